@@ -1,8 +1,21 @@
 #include "atomic.h"
 
+#if defined(_WIN32)
+
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
+// Interlocked functions are full barriers, which serves every order.
+//
+// On x86 and x64, aligned loads already acquire and aligned stores already
+// release; only the compiler must be kept from moving accesses across them.
+// Other processors get a full hardware barrier instead.
+#if defined(_M_IX86) || defined(_M_X64)
+#define atomic_acquire_release_barrier() _ReadWriteBarrier()
+#else
+#define atomic_acquire_release_barrier() MemoryBarrier()
+#endif
+
 int atomic_increment(int* address)
 {
 	return InterlockedIncrement(address) - 1;
@@ -20,10 +33,547 @@ int atomic_compare_and_exchange(int* dest, int compare, int exchange)
 
 int atomic_load(int* address)
 {
-	return *(volatile int*)address;
+	return atomic_load_explicit(address, k_atomic_order_acquire);
 }
 
 void atomic_store(int* address, int value)
 {
-	*(volatile int*)address = value;
+	atomic_store_explicit(address, value, k_atomic_order_release);
+}
+
+int atomic_exchange(int* address, int exchange)
+{
+	return InterlockedExchange(address, exchange);
+}
+
+int atomic_fetch_add(int* address, int value)
+{
+	return InterlockedExchangeAdd(address, value);
+}
+
+int atomic_fetch_or(int* address, int value)
+{
+	return InterlockedOr(address, value);
+}
+
+int64_t atomic_compare_and_exchange64(int64_t* dest, int64_t compare, int64_t exchange)
+{
+	return InterlockedCompareExchange64(dest, exchange, compare);
+}
+
+int64_t atomic_load64(int64_t* address)
+{
+	return atomic_load64_explicit(address, k_atomic_order_acquire);
+}
+
+void atomic_store64(int64_t* address, int64_t value)
+{
+	InterlockedExchange64(address, value);
+}
+
+int64_t atomic_exchange64(int64_t* address, int64_t exchange)
+{
+	return InterlockedExchange64(address, exchange);
+}
+
+int64_t atomic_fetch_add64(int64_t* address, int64_t value)
+{
+	return InterlockedExchangeAdd64(address, value);
+}
+
+int64_t atomic_fetch_or64(int64_t* address, int64_t value)
+{
+	return InterlockedOr64(address, value);
+}
+
+void* atomic_compare_and_exchange_pointer(void** dest, void* compare, void* exchange)
+{
+	return InterlockedCompareExchangePointer(dest, exchange, compare);
+}
+
+void* atomic_exchange_pointer(void** address, void* exchange)
+{
+	return InterlockedExchangePointer(address, exchange);
+}
+
+void* atomic_load_pointer(void** address)
+{
+	return atomic_load_pointer_explicit(address, k_atomic_order_acquire);
+}
+
+void atomic_store_pointer(void** address, void* value)
+{
+	atomic_store_pointer_explicit(address, value, k_atomic_order_release);
+}
+
+#if defined(_WIN64)
+
+void* atomic_fetch_add_pointer(void** address, intptr_t value)
+{
+	return (void*)InterlockedExchangeAdd64((LONG64*)address, value);
+}
+
+void* atomic_fetch_or_pointer(void** address, uintptr_t value)
+{
+	return (void*)InterlockedOr64((LONG64*)address, (LONG64)value);
+}
+
+#else
+
+void* atomic_fetch_add_pointer(void** address, intptr_t value)
+{
+	return (void*)(intptr_t)InterlockedExchangeAdd((LONG*)address, (LONG)value);
+}
+
+void* atomic_fetch_or_pointer(void** address, uintptr_t value)
+{
+	return (void*)(intptr_t)InterlockedOr((LONG*)address, (LONG)value);
+}
+
+#endif
+
+int atomic_load_explicit(int* address, atomic_order_t order)
+{
+	int value = *(volatile int*)address;
+	if (order != k_atomic_order_relaxed)
+	{
+		atomic_acquire_release_barrier();
+	}
+	return value;
+}
+
+void atomic_store_explicit(int* address, int value, atomic_order_t order)
+{
+	if (order == k_atomic_order_relaxed)
+	{
+		*(volatile int*)address = value;
+	}
+	else if (order == k_atomic_order_release)
+	{
+		atomic_acquire_release_barrier();
+		*(volatile int*)address = value;
+	}
+	else
+	{
+		InterlockedExchange(address, value);
+	}
+}
+
+int atomic_exchange_explicit(int* address, int exchange, atomic_order_t order)
+{
+	(void)order;
+	return InterlockedExchange(address, exchange);
+}
+
+int atomic_compare_and_exchange_explicit(int* dest, int compare, int exchange, atomic_order_t order)
+{
+	(void)order;
+	return InterlockedCompareExchange(dest, exchange, compare);
+}
+
+int atomic_fetch_add_explicit(int* address, int value, atomic_order_t order)
+{
+	(void)order;
+	return InterlockedExchangeAdd(address, value);
+}
+
+int atomic_fetch_or_explicit(int* address, int value, atomic_order_t order)
+{
+	(void)order;
+	return InterlockedOr(address, value);
+}
+
+int64_t atomic_load64_explicit(int64_t* address, atomic_order_t order)
+{
+	int64_t value = *(volatile int64_t*)address;
+	if (order != k_atomic_order_relaxed)
+	{
+		atomic_acquire_release_barrier();
+	}
+	return value;
+}
+
+void atomic_store64_explicit(int64_t* address, int64_t value, atomic_order_t order)
+{
+	if (order == k_atomic_order_relaxed)
+	{
+		*(volatile int64_t*)address = value;
+	}
+	else if (order == k_atomic_order_release)
+	{
+		atomic_acquire_release_barrier();
+		*(volatile int64_t*)address = value;
+	}
+	else
+	{
+		InterlockedExchange64(address, value);
+	}
+}
+
+int64_t atomic_exchange64_explicit(int64_t* address, int64_t exchange, atomic_order_t order)
+{
+	(void)order;
+	return InterlockedExchange64(address, exchange);
+}
+
+int64_t atomic_compare_and_exchange64_explicit(int64_t* dest, int64_t compare, int64_t exchange, atomic_order_t order)
+{
+	(void)order;
+	return InterlockedCompareExchange64(dest, exchange, compare);
 }
+
+int64_t atomic_fetch_add64_explicit(int64_t* address, int64_t value, atomic_order_t order)
+{
+	(void)order;
+	return InterlockedExchangeAdd64(address, value);
+}
+
+int64_t atomic_fetch_or64_explicit(int64_t* address, int64_t value, atomic_order_t order)
+{
+	(void)order;
+	return InterlockedOr64(address, value);
+}
+
+void* atomic_load_pointer_explicit(void** address, atomic_order_t order)
+{
+	void* value = *(void* volatile*)address;
+	if (order != k_atomic_order_relaxed)
+	{
+		atomic_acquire_release_barrier();
+	}
+	return value;
+}
+
+void atomic_store_pointer_explicit(void** address, void* value, atomic_order_t order)
+{
+	if (order == k_atomic_order_relaxed)
+	{
+		*(void* volatile*)address = value;
+	}
+	else if (order == k_atomic_order_release)
+	{
+		atomic_acquire_release_barrier();
+		*(void* volatile*)address = value;
+	}
+	else
+	{
+		InterlockedExchangePointer(address, value);
+	}
+}
+
+void* atomic_exchange_pointer_explicit(void** address, void* exchange, atomic_order_t order)
+{
+	(void)order;
+	return InterlockedExchangePointer(address, exchange);
+}
+
+void* atomic_compare_and_exchange_pointer_explicit(void** dest, void* compare, void* exchange, atomic_order_t order)
+{
+	(void)order;
+	return InterlockedCompareExchangePointer(dest, exchange, compare);
+}
+
+void atomic_fence(atomic_order_t order)
+{
+	if (order == k_atomic_order_seq_cst)
+	{
+		MemoryBarrier();
+	}
+	else if (order != k_atomic_order_relaxed)
+	{
+		atomic_acquire_release_barrier();
+	}
+}
+
+void atomic_fence_light(void)
+{
+	_ReadWriteBarrier();
+}
+
+void atomic_fence_heavy(void)
+{
+	FlushProcessWriteBuffers();
+}
+
+void atomic_pause(void)
+{
+	YieldProcessor();
+}
+
+#else
+
+#include <linux/membarrier.h>
+#include <stdbool.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// GCC and Clang builtins. Read-modify-write operations are full barriers,
+// as the Interlocked functions are.
+//
+// The builtins only honor a memory order that is a compile-time constant,
+// so the _explicit functions switch on the order and give each case its
+// own call. A load cannot release and a store cannot acquire; those fall
+// through to seq_cst.
+
+#define ATOMIC_LOAD_ORDERS(order, op) \
+	switch (order) \
+	{ \
+	case k_atomic_order_relaxed: return op(__ATOMIC_RELAXED); \
+	case k_atomic_order_acquire: return op(__ATOMIC_ACQUIRE); \
+	default: return op(__ATOMIC_SEQ_CST); \
+	}
+
+#define ATOMIC_STORE_ORDERS(order, op) \
+	switch (order) \
+	{ \
+	case k_atomic_order_relaxed: op(__ATOMIC_RELAXED); break; \
+	case k_atomic_order_release: op(__ATOMIC_RELEASE); break; \
+	default: op(__ATOMIC_SEQ_CST); break; \
+	}
+
+#define ATOMIC_RMW_ORDERS(order, op) \
+	switch (order) \
+	{ \
+	case k_atomic_order_relaxed: return op(__ATOMIC_RELAXED); \
+	case k_atomic_order_acquire: return op(__ATOMIC_ACQUIRE); \
+	case k_atomic_order_release: return op(__ATOMIC_RELEASE); \
+	case k_atomic_order_acq_rel: return op(__ATOMIC_ACQ_REL); \
+	default: return op(__ATOMIC_SEQ_CST); \
+	}
+
+// A failed compare-and-exchange only loads, so it cannot release.
+#define ATOMIC_FAILURE_ORDER(order) \
+	((order) == __ATOMIC_RELEASE ? __ATOMIC_RELAXED : (order) == __ATOMIC_ACQ_REL ? __ATOMIC_ACQUIRE : (order))
+
+#define ATOMIC_LOAD(order) __atomic_load_n(address, order)
+#define ATOMIC_STORE(order) __atomic_store_n(address, value, order)
+#define ATOMIC_EXCHANGE(order) __atomic_exchange_n(address, exchange, order)
+#define ATOMIC_COMPARE_AND_EXCHANGE(order) \
+	(__atomic_compare_exchange_n(dest, &compare, exchange, false, order, ATOMIC_FAILURE_ORDER(order)), compare)
+#define ATOMIC_FETCH_ADD(order) __atomic_fetch_add(address, value, order)
+#define ATOMIC_FETCH_OR(order) __atomic_fetch_or(address, value, order)
+
+int atomic_increment(int* address)
+{
+	return __atomic_fetch_add(address, 1, __ATOMIC_SEQ_CST);
+}
+
+int atomic_decrement(int* address)
+{
+	return __atomic_fetch_sub(address, 1, __ATOMIC_SEQ_CST);
+}
+
+int atomic_compare_and_exchange(int* dest, int compare, int exchange)
+{
+	return atomic_compare_and_exchange_explicit(dest, compare, exchange, k_atomic_order_seq_cst);
+}
+
+int atomic_load(int* address)
+{
+	return __atomic_load_n(address, __ATOMIC_ACQUIRE);
+}
+
+void atomic_store(int* address, int value)
+{
+	__atomic_store_n(address, value, __ATOMIC_RELEASE);
+}
+
+int atomic_exchange(int* address, int exchange)
+{
+	return __atomic_exchange_n(address, exchange, __ATOMIC_SEQ_CST);
+}
+
+int atomic_fetch_add(int* address, int value)
+{
+	return __atomic_fetch_add(address, value, __ATOMIC_SEQ_CST);
+}
+
+int atomic_fetch_or(int* address, int value)
+{
+	return __atomic_fetch_or(address, value, __ATOMIC_SEQ_CST);
+}
+
+int64_t atomic_compare_and_exchange64(int64_t* dest, int64_t compare, int64_t exchange)
+{
+	return atomic_compare_and_exchange64_explicit(dest, compare, exchange, k_atomic_order_seq_cst);
+}
+
+int64_t atomic_load64(int64_t* address)
+{
+	return __atomic_load_n(address, __ATOMIC_ACQUIRE);
+}
+
+void atomic_store64(int64_t* address, int64_t value)
+{
+	__atomic_store_n(address, value, __ATOMIC_SEQ_CST);
+}
+
+int64_t atomic_exchange64(int64_t* address, int64_t exchange)
+{
+	return __atomic_exchange_n(address, exchange, __ATOMIC_SEQ_CST);
+}
+
+int64_t atomic_fetch_add64(int64_t* address, int64_t value)
+{
+	return __atomic_fetch_add(address, value, __ATOMIC_SEQ_CST);
+}
+
+int64_t atomic_fetch_or64(int64_t* address, int64_t value)
+{
+	return __atomic_fetch_or(address, value, __ATOMIC_SEQ_CST);
+}
+
+void* atomic_compare_and_exchange_pointer(void** dest, void* compare, void* exchange)
+{
+	return atomic_compare_and_exchange_pointer_explicit(dest, compare, exchange, k_atomic_order_seq_cst);
+}
+
+void* atomic_exchange_pointer(void** address, void* exchange)
+{
+	return __atomic_exchange_n(address, exchange, __ATOMIC_SEQ_CST);
+}
+
+void* atomic_load_pointer(void** address)
+{
+	return __atomic_load_n(address, __ATOMIC_ACQUIRE);
+}
+
+void atomic_store_pointer(void** address, void* value)
+{
+	__atomic_store_n(address, value, __ATOMIC_RELEASE);
+}
+
+void* atomic_fetch_add_pointer(void** address, intptr_t value)
+{
+	return (void*)__atomic_fetch_add((intptr_t*)address, value, __ATOMIC_SEQ_CST);
+}
+
+void* atomic_fetch_or_pointer(void** address, uintptr_t value)
+{
+	return (void*)__atomic_fetch_or((uintptr_t*)address, value, __ATOMIC_SEQ_CST);
+}
+
+int atomic_load_explicit(int* address, atomic_order_t order)
+{
+	ATOMIC_LOAD_ORDERS(order, ATOMIC_LOAD);
+}
+
+void atomic_store_explicit(int* address, int value, atomic_order_t order)
+{
+	ATOMIC_STORE_ORDERS(order, ATOMIC_STORE);
+}
+
+int atomic_exchange_explicit(int* address, int exchange, atomic_order_t order)
+{
+	ATOMIC_RMW_ORDERS(order, ATOMIC_EXCHANGE);
+}
+
+int atomic_compare_and_exchange_explicit(int* dest, int compare, int exchange, atomic_order_t order)
+{
+	ATOMIC_RMW_ORDERS(order, ATOMIC_COMPARE_AND_EXCHANGE);
+}
+
+int atomic_fetch_add_explicit(int* address, int value, atomic_order_t order)
+{
+	ATOMIC_RMW_ORDERS(order, ATOMIC_FETCH_ADD);
+}
+
+int atomic_fetch_or_explicit(int* address, int value, atomic_order_t order)
+{
+	ATOMIC_RMW_ORDERS(order, ATOMIC_FETCH_OR);
+}
+
+int64_t atomic_load64_explicit(int64_t* address, atomic_order_t order)
+{
+	ATOMIC_LOAD_ORDERS(order, ATOMIC_LOAD);
+}
+
+void atomic_store64_explicit(int64_t* address, int64_t value, atomic_order_t order)
+{
+	ATOMIC_STORE_ORDERS(order, ATOMIC_STORE);
+}
+
+int64_t atomic_exchange64_explicit(int64_t* address, int64_t exchange, atomic_order_t order)
+{
+	ATOMIC_RMW_ORDERS(order, ATOMIC_EXCHANGE);
+}
+
+int64_t atomic_compare_and_exchange64_explicit(int64_t* dest, int64_t compare, int64_t exchange, atomic_order_t order)
+{
+	ATOMIC_RMW_ORDERS(order, ATOMIC_COMPARE_AND_EXCHANGE);
+}
+
+int64_t atomic_fetch_add64_explicit(int64_t* address, int64_t value, atomic_order_t order)
+{
+	ATOMIC_RMW_ORDERS(order, ATOMIC_FETCH_ADD);
+}
+
+int64_t atomic_fetch_or64_explicit(int64_t* address, int64_t value, atomic_order_t order)
+{
+	ATOMIC_RMW_ORDERS(order, ATOMIC_FETCH_OR);
+}
+
+void* atomic_load_pointer_explicit(void** address, atomic_order_t order)
+{
+	ATOMIC_LOAD_ORDERS(order, ATOMIC_LOAD);
+}
+
+void atomic_store_pointer_explicit(void** address, void* value, atomic_order_t order)
+{
+	ATOMIC_STORE_ORDERS(order, ATOMIC_STORE);
+}
+
+void* atomic_exchange_pointer_explicit(void** address, void* exchange, atomic_order_t order)
+{
+	ATOMIC_RMW_ORDERS(order, ATOMIC_EXCHANGE);
+}
+
+void* atomic_compare_and_exchange_pointer_explicit(void** dest, void* compare, void* exchange, atomic_order_t order)
+{
+	ATOMIC_RMW_ORDERS(order, ATOMIC_COMPARE_AND_EXCHANGE);
+}
+
+void atomic_fence(atomic_order_t order)
+{
+	switch (order)
+	{
+	case k_atomic_order_relaxed: break;
+	case k_atomic_order_acquire: __atomic_thread_fence(__ATOMIC_ACQUIRE); break;
+	case k_atomic_order_release: __atomic_thread_fence(__ATOMIC_RELEASE); break;
+	case k_atomic_order_acq_rel: __atomic_thread_fence(__ATOMIC_ACQ_REL); break;
+	default: __atomic_thread_fence(__ATOMIC_SEQ_CST); break;
+	}
+}
+
+void atomic_fence_light(void)
+{
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+void atomic_fence_heavy(void)
+{
+	// The expedited barrier needs the process to register once; until it
+	// has, the call fails and registers. Kernels without it get the slow,
+	// global barrier.
+	if (syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0) == 0)
+	{
+		return;
+	}
+	if (syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) == 0 &&
+		syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0) == 0)
+	{
+		return;
+	}
+	syscall(SYS_membarrier, MEMBARRIER_CMD_GLOBAL, 0, 0);
+}
+
+void atomic_pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+#endif
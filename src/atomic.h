@@ -1,6 +1,28 @@
 #pragma once
 
-// Atomic operations on 32-bit integers.
+#include <stdint.h>
+
+// Atomic operations on 32-bit integers, 64-bit integers and pointers.
+//
+// The plain functions keep their long-standing orderings: read-modify-write
+// operations are full barriers, loads acquire and stores release, except
+// atomic_store64, which is a full barrier. The _explicit functions take the
+// ordering as an argument, following the C11 memory model.
+
+// Memory ordering of an atomic operation, weakest first.
+typedef enum atomic_order_t
+{
+	// Atomic, but orders nothing else.
+	k_atomic_order_relaxed,
+	// No later reads or writes move before it. For loads and read-modify-writes.
+	k_atomic_order_acquire,
+	// No earlier reads or writes move after it. For stores and read-modify-writes.
+	k_atomic_order_release,
+	// Both acquire and release. For read-modify-writes.
+	k_atomic_order_acq_rel,
+	// Acquire and release, plus a single total order of all seq_cst operations.
+	k_atomic_order_seq_cst,
+} atomic_order_t;
 
 // Increment a number atomically.
 // Returns the old value of the number.
@@ -27,3 +49,114 @@ int atomic_load(int* address);
 // Writes an integer.
 // Paired with an atomic_load, can guarantee ordering and visibility.
 void atomic_store(int* address, int value);
+
+// Assign a number atomically.
+// Returns the old value of the number.
+int atomic_exchange(int* address, int exchange);
+
+// Add to a number atomically.
+// Returns the old value of the number.
+int atomic_fetch_add(int* address, int value);
+
+// Bitwise-or a number atomically.
+// Returns the old value of the number.
+int atomic_fetch_or(int* address, int value);
+
+// Compare two 64-bit numbers atomically and assign if equal.
+// Returns the old value of the number.
+// Performs the following operation atomically:
+//   int64_t old_value = *address; if (*address == compare) *address = exchange; return old_value;
+int64_t atomic_compare_and_exchange64(int64_t* dest, int64_t compare, int64_t exchange);
+
+// Reads a 64-bit integer from an address.
+// The address must be 8-byte aligned so the read is not torn.
+int64_t atomic_load64(int64_t* address);
+
+// Writes a 64-bit integer.
+// A full barrier: later loads are not reordered before the write.
+void atomic_store64(int64_t* address, int64_t value);
+
+// Assign a 64-bit number atomically.
+// Returns the old value of the number.
+int64_t atomic_exchange64(int64_t* address, int64_t exchange);
+
+// Add to a 64-bit number atomically.
+// Returns the old value of the number.
+int64_t atomic_fetch_add64(int64_t* address, int64_t value);
+
+// Bitwise-or a 64-bit number atomically.
+// Returns the old value of the number.
+int64_t atomic_fetch_or64(int64_t* address, int64_t value);
+
+// Compare two pointers atomically and assign if equal.
+// Returns the old value of the pointer.
+// Performs the following operation atomically:
+//   void* old_value = *address; if (*address == compare) *address = exchange; return old_value;
+void* atomic_compare_and_exchange_pointer(void** dest, void* compare, void* exchange);
+
+// Assign a pointer atomically.
+// Returns the old value of the pointer.
+// Performs the following operation atomically:
+//   void* old_value = *address; *address = exchange; return old_value;
+void* atomic_exchange_pointer(void** address, void* exchange);
+
+// Reads a pointer from an address.
+// All writes that occurred before the last atomic exchange to this address are flushed.
+void* atomic_load_pointer(void** address);
+
+// Writes a pointer.
+// Paired with an atomic_load_pointer, can guarantee ordering and visibility.
+void atomic_store_pointer(void** address, void* value);
+
+// Add to the address held in a pointer atomically, in bytes.
+// Returns the old value of the pointer.
+void* atomic_fetch_add_pointer(void** address, intptr_t value);
+
+// Bitwise-or the address held in a pointer atomically, as for tag bits
+// kept in its low bits. Returns the old value of the pointer.
+void* atomic_fetch_or_pointer(void** address, uintptr_t value);
+
+// Explicitly ordered versions of the operations above.
+// Loads take relaxed, acquire or seq_cst; stores take relaxed, release or
+// seq_cst. Any other order is treated as seq_cst. A compare-and-exchange
+// that fails orders like a load with the given order.
+int atomic_load_explicit(int* address, atomic_order_t order);
+void atomic_store_explicit(int* address, int value, atomic_order_t order);
+int atomic_exchange_explicit(int* address, int exchange, atomic_order_t order);
+int atomic_compare_and_exchange_explicit(int* dest, int compare, int exchange, atomic_order_t order);
+int atomic_fetch_add_explicit(int* address, int value, atomic_order_t order);
+int atomic_fetch_or_explicit(int* address, int value, atomic_order_t order);
+
+int64_t atomic_load64_explicit(int64_t* address, atomic_order_t order);
+void atomic_store64_explicit(int64_t* address, int64_t value, atomic_order_t order);
+int64_t atomic_exchange64_explicit(int64_t* address, int64_t exchange, atomic_order_t order);
+int64_t atomic_compare_and_exchange64_explicit(int64_t* dest, int64_t compare, int64_t exchange, atomic_order_t order);
+int64_t atomic_fetch_add64_explicit(int64_t* address, int64_t value, atomic_order_t order);
+int64_t atomic_fetch_or64_explicit(int64_t* address, int64_t value, atomic_order_t order);
+
+void* atomic_load_pointer_explicit(void** address, atomic_order_t order);
+void atomic_store_pointer_explicit(void** address, void* value, atomic_order_t order);
+void* atomic_exchange_pointer_explicit(void** address, void* exchange, atomic_order_t order);
+void* atomic_compare_and_exchange_pointer_explicit(void** dest, void* compare, void* exchange, atomic_order_t order);
+
+// Order memory accesses around this point without touching memory.
+// A seq_cst fence between a store and a later load keeps them in order,
+// which acquire and release alone do not.
+void atomic_fence(atomic_order_t order);
+
+// An asymmetric pair of fences, for a store-then-load handshake where one
+// side runs often and the other rarely, such as publishing an index and
+// then checking whether the other thread sleeps. Between a store and a
+// later load, atomic_fence_light on the frequent side and
+// atomic_fence_heavy on the rare side keep the two threads from both
+// missing each other's store, as seq_cst fences on both sides would.
+// The light fence only stops the compiler from reordering. The heavy
+// fence is a system call that puts a full barrier on every running
+// thread of the process: FlushProcessWriteBuffers on Windows, membarrier
+// on Linux.
+void atomic_fence_light(void);
+void atomic_fence_heavy(void);
+
+// Tell the CPU the caller is spinning, to save power and give a sibling
+// hyperthread the core. Call once per iteration of a spin-wait loop.
+void atomic_pause(void);
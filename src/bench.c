@@ -0,0 +1,340 @@
+#include "bench.h"
+
+#include "debug.h"
+#include "event.h"
+#include "heap.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum
+{
+	k_bench_max_threads = 64,
+	k_bench_max_results = 512,
+	k_bench_max_repeat = 100,
+	// Operations timed together as one latency sample. Timing each one
+	// alone would cost more than the cheapest operations measured.
+	k_bench_chunk_ops = 64,
+	k_bench_default_warmup = 1,
+	k_bench_default_repeat = 5,
+	k_bench_quick_repeat = 3,
+};
+
+typedef struct bench_result_t
+{
+	const char* scenario;
+	int threads;
+	int repetitions;
+	// Operations in one repetition, over every thread.
+	uint64_t ops;
+	// Medians over the repetitions and the latency samples.
+	uint64_t ops_per_second;
+	uint64_t median_ns;
+	uint64_t p99_ns;
+	bool ok;
+} bench_result_t;
+
+typedef struct bench_t
+{
+	heap_t* heap;
+	const char* suite;
+	int max_threads;
+	bool quick;
+	int warmup;
+	int repeat;
+	const char* scenario_filter;
+	int result_count;
+	bench_result_t results[k_bench_max_results];
+} bench_t;
+
+typedef struct bench_thread_t
+{
+	const bench_scenario_t* scenario;
+	void* state;
+	event_t* start;
+	int index;
+	int ops;
+	uint64_t start_ticks;
+	uint64_t end_ticks;
+	// Per-operation time of each chunk in nanoseconds, or NULL during warmup.
+	uint32_t* samples;
+	int sample_count;
+} bench_thread_t;
+
+static uint64_t bench_ticks_to_ns(uint64_t ticks)
+{
+	return (uint64_t)((double)ticks * 1000000000.0 / (double)timer_get_ticks_per_second());
+}
+
+static int compare_u32(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static int bench_thread_func(void* user)
+{
+	bench_thread_t* thread = user;
+	event_wait(thread->start);
+
+	thread->start_ticks = timer_get_ticks();
+	uint64_t chunk_start = thread->start_ticks;
+	for (int done = 0; done < thread->ops; )
+	{
+		int count = __min(k_bench_chunk_ops, thread->ops - done);
+		thread->scenario->run(thread->state, thread->index, count);
+		uint64_t now = timer_get_ticks();
+		if (thread->samples)
+		{
+			thread->samples[thread->sample_count++] = (uint32_t)(bench_ticks_to_ns(now - chunk_start) / count);
+		}
+		chunk_start = now;
+		done += count;
+	}
+	thread->end_ticks = chunk_start;
+	return 0;
+}
+
+// Run one repetition. Appends its latency samples, if samples is not NULL.
+// Returns false if the scenario's check fails.
+static bool bench_repetition(bench_t* bench, const bench_scenario_t* scenario, int thread_count, int ops,
+	uint32_t* samples, int* sample_count, uint64_t* ops_per_second)
+{
+	void* state = scenario->setup(bench->heap, thread_count);
+	event_t* start = event_create();
+	int chunks = (ops + k_bench_chunk_ops - 1) / k_bench_chunk_ops;
+	bench_thread_t workers[k_bench_max_threads];
+	thread_t* threads[k_bench_max_threads];
+	for (int i = 0; i < thread_count; ++i)
+	{
+		workers[i] = (bench_thread_t)
+		{
+			.scenario = scenario,
+			.state = state,
+			.start = start,
+			.index = i,
+			.ops = ops,
+			.samples = samples ? samples + *sample_count + (size_t)chunks * i : NULL,
+		};
+		threads[i] = thread_create(bench_thread_func, &workers[i]);
+	}
+
+	// Go!
+	event_signal(start);
+
+	// Throughput is over the wall time from the first thread starting to
+	// the last finishing, so threads that ran one after another on a busy
+	// machine do not count as parallel.
+	uint64_t start_ticks = UINT64_MAX;
+	uint64_t end_ticks = 0;
+	for (int i = 0; i < thread_count; ++i)
+	{
+		thread_destroy(threads[i]);
+		start_ticks = __min(start_ticks, workers[i].start_ticks);
+		end_ticks = __max(end_ticks, workers[i].end_ticks);
+	}
+	if (samples)
+	{
+		// Every thread fills exactly its own stretch of chunks.
+		*sample_count += chunks * thread_count;
+	}
+
+	bool ok = scenario->check ? scenario->check(state, thread_count, ops) : true;
+	scenario->teardown(bench->heap, state);
+	event_destroy(start);
+
+	uint64_t total_ops = (uint64_t)ops * thread_count;
+	*ops_per_second = (uint64_t)((double)total_ops * (double)timer_get_ticks_per_second() / (double)__max(end_ticks - start_ticks, 1));
+	return ok;
+}
+
+static void bench_print_result(const bench_t* bench, const bench_result_t* result)
+{
+	debug_print(k_print_warning, "%-6s %-22s threads=%-2d ops/s=%-11llu median=%lluns p99=%lluns %s\n",
+		bench->suite, result->scenario, result->threads,
+		(unsigned long long)result->ops_per_second,
+		(unsigned long long)result->median_ns, (unsigned long long)result->p99_ns,
+		result->ok ? "ok" : "CHECK FAILED");
+}
+
+static bool bench_run(bench_t* bench, const bench_scenario_t* scenario, int thread_count)
+{
+	int ops = bench->quick ? __max(scenario->ops_per_thread / 10, 1) : scenario->ops_per_thread;
+	int chunks = (ops + k_bench_chunk_ops - 1) / k_bench_chunk_ops;
+	uint32_t* samples = heap_alloc(bench->heap, sizeof(uint32_t) * chunks * thread_count * bench->repeat, 8);
+	int sample_count = 0;
+	uint64_t rates[k_bench_max_repeat];
+	bool ok = true;
+	for (int i = 0; i < bench->warmup + bench->repeat; ++i)
+	{
+		bool measured = i >= bench->warmup;
+		uint64_t rate = 0;
+		ok = bench_repetition(bench, scenario, thread_count, ops, measured ? samples : NULL, &sample_count, &rate) && ok;
+		if (measured)
+		{
+			rates[i - bench->warmup] = rate;
+		}
+	}
+	qsort(rates, bench->repeat, sizeof(uint64_t), compare_u64);
+	qsort(samples, sample_count, sizeof(uint32_t), compare_u32);
+
+	if (bench->result_count == k_bench_max_results)
+	{
+		debug_print(k_print_warning, "Too many benchmark results; dropping the rest.\n");
+	}
+	else
+	{
+		bench_result_t* result = &bench->results[bench->result_count++];
+		*result = (bench_result_t)
+		{
+			.scenario = scenario->name,
+			.threads = thread_count,
+			.repetitions = bench->repeat,
+			.ops = (uint64_t)ops * thread_count,
+			.ops_per_second = rates[bench->repeat / 2],
+			.median_ns = sample_count > 0 ? samples[sample_count / 2] : 0,
+			.p99_ns = sample_count > 0 ? samples[(size_t)sample_count * 99 / 100] : 0,
+			.ok = ok,
+		};
+		bench_print_result(bench, result);
+	}
+	heap_free(bench->heap, samples);
+	return ok;
+}
+
+static void bench_write_json(bench_t* bench, FILE* file)
+{
+	fprintf(file, "{\n\t\"suite\": \"%s\",\n\t\"results\": [\n", bench->suite);
+	for (int i = 0; i < bench->result_count; ++i)
+	{
+		const bench_result_t* result = &bench->results[i];
+		fprintf(file,
+			"\t\t{\"scenario\": \"%s\", \"threads\": %d, \"repetitions\": %d, \"ops\": %llu, "
+			"\"ops_per_second\": %llu, \"latency_ns\": {\"median\": %llu, \"p99\": %llu}, \"ok\": %s}%s\n",
+			result->scenario, result->threads, result->repetitions, (unsigned long long)result->ops,
+			(unsigned long long)result->ops_per_second,
+			(unsigned long long)result->median_ns, (unsigned long long)result->p99_ns,
+			result->ok ? "true" : "false",
+			i + 1 < bench->result_count ? "," : "");
+	}
+	fprintf(file, "\t]\n}\n");
+}
+
+int bench_main(const char* suite, const bench_scenario_t* scenarios, int scenario_count, int argc, const char** argv)
+{
+	heap_t* heap = heap_create(1024 * 1024);
+	bench_t* bench = heap_alloc(heap, sizeof(bench_t), 8);
+	bench->heap = heap;
+	bench->suite = suite;
+	bench->max_threads = __min(thread_get_core_count(), k_bench_max_threads);
+	bench->quick = false;
+	bench->warmup = k_bench_default_warmup;
+	bench->repeat = -1;
+	bench->scenario_filter = NULL;
+	bench->result_count = 0;
+	const char* json_path = NULL;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+		{
+			int threads = atoi(argv[++i]);
+			bench->max_threads = __max(__min(threads, k_bench_max_threads), 1);
+		}
+		else if (strcmp(argv[i], "--scenario") == 0 && i + 1 < argc)
+		{
+			bench->scenario_filter = argv[++i];
+		}
+		else if (strcmp(argv[i], "--warmup") == 0 && i + 1 < argc)
+		{
+			int warmup = atoi(argv[++i]);
+			bench->warmup = __max(warmup, 0);
+		}
+		else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc)
+		{
+			int repeat = atoi(argv[++i]);
+			bench->repeat = __max(__min(repeat, k_bench_max_repeat), 1);
+		}
+		else if (strcmp(argv[i], "--quick") == 0)
+		{
+			bench->quick = true;
+		}
+		else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+		{
+			json_path = argv[++i];
+		}
+		else
+		{
+			debug_print(k_print_error, "Unknown option: %s\n", argv[i]);
+			heap_free(heap, bench);
+			heap_destroy(heap);
+			return 1;
+		}
+	}
+	if (bench->repeat < 0)
+	{
+		bench->repeat = bench->quick ? k_bench_quick_repeat : k_bench_default_repeat;
+	}
+
+	bool ok = true;
+	for (int s = 0; s < scenario_count; ++s)
+	{
+		const bench_scenario_t* scenario = &scenarios[s];
+		if (bench->scenario_filter && strcmp(bench->scenario_filter, scenario->name) != 0)
+		{
+			continue;
+		}
+
+		int multiple = __max(scenario->thread_multiple, 1);
+		int last_thread_count = 0;
+		// 1, 2, 4, ... threads, always ending with the maximum.
+		for (int threads = 1; ; threads = __min(threads * 2, bench->max_threads))
+		{
+			int thread_count = __min((threads + multiple - 1) / multiple * multiple, k_bench_max_threads);
+			if (thread_count != last_thread_count)
+			{
+				ok = bench_run(bench, scenario, thread_count) && ok;
+				last_thread_count = thread_count;
+			}
+			if (threads == bench->max_threads)
+			{
+				break;
+			}
+		}
+	}
+
+	int status = ok ? 0 : 1;
+	if (json_path)
+	{
+		FILE* file = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "w");
+		if (file)
+		{
+			bench_write_json(bench, file);
+			if (file != stdout)
+			{
+				fclose(file);
+			}
+		}
+		else
+		{
+			debug_print(k_print_error, "Unable to write %s\n", json_path);
+			status = 1;
+		}
+	}
+
+	heap_free(heap, bench);
+	heap_destroy(heap);
+	return status;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Multithreaded microbenchmark harness.
+//
+// A suite is a table of scenarios. Each scenario is run for a sweep of
+// thread counts, 1, 2, 4, ... up to the core count. Each thread count gets
+// warmup repetitions, whose results are dropped, and then measured
+// repetitions. Within a repetition, every thread runs the scenario's
+// operations in chunks and times each chunk, giving per-operation latency
+// samples. The harness reports, per scenario and thread count, the median
+// throughput over the repetitions and the median and p99 latency over
+// every chunk. Results are printed with debug_print and optionally written
+// as JSON.
+
+typedef struct heap_t heap_t;
+
+typedef struct bench_scenario_t
+{
+	const char* name;
+	// Operations each thread runs per repetition.
+	int ops_per_thread;
+	// Thread counts are rounded up to a multiple of this; 2 for scenarios
+	// that pair producer and consumer threads. Zero means 1.
+	int thread_multiple;
+	// Create the state shared by the threads of one repetition.
+	void* (*setup)(heap_t* heap, int thread_count);
+	// Run count operations on thread thread_index. Called repeatedly during
+	// a repetition; threads that work in pairs get matching counts.
+	void (*run)(void* state, int thread_index, int count);
+	// Optional. Return false if the repetition computed a wrong result.
+	bool (*check)(void* state, int thread_count, int ops_per_thread);
+	// Free the state returned by setup.
+	void (*teardown)(heap_t* heap, void* state);
+} bench_scenario_t;
+
+// Run a suite of scenarios. Accepts these options:
+//   --threads N      largest thread count in the sweep (default: core count)
+//   --scenario NAME  run only one scenario
+//   --warmup N       warmup repetitions per run (default: 1)
+//   --repeat N       measured repetitions per run (default: 5)
+//   --quick          a tenth of the operations and fewer repetitions
+//   --json PATH      write the results as JSON to PATH, or - for stdout
+// Returns zero on success, nonzero on a bad option or a failed check.
+int bench_main(const char* suite, const bench_scenario_t* scenarios, int scenario_count, int argc, const char** argv);
@@ -2,13 +2,21 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
+
+static uint32_t s_mask = 0xffffffff;
+
+void debug_set_print_mask(uint32_t mask)
+{
+	s_mask = mask;
+}
+
+#if defined(_WIN32)
 
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 #include <DbgHelp.h>
 
-static uint32_t s_mask = 0xffffffff;
-
 static LONG debug_exception_handler(LPEXCEPTION_POINTERS info)
 {
 	// XXX: MS uses 0xE06D7363 to indicate C++ language exception.
@@ -48,11 +56,6 @@ void debug_install_exception_handler()
 	AddVectoredExceptionHandler(TRUE, debug_exception_handler);
 }
 
-void debug_set_print_mask(uint32_t mask)
-{
-	s_mask = mask;
-}
-
 void debug_print(uint32_t type, _Printf_format_string_ const char* format, ...)
 {
 	if ((s_mask & type) == 0)
@@ -78,3 +81,40 @@ int debug_backtrace(void** stack, int stack_capacity)
 {
 	return CaptureStackBackTrace(1, stack_capacity, stack, NULL);
 }
+
+#else
+
+#include <execinfo.h>
+
+void debug_install_exception_handler()
+{
+	// Crash dumps are Windows-only; rely on core dumps elsewhere.
+}
+
+void debug_print(uint32_t type, _Printf_format_string_ const char* format, ...)
+{
+	if ((s_mask & type) == 0)
+	{
+		return;
+	}
+
+	va_list args;
+	va_start(args, format);
+	char buffer[256];
+	vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+
+	fputs(buffer, stdout);
+}
+
+int debug_backtrace(void** stack, int stack_capacity)
+{
+	// Skip this function, as CaptureStackBackTrace is told to.
+	void* frames[64];
+	int count = backtrace(frames, stack_capacity + 1 < 64 ? stack_capacity + 1 : 64);
+	count = count > 0 ? count - 1 : 0;
+	memcpy(stack, frames + 1, sizeof(void*) * count);
+	return count;
+}
+
+#endif
@@ -4,6 +4,7 @@
 // Framework for game entities and their components.
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 typedef struct heap_t heap_t;
@@ -1,30 +1,71 @@
 #include "event.h"
 
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
+#include "atomic.h"
+#include "futex.h"
+
+#include <stdlib.h>
+
+// Manual-reset event on a futex word: 0 while clear, 1 once signaled, and
+// 2 while clear with threads parked on it. Signaling and checking an event
+// nobody waits on never leave user space.
+
+enum
+{
+	k_event_clear = 0,
+	k_event_raised = 1,
+	k_event_waited = 2,
+};
+
+typedef struct event_t
+{
+	int state;
+} event_t;
 
 event_t* event_create()
 {
-	HANDLE evt = CreateEvent(NULL, TRUE, FALSE, NULL);
-	return (event_t*)evt;
+	event_t* event = malloc(sizeof(event_t));
+	event->state = k_event_clear;
+	return event;
 }
 
 void event_destroy(event_t* event)
 {
-	CloseHandle(event);
+	free(event);
 }
 
 void event_signal(event_t* event)
 {
-	SetEvent(event);
+	if (atomic_exchange(&event->state, k_event_raised) == k_event_waited)
+	{
+		futex_wake_all(&event->state);
+	}
+}
+
+void event_reset(event_t* event)
+{
+	atomic_compare_and_exchange(&event->state, k_event_raised, k_event_clear);
 }
 
 void event_wait(event_t* event)
 {
-	WaitForSingleObject(event, INFINITE);
+	int state = atomic_load(&event->state);
+	while (state != k_event_raised)
+	{
+		if (state == k_event_clear)
+		{
+			// Announce the waiter, so the signal knows to wake it.
+			state = atomic_compare_and_exchange(&event->state, k_event_clear, k_event_waited);
+			if (state != k_event_clear)
+			{
+				continue;
+			}
+		}
+		futex_wait(&event->state, k_event_waited);
+		state = atomic_load(&event->state);
+	}
 }
 
 bool event_is_raised(event_t* event)
 {
-	return WaitForSingleObject(event, 0) == WAIT_OBJECT_0;
+	return atomic_load(&event->state) == k_event_raised;
 }
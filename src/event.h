@@ -3,6 +3,8 @@
 #include <stdbool.h>
 
 // Event thread synchronization
+//
+// Built on futex: an event nobody waits on is only an atomic flag.
 
 // Handle to an event.
 typedef struct event_t event_t;
@@ -17,6 +19,10 @@ void event_destroy(event_t* event);
 // All threads waiting on this event will resume.
 void event_signal(event_t* event);
 
+// Clears a signaled event, so it can be waited on again.
+// No other thread may signal the event while it is being reset.
+void event_reset(event_t* event);
+
 // Waits for an event to be signaled.
 void event_wait(event_t* event);
 
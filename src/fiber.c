@@ -0,0 +1,155 @@
+#include "fiber.h"
+
+#include "debug.h"
+#include "heap.h"
+#include "vm.h"
+
+#include <stdint.h>
+
+#if defined(_WIN32)
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+typedef struct fiber_t
+{
+	heap_t* heap;
+	void* handle;
+	void (*function)(void*);
+	void* data;
+} fiber_t;
+
+static void CALLBACK fiber_start(void* user)
+{
+	fiber_t* fiber = user;
+	fiber->function(fiber->data);
+}
+
+fiber_t* fiber_convert_thread(heap_t* heap)
+{
+	fiber_t* fiber = heap_alloc(heap, sizeof(fiber_t), 8);
+	fiber->heap = heap;
+	fiber->handle = ConvertThreadToFiber(NULL);
+	fiber->function = NULL;
+	fiber->data = NULL;
+	return fiber;
+}
+
+void fiber_revert_thread(fiber_t* fiber)
+{
+	ConvertFiberToThread();
+	heap_free(fiber->heap, fiber);
+}
+
+fiber_t* fiber_create(heap_t* heap, size_t stack_size, void (*function)(void*), void* data)
+{
+	fiber_t* fiber = heap_alloc(heap, sizeof(fiber_t), 8);
+	fiber->heap = heap;
+	fiber->function = function;
+	fiber->data = data;
+	fiber->handle = CreateFiber(stack_size, fiber_start, fiber);
+	if (!fiber->handle)
+	{
+		debug_print(k_print_error, "Fiber failed to create!\n");
+		heap_free(heap, fiber);
+		return NULL;
+	}
+	return fiber;
+}
+
+void fiber_destroy(fiber_t* fiber)
+{
+	DeleteFiber(fiber->handle);
+	heap_free(fiber->heap, fiber);
+}
+
+void fiber_switch(fiber_t* from, fiber_t* to)
+{
+	(void)from;
+	SwitchToFiber(to->handle);
+}
+
+#else
+
+#include <ucontext.h>
+
+// Stacks are reserved apart from the heap, with an uncommitted guard page
+// below them, so an overflow faults instead of corrupting its neighbours.
+// CreateFiber does the same on Windows.
+typedef struct fiber_t
+{
+	heap_t* heap;
+	ucontext_t context;
+	// The reservation, guard page first; NULL for a converted thread.
+	void* stack;
+	size_t stack_reserve_size;
+	void (*function)(void*);
+	void* data;
+} fiber_t;
+
+// makecontext passes int arguments; the fiber pointer is split in two.
+static void fiber_start(unsigned int low, unsigned int high)
+{
+	fiber_t* fiber = (fiber_t*)(((uintptr_t)high << 16 << 16) | low);
+	fiber->function(fiber->data);
+}
+
+fiber_t* fiber_convert_thread(heap_t* heap)
+{
+	fiber_t* fiber = heap_alloc(heap, sizeof(fiber_t), 16);
+	fiber->heap = heap;
+	fiber->stack = NULL;
+	fiber->stack_reserve_size = 0;
+	fiber->function = NULL;
+	fiber->data = NULL;
+	return fiber;
+}
+
+void fiber_revert_thread(fiber_t* fiber)
+{
+	heap_free(fiber->heap, fiber);
+}
+
+fiber_t* fiber_create(heap_t* heap, size_t stack_size, void (*function)(void*), void* data)
+{
+	size_t page_size = vm_page_size();
+	stack_size = (stack_size + page_size - 1) & ~(page_size - 1);
+	char* stack = vm_reserve(stack_size + page_size);
+	if (stack && !vm_commit(stack + page_size, stack_size))
+	{
+		vm_release(stack, stack_size + page_size);
+		stack = NULL;
+	}
+	if (!stack)
+	{
+		debug_print(k_print_error, "Fiber stack failed to map!\n");
+		return NULL;
+	}
+
+	fiber_t* fiber = heap_alloc(heap, sizeof(fiber_t), 16);
+	fiber->heap = heap;
+	fiber->stack = stack;
+	fiber->stack_reserve_size = stack_size + page_size;
+	fiber->function = function;
+	fiber->data = data;
+	getcontext(&fiber->context);
+	fiber->context.uc_stack.ss_sp = stack + page_size;
+	fiber->context.uc_stack.ss_size = stack_size;
+	fiber->context.uc_link = NULL;
+	uintptr_t address = (uintptr_t)fiber;
+	makecontext(&fiber->context, (void (*)())fiber_start, 2, (unsigned int)address, (unsigned int)(address >> 16 >> 16));
+	return fiber;
+}
+
+void fiber_destroy(fiber_t* fiber)
+{
+	vm_release(fiber->stack, fiber->stack_reserve_size);
+	heap_free(fiber->heap, fiber);
+}
+
+void fiber_switch(fiber_t* from, fiber_t* to)
+{
+	swapcontext(&from->context, &to->context);
+}
+
+#endif
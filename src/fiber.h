@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stddef.h>
+
+// Fibers: stacks of execution that are switched between cooperatively.
+// A fiber may be resumed on any thread, not only the one it last ran on.
+
+// Handle to a fiber.
+typedef struct fiber_t fiber_t;
+
+typedef struct heap_t heap_t;
+
+// Turn the calling thread into a fiber, so it can switch to other fibers.
+// Returns the fiber running the thread's original stack.
+fiber_t* fiber_convert_thread(heap_t* heap);
+
+// Undo fiber_convert_thread. Must be called on the same thread, while it
+// runs its original stack.
+void fiber_revert_thread(fiber_t* fiber);
+
+// Create a fiber with its own stack of stack_size bytes.
+// The stack is mapped apart from the heap, with a guard page below it, so
+// an overflow faults instead of corrupting other memory.
+// The fiber starts running function with data when first switched to.
+// The function must never return; switch away from the fiber instead.
+// Returns NULL if the stack cannot be mapped.
+fiber_t* fiber_create(heap_t* heap, size_t stack_size, void (*function)(void*), void* data);
+
+// Destroy a fiber created with fiber_create. It must not be running.
+void fiber_destroy(fiber_t* fiber);
+
+// Suspend the calling fiber, from, and resume to.
+// Returns when another thread or fiber switches back to from.
+void fiber_switch(fiber_t* from, fiber_t* to);
@@ -57,6 +57,7 @@ typedef struct frogger_game_t
 
 	timer_object_t* timer;
 
+	heap_t* ecs_heap;
 	ecs_t* ecs;
 	int transform_type;
 	int camera_type;
@@ -132,7 +133,8 @@ frogger_game_t* frogger_game_create(heap_t* heap, fs_t* fs, wm_window_t* window,
 
 	game->timer = timer_object_create(heap, NULL);
 
-	game->ecs = ecs_create(heap);
+	game->ecs_heap = heap_create_child(heap, "ecs", 256 * 1024, 32 * 1024 * 1024);
+	game->ecs = ecs_create(game->ecs_heap);
 	game->transform_type = ecs_register_component_type(game->ecs, "transform", sizeof(transform_component_t), _Alignof(transform_component_t));
 	game->camera_type = ecs_register_component_type(game->ecs, "camera", sizeof(camera_component_t), _Alignof(camera_component_t));
 	game->model_type = ecs_register_component_type(game->ecs, "model", sizeof(model_component_t), _Alignof(model_component_t));
@@ -154,6 +156,7 @@ frogger_game_t* frogger_game_create(heap_t* heap, fs_t* fs, wm_window_t* window,
 void frogger_game_destroy(frogger_game_t* game)
 {
 	ecs_destroy(game->ecs);
+	heap_destroy(game->ecs_heap);
 	timer_object_destroy(game->timer);
 	unload_resources(game);
 	heap_free(game->heap, game);
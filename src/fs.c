@@ -2,25 +2,82 @@
 #include "lz4/lz4.h"
 #include "debug.h"
 
+#include "atomic.h"
 #include "event.h"
+#include "futex.h"
 #include "heap.h"
+#include "heap_pool.h"
+#include "job.h"
+#include "mutex.h"
 #include "queue.h"
 #include "thread.h"
 
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 
+#if defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#else
+#include "uring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+enum
+{
+	k_fs_works_per_slab = 16,
+	// Most work items a worker takes off its queue at once.
+	k_fs_work_batch = 16,
+	k_fs_max_threads = 64,
+	k_fs_path_buckets = 64,
+};
+
+typedef struct fs_work_t fs_work_t;
+
+// Work in one stage of the pipeline, by path. The first work on a path
+// holds it; later work on the path waits behind the holder, oldest first,
+// and is handed the path when the holder releases it. Not thread-safe.
+typedef struct fs_paths_t
+{
+	// Holders, chained by hash.
+	fs_work_t* buckets[k_fs_path_buckets];
+} fs_paths_t;
+
+// Workers sharing one queue. Work is queued only once it holds its path,
+// so a busy path holds back its own work and nothing else.
+typedef struct fs_stage_t
+{
+	fs_t* fs;
+	queue_t* queue;
+	mutex_t* paths_mutex;
+	fs_paths_t paths;
+	thread_t** threads;
+	int thread_count;
+} fs_stage_t;
+
+typedef struct fs_uring_t fs_uring_t;
 
 typedef struct fs_t
 {
 	heap_t* heap;
-	// Queue and thread used for file operations
-	queue_t* file_queue;
-	thread_t* file_thread;
-	// Queue and thread used for compression
-	queue_t* comp_queue;
-	thread_t* comp_thread;
+	heap_pool_t* work_pool;
+	job_system_t* jobs;
+	// io_uring backend for file operations, or NULL for the file stage
+	fs_uring_t* uring;
+	// Workers for file operations; none with io_uring
+	fs_stage_t file_stage;
+	// Workers for compression
+	fs_stage_t comp_stage;
+	// Work started and not yet complete, in any stage.
+	int outstanding;
+	// Set by fs_destroy while it waits for outstanding to reach zero.
+	int destroying;
 } fs_t;
 
 typedef enum fs_work_op_t
@@ -31,67 +88,333 @@ typedef enum fs_work_op_t
 
 typedef struct fs_work_t
 {
+	fs_t* fs;
 	heap_t* heap;
 	fs_work_op_t op;
 	char path[1024];
+	// Picks the path's bucket in fs_paths_t.
+	uint32_t path_hash;
+	// Next holder in the bucket while holding the path, else next work
+	// waiting on it.
+	fs_work_t* path_next;
+	// Work waiting on the path while holding it.
+	fs_work_t* path_waiting;
+	fs_work_t* path_waiting_tail;
 	bool null_terminate;
 	bool use_compression;
 	void* buffer;
+	// Registered io_uring buffer holding a compressed read, or -1.
+	int staging;
 	size_t size;
+	// Signaled when the work completes: a job counter with a job system,
+	// an event without.
 	event_t* done;
+	job_counter_t* counter;
 	int result;
 } fs_work_t;
 
 static int file_thread_func(void* user);
 static int comp_thread_func(void* user);
 
+// The io_uring backend, defined with the platform's file operations.
+// fs_uring_create returns NULL where io_uring is unavailable.
+static fs_uring_t* fs_uring_create(fs_t* fs, int queue_capacity);
+static void fs_uring_destroy(fs_uring_t* uring);
+static void fs_uring_push(fs_uring_t* uring, fs_work_t* work);
+static void fs_uring_release_staging(fs_uring_t* uring, int staging);
+
 fs_t* fs_create(heap_t* heap, int queue_capacity)
 {
-	fs_t* fs = heap_alloc(heap, sizeof(fs_t), 8);
-	fs->heap = heap;
-	fs->file_queue = queue_create(heap, queue_capacity);
-	fs->file_thread = thread_create(file_thread_func, fs);
-	fs->comp_queue = queue_create(heap, queue_capacity);
-	fs->comp_thread = thread_create(comp_thread_func, fs);
+	fs_info_t info =
+	{
+		.heap = heap,
+		.queue_capacity = queue_capacity,
+	};
+	return fs_create_ex(&info);
+}
+
+static bool fs_same_path(fs_work_t* a, fs_work_t* b)
+{
+	return a->path_hash == b->path_hash && strcmp(a->path, b->path) == 0;
+}
+
+// Returns true if work now holds its path, false if it waits behind the
+// holder.
+static bool fs_paths_claim(fs_paths_t* paths, fs_work_t* work)
+{
+	work->path_next = NULL;
+	work->path_waiting = NULL;
+	work->path_waiting_tail = NULL;
+	fs_work_t** bucket = &paths->buckets[work->path_hash % k_fs_path_buckets];
+	for (fs_work_t* holder = *bucket; holder; holder = holder->path_next)
+	{
+		if (fs_same_path(holder, work))
+		{
+			if (holder->path_waiting_tail)
+			{
+				holder->path_waiting_tail->path_next = work;
+			}
+			else
+			{
+				holder->path_waiting = work;
+			}
+			holder->path_waiting_tail = work;
+			return false;
+		}
+	}
+	work->path_next = *bucket;
+	*bucket = work;
+	return true;
+}
+
+// Release the path work holds. Returns the oldest work waiting on it, which
+// now holds it, or NULL.
+static fs_work_t* fs_paths_release(fs_paths_t* paths, fs_work_t* work)
+{
+	fs_work_t** link = &paths->buckets[work->path_hash % k_fs_path_buckets];
+	while (*link != work)
+	{
+		link = &(*link)->path_next;
+	}
+	*link = work->path_next;
+
+	fs_work_t* next = work->path_waiting;
+	if (next)
+	{
+		next->path_waiting = next->path_next;
+		next->path_waiting_tail = next->path_waiting ? work->path_waiting_tail : NULL;
+		next->path_next = *link;
+		*link = next;
+	}
+	return next;
+}
+
+static void fs_stage_create(fs_t* fs, fs_stage_t* stage, int count, int queue_capacity, int (*function)(void*), const char* name, thread_priority_t priority)
+{
+	stage->fs = fs;
+	stage->queue = count ? queue_create(fs->heap, queue_capacity * count) : NULL;
+	stage->paths_mutex = mutex_create();
+	memset(&stage->paths, 0, sizeof(stage->paths));
+	stage->threads = count ? heap_alloc(fs->heap, sizeof(thread_t*) * count, 8) : NULL;
+	stage->thread_count = count;
+	for (int i = 0; i < count; ++i)
+	{
+		char thread_name[32];
+		snprintf(thread_name, sizeof(thread_name), "%s %d", name, i);
+		thread_info_t thread_info =
+		{
+			.function = function,
+			.data = stage,
+			.name = thread_name,
+			.priority = priority,
+		};
+		stage->threads[i] = thread_create_ex(&thread_info);
+	}
+}
+
+static void fs_stage_destroy(fs_t* fs, fs_stage_t* stage)
+{
+	for (int i = 0; i < stage->thread_count; ++i)
+	{
+		thread_destroy(stage->threads[i]);
+	}
+	if (stage->queue)
+	{
+		queue_destroy(stage->queue);
+	}
+	mutex_destroy(stage->paths_mutex);
+	heap_free(fs->heap, stage->threads);
+}
+
+// Queue work once it holds its path; until then it waits on the holder.
+static void fs_stage_push(fs_stage_t* stage, fs_work_t* work)
+{
+	mutex_lock(stage->paths_mutex);
+	bool claimed = fs_paths_claim(&stage->paths, work);
+	mutex_unlock(stage->paths_mutex);
+	if (claimed)
+	{
+		queue_push(stage->queue, work);
+	}
+}
+
+// Called by a worker when it is done with work, before passing it on.
+// Returns the work next on its path, for the worker to run in turn.
+static fs_work_t* fs_stage_release(fs_stage_t* stage, fs_work_t* work)
+{
+	mutex_lock(stage->paths_mutex);
+	fs_work_t* next = fs_paths_release(&stage->paths, work);
+	mutex_unlock(stage->paths_mutex);
+	return next;
+}
+
+fs_t* fs_create_ex(const fs_info_t* info)
+{
+	fs_t* fs = heap_alloc(info->heap, sizeof(fs_t), 8);
+	fs->heap = info->heap;
+	fs->work_pool = heap_pool_create(info->heap, sizeof(fs_work_t), 8, k_fs_works_per_slab);
+	fs->jobs = info->jobs;
+	fs->outstanding = 0;
+	fs->destroying = 0;
+	fs->uring = info->backend != k_fs_backend_threads ? fs_uring_create(fs, info->queue_capacity) : NULL;
+	if (!fs->uring && info->backend == k_fs_backend_io_uring)
+	{
+		debug_print(k_print_warning, "io_uring unavailable; fs is using worker threads.\n");
+	}
+	int file_thread_count = fs->uring ? 0 : __min(__max(info->file_thread_count, 1), k_fs_max_threads);
+	int comp_thread_count = __min(__max(info->comp_thread_count, 1), k_fs_max_threads);
+	fs_stage_create(fs, &fs->file_stage, file_thread_count, info->queue_capacity,
+		file_thread_func, "fs file", k_thread_priority_normal);
+	// Compression is throughput work; let latency-sensitive threads preempt it.
+	fs_stage_create(fs, &fs->comp_stage, comp_thread_count, info->queue_capacity,
+		comp_thread_func, "fs compression", k_thread_priority_low);
 	return fs;
 }
 
+// FNV-1a, to pick a path's bucket.
+static uint32_t fs_hash_path(const char* path)
+{
+	uint32_t hash = 2166136261u;
+	for (const char* c = path; *c; ++c)
+	{
+		hash = (hash ^ (uint8_t)*c) * 16777619u;
+	}
+	return hash;
+}
+
+static void fs_push_file_work(fs_t* fs, fs_work_t* work)
+{
+	if (fs->uring)
+	{
+		fs_uring_push(fs->uring, work);
+	}
+	else
+	{
+		fs_stage_push(&fs->file_stage, work);
+	}
+}
+
+static void fs_push_comp_work(fs_t* fs, fs_work_t* work)
+{
+	fs_stage_push(&fs->comp_stage, work);
+}
+
+static void fs_work_start(fs_t* fs, fs_work_t* work)
+{
+	atomic_increment(&fs->outstanding);
+	if (fs->jobs)
+	{
+		work->done = NULL;
+		work->counter = job_counter_create(fs->jobs);
+		job_counter_increment(work->counter);
+	}
+	else
+	{
+		work->done = event_create();
+		work->counter = NULL;
+	}
+}
+
+static void fs_work_signal(fs_work_t* work)
+{
+	// The work may be freed once signaled.
+	fs_t* fs = work->fs;
+	if (work->counter)
+	{
+		job_counter_decrement(fs->jobs, work->counter);
+	}
+	else
+	{
+		event_signal(work->done);
+	}
+	if (atomic_decrement(&fs->outstanding) == 1 && atomic_load(&fs->destroying))
+	{
+		futex_wake_all(&fs->outstanding);
+	}
+}
+
+// Pass work whose file operation finished on to decompression, or
+// complete it.
+static void fs_file_finished(fs_t* fs, fs_work_t* work)
+{
+	if (work->op == k_fs_work_op_read && !work->result && work->use_compression)
+	{
+		// HOMEWORK 2: Queue file read work on compression queue!
+		fs_push_comp_work(fs, work);
+	}
+	else
+	{
+		fs_work_signal(work);
+	}
+}
+
 void fs_destroy(fs_t* fs)
 {
-	queue_push(fs->file_queue, NULL);
-	queue_push(fs->comp_queue, NULL);
-	thread_destroy(fs->file_thread);
-	queue_destroy(fs->file_queue);
-	thread_destroy(fs->comp_thread);
-	queue_destroy(fs->comp_queue);
+	// Stages feed each other, compressed writes from compression to file
+	// operations and compressed reads back, so none can stop while work is
+	// in either. Once all of it is complete, nothing more is passed between
+	// stages and nothing is pushed to the io_uring thread after its quit.
+	atomic_store(&fs->destroying, 1);
+	int outstanding;
+	while ((outstanding = atomic_load(&fs->outstanding)) != 0)
+	{
+		futex_wait(&fs->outstanding, outstanding);
+	}
+
+	for (int i = 0; i < fs->file_stage.thread_count; ++i)
+	{
+		queue_push(fs->file_stage.queue, NULL);
+	}
+	for (int i = 0; i < fs->comp_stage.thread_count; ++i)
+	{
+		queue_push(fs->comp_stage.queue, NULL);
+	}
+	if (fs->uring)
+	{
+		fs_uring_destroy(fs->uring);
+	}
+	fs_stage_destroy(fs, &fs->file_stage);
+	fs_stage_destroy(fs, &fs->comp_stage);
+	heap_pool_destroy(fs->work_pool);
 	heap_free(fs->heap, fs);
 }
 
+fs_backend_t fs_get_backend(fs_t* fs)
+{
+	return fs->uring ? k_fs_backend_io_uring : k_fs_backend_threads;
+}
+
 fs_work_t* fs_read(fs_t* fs, const char* path, heap_t* heap, bool null_terminate, bool use_compression)
 {
-	fs_work_t* work = heap_alloc(fs->heap, sizeof(fs_work_t), 8);
+	fs_work_t* work = heap_pool_alloc(fs->work_pool);
+	work->fs = fs;
 	work->heap = heap;
 	work->op = k_fs_work_op_read;
 	strcpy_s(work->path, sizeof(work->path), path);
+	work->path_hash = fs_hash_path(work->path);
 	work->buffer = NULL;
+	work->staging = -1;
 	work->size = 0;
-	work->done = event_create();
+	fs_work_start(fs, work);
 	work->result = 0;
 	work->null_terminate = null_terminate;
 	work->use_compression = use_compression;
-	queue_push(fs->file_queue, work);
+	fs_push_file_work(fs, work);
 	return work;
 }
 
 fs_work_t* fs_write(fs_t* fs, const char* path, const void* buffer, size_t size, bool use_compression)
 {
-	fs_work_t* work = heap_alloc(fs->heap, sizeof(fs_work_t), 8);
+	fs_work_t* work = heap_pool_alloc(fs->work_pool);
+	work->fs = fs;
 	work->heap = fs->heap;
 	work->op = k_fs_work_op_write;
 	strcpy_s(work->path, sizeof(work->path), path);
+	work->path_hash = fs_hash_path(work->path);
 	work->buffer = (void*)buffer;
+	work->staging = -1;
 	work->size = size;
-	work->done = event_create();
+	fs_work_start(fs, work);
 	work->result = 0;
 	work->null_terminate = false;
 	work->use_compression = use_compression;
@@ -100,11 +423,11 @@ fs_work_t* fs_write(fs_t* fs, const char* path, const void* buffer, size_t size,
 	{
 		// HOMEWORK 2: Queue file write work on compression queue!
 
-		queue_push(fs->comp_queue, work);
+		fs_push_comp_work(fs, work);
 	}
 	else
 	{
-		queue_push(fs->file_queue, work);
+		fs_push_file_work(fs, work);
 	}
 
 	return work;
@@ -112,12 +435,20 @@ fs_work_t* fs_write(fs_t* fs, const char* path, const void* buffer, size_t size,
 
 bool fs_work_is_done(fs_work_t* work)
 {
-	return work ? event_is_raised(work->done) : true;
+	if (!work)
+	{
+		return true;
+	}
+	return work->counter ? job_counter_is_done(work->counter) : event_is_raised(work->done);
 }
 
 void fs_work_wait(fs_work_t* work)
 {
-	if (work)
+	if (work && work->counter)
+	{
+		job_wait(work->fs->jobs, work->counter);
+	}
+	else if (work)
 	{
 		event_wait(work->done);
 	}
@@ -145,22 +476,30 @@ void fs_work_destroy(fs_work_t* work)
 {
 	if (work)
 	{
-		event_wait(work->done);
-		event_destroy(work->done);
+		fs_work_wait(work);
+		if (work->counter)
+		{
+			job_counter_destroy(work->fs->jobs, work->counter);
+		}
+		else
+		{
+			event_destroy(work->done);
+		}
 		if (work->use_compression && (work->op == k_fs_work_op_write)) {
 			heap_free(work->heap, work->buffer);
 		}
-		heap_free(work->heap, work);
+		heap_pool_free(work->fs->work_pool, work);
 	}
 }
 
-static void file_read(fs_t* fs, fs_work_t* work)
+#if defined(_WIN32)
+
+static void file_read(fs_work_t* work)
 {
 	wchar_t wide_path[1024];
 	if (MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, sizeof(wide_path)) <= 0)
 	{
 		work->result = -1;
-		event_signal(work->done);
 		return;
 	}
 
@@ -169,7 +508,6 @@ static void file_read(fs_t* fs, fs_work_t* work)
 	if (handle == INVALID_HANDLE_VALUE)
 	{
 		work->result = GetLastError();
-		event_signal(work->done);
 		return;
 	}
 
@@ -177,7 +515,6 @@ static void file_read(fs_t* fs, fs_work_t* work)
 	{
 		work->result = GetLastError();
 		CloseHandle(handle);
-		event_signal(work->done);
 		return;
 	}
 
@@ -188,7 +525,6 @@ static void file_read(fs_t* fs, fs_work_t* work)
 	{
 		work->result = GetLastError();
 		CloseHandle(handle);
-		event_signal(work->done);
 		return;
 	}
 
@@ -199,16 +535,6 @@ static void file_read(fs_t* fs, fs_work_t* work)
 	}
 
 	CloseHandle(handle);
-
-	if (work->use_compression)
-	{
-		// HOMEWORK 2: Queue file read work on compression queue!
-		queue_push(fs->comp_queue, work);
-	}
-	else
-	{
-		event_signal(work->done);
-	}
 }
 
 static void file_write(fs_work_t* work)
@@ -217,7 +543,6 @@ static void file_write(fs_work_t* work)
 	if (MultiByteToWideChar(CP_UTF8, 0, work->path, -1, wide_path, sizeof(wide_path)) <= 0)
 	{
 		work->result = -1;
-		event_signal(work->done);
 		return;
 	}
 
@@ -226,7 +551,6 @@ static void file_write(fs_work_t* work)
 	if (handle == INVALID_HANDLE_VALUE)
 	{
 		work->result = GetLastError();
-		event_signal(work->done);
 		return;
 	}
 
@@ -235,91 +559,701 @@ static void file_write(fs_work_t* work)
 	{
 		work->result = GetLastError();
 		CloseHandle(handle);
-		event_signal(work->done);
 		return;
 	}
 
 	work->size = bytes_written;
 
 	CloseHandle(handle);
+}
 
-	event_signal(work->done);
+static fs_uring_t* fs_uring_create(fs_t* fs, int queue_capacity)
+{
+	return NULL;
 }
 
-static int file_thread_func(void* user)
+static void fs_uring_destroy(fs_uring_t* uring)
 {
-	fs_t* fs = user;
-	while (true)
+}
+
+static void fs_uring_push(fs_uring_t* uring, fs_work_t* work)
+{
+}
+
+static void fs_uring_release_staging(fs_uring_t* uring, int staging)
+{
+}
+
+#else
+
+static void file_read(fs_work_t* work)
+{
+	int fd = open(work->path, O_RDONLY);
+	if (fd < 0)
+	{
+		work->result = errno;
+		return;
+	}
+
+	struct stat info;
+	if (fstat(fd, &info) != 0)
+	{
+		work->result = errno;
+		close(fd);
+		return;
+	}
+	work->size = (size_t)info.st_size;
+
+	work->buffer = heap_alloc(work->heap, work->null_terminate ? work->size + 1 : work->size, 8);
+
+	size_t bytes_read = 0;
+	while (bytes_read < work->size)
 	{
-		fs_work_t* work = queue_pop(fs->file_queue);
-		if (work == NULL)
+		ssize_t result = read(fd, (char*)work->buffer + bytes_read, work->size - bytes_read);
+		if (result < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (result < 0)
+		{
+			work->result = errno;
+			close(fd);
+			return;
+		}
+		if (result == 0)
 		{
 			break;
 		}
+		bytes_read += (size_t)result;
+	}
 
-		switch (work->op)
+	work->size = bytes_read;
+	if (work->null_terminate)
+	{
+		((char*)work->buffer)[bytes_read] = 0;
+	}
+
+	close(fd);
+}
+
+static void file_write(fs_work_t* work)
+{
+	int fd = open(work->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+	{
+		work->result = errno;
+		return;
+	}
+
+	size_t bytes_written = 0;
+	while (bytes_written < work->size)
+	{
+		ssize_t result = write(fd, (const char*)work->buffer + bytes_written, work->size - bytes_written);
+		if (result < 0 && errno == EINTR)
 		{
-		case k_fs_work_op_read:
-			file_read(fs, work);
+			continue;
+		}
+		if (result < 0)
+		{
+			work->result = errno;
+			close(fd);
+			return;
+		}
+		bytes_written += (size_t)result;
+	}
+
+	work->size = bytes_written;
+
+	close(fd);
+}
+
+// io_uring backend
+//
+// One thread takes work off a queue and keeps up to k_fs_uring_depth
+// requests in flight. Each request is a short chain of operations: a read
+// opens the file and gets its size together, then reads and closes it; a
+// write opens, writes and closes. Every pass of the thread queues the next
+// operation of each request whose last one completed, submits them all in
+// one system call, and sleeps in the same call until something completes.
+//
+// Files are opened straight into the ring's fixed file slots, one per
+// request, where the kernel allows it. Compressed reads land in registered
+// staging buffers, since their contents only live until decompressed.
+//
+// Work on a path already in flight waits in a path table until the earlier
+// request finishes, keeping each path's operations in order, while work on
+// other paths goes on starting.
+
+enum
+{
+	// Requests in flight at once.
+	k_fs_uring_depth = 64,
+	// Each request queues at most two operations between submissions, and
+	// the wakeup read one more.
+	k_fs_uring_entries = k_fs_uring_depth * 2 + 1,
+	k_fs_uring_staging_count = 8,
+	k_fs_uring_staging_size = 256 * 1024,
+	// Most completions handled per pass.
+	k_fs_uring_reap_batch = 32,
+	// Largest single read or write; longer ones continue where they stop.
+	k_fs_uring_max_io = 1 << 30,
+};
+
+typedef enum fs_uring_op_t
+{
+	k_fs_uring_op_open,
+	k_fs_uring_op_statx,
+	k_fs_uring_op_io,
+	k_fs_uring_op_close,
+	k_fs_uring_op_wake,
+} fs_uring_op_t;
+
+typedef struct fs_uring_request_t
+{
+	fs_work_t* work;
+	// Fixed file slot, or descriptor without slots; -1 until opened.
+	int fd;
+	// Operations queued or in flight.
+	int pending;
+	// Bytes moved so far, and the file size for reads.
+	size_t done;
+	size_t size;
+	bool eof;
+	// errno of the first operation to fail, or zero.
+	int error;
+	struct statx statx;
+} fs_uring_request_t;
+
+typedef struct fs_uring_t
+{
+	fs_t* fs;
+	uring_t* ring;
+	queue_t* queue;
+	thread_t* thread;
+	bool fixed_files;
+
+	// Eventfd the thread keeps a read pending on, so a push can wake it
+	// from the kernel.
+	int wake_fd;
+	uint64_t wake_value;
+	// Set while the thread may sleep in the kernel.
+	int sleeping;
+
+	fs_uring_request_t requests[k_fs_uring_depth];
+	int free_requests[k_fs_uring_depth];
+	int free_request_count;
+	// Work taken off the queue, by path: in flight, ready, or waiting.
+	fs_paths_t paths;
+	// Work handed its path by a finished request, waiting for a request.
+	// Each finished request frees one, so there are never more than these.
+	fs_work_t* ready[k_fs_uring_depth];
+	int ready_count;
+	// Set by fs_uring_destroy, after which nothing more is pushed.
+	int quit;
+
+	// Registered buffers, and the free ones as indices plus one. Freed by
+	// compression workers.
+	char* staging;
+	queue_t* free_staging;
+} fs_uring_t;
+
+static uint64_t fs_uring_tag(int request, fs_uring_op_t op)
+{
+	return ((uint64_t)request << 8) | op;
+}
+
+// Requests never have more than k_fs_uring_entries operations queued
+// between submissions, so the ring cannot be full.
+static void fs_uring_queued(fs_uring_request_t* request, bool queued)
+{
+	if (!queued)
+	{
+		debug_print(k_print_error, "io_uring submission ring full!\n");
+		request->error = EBUSY;
+		return;
+	}
+	request->pending++;
+}
+
+static void fs_uring_arm_wake(fs_uring_t* uring)
+{
+	uring_read(uring->ring, uring->wake_fd, false, &uring->wake_value, sizeof(uring->wake_value), 0, -1,
+		fs_uring_tag(0, k_fs_uring_op_wake));
+}
+
+// Wake the thread if it may be asleep in the kernel.
+static void fs_uring_wake(fs_uring_t* uring)
+{
+	if (atomic_exchange(&uring->sleeping, 0))
+	{
+		uint64_t one = 1;
+		ssize_t result = write(uring->wake_fd, &one, sizeof(one));
+		(void)result;
+	}
+}
+
+static void fs_uring_push(fs_uring_t* uring, fs_work_t* work)
+{
+	queue_push(uring->queue, work);
+	fs_uring_wake(uring);
+}
+
+static void fs_uring_release_staging(fs_uring_t* uring, int staging)
+{
+	queue_push(uring->free_staging, (void*)(intptr_t)(staging + 1));
+}
+
+static void fs_uring_advance(fs_uring_t* uring, int index);
+
+static void fs_uring_start(fs_uring_t* uring, fs_work_t* work)
+{
+	int index = uring->free_requests[--uring->free_request_count];
+	fs_uring_request_t* request = &uring->requests[index];
+	request->work = work;
+	request->fd = -1;
+	request->pending = 0;
+	request->done = 0;
+	request->size = work->op == k_fs_work_op_write ? work->size : 0;
+	request->eof = false;
+	request->error = 0;
+
+	int slot = uring->fixed_files ? index : -1;
+	if (work->op == k_fs_work_op_read)
+	{
+		fs_uring_queued(request, uring_openat(uring->ring, work->path, O_RDONLY | O_CLOEXEC, 0, slot,
+			fs_uring_tag(index, k_fs_uring_op_open)));
+		fs_uring_queued(request, uring_statx(uring->ring, work->path, &request->statx,
+			fs_uring_tag(index, k_fs_uring_op_statx)));
+	}
+	else
+	{
+		fs_uring_queued(request, uring_openat(uring->ring, work->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644, slot,
+			fs_uring_tag(index, k_fs_uring_op_open)));
+	}
+	if (request->pending == 0)
+	{
+		fs_uring_advance(uring, index);
+	}
+}
+
+// Start queued work while requests are free. Returns true if any started.
+static bool fs_uring_take_work(fs_uring_t* uring)
+{
+	bool started = false;
+	while (uring->free_request_count > 0)
+	{
+		fs_work_t* work;
+		if (uring->ready_count > 0)
+		{
+			work = uring->ready[--uring->ready_count];
+		}
+		else
+		{
+			work = queue_try_pop(uring->queue);
+			if (!work)
+			{
+				break;
+			}
+			// Work on a busy path waits for it without holding up the queue.
+			if (!fs_paths_claim(&uring->paths, work))
+			{
+				continue;
+			}
+		}
+		fs_uring_start(uring, work);
+		started = true;
+	}
+	return started;
+}
+
+static void fs_uring_finish(fs_uring_t* uring, int index)
+{
+	fs_uring_request_t* request = &uring->requests[index];
+	fs_work_t* work = request->work;
+	request->work = NULL;
+	uring->free_requests[uring->free_request_count++] = index;
+
+	work->result = request->error;
+	work->size = request->done;
+	if (work->op == k_fs_work_op_read && request->error && work->staging >= 0)
+	{
+		fs_uring_release_staging(uring, work->staging);
+		work->staging = -1;
+		work->buffer = NULL;
+	}
+	else if (work->op == k_fs_work_op_read && work->null_terminate && work->staging < 0 && work->buffer)
+	{
+		((char*)work->buffer)[request->done] = 0;
+	}
+
+	fs_work_t* next = fs_paths_release(&uring->paths, work);
+	if (next)
+	{
+		uring->ready[uring->ready_count++] = next;
+	}
+	fs_file_finished(uring->fs, work);
+}
+
+// Queue the next operation of a request whose last ones completed.
+static void fs_uring_advance(fs_uring_t* uring, int index)
+{
+	fs_uring_request_t* request = &uring->requests[index];
+	fs_work_t* work = request->work;
+
+	if (!request->error && work->op == k_fs_work_op_read && !work->buffer)
+	{
+		void* staging = work->use_compression && request->size <= k_fs_uring_staging_size
+			? queue_try_pop(uring->free_staging) : NULL;
+		if (staging)
+		{
+			work->staging = (int)(intptr_t)staging - 1;
+			work->buffer = uring->staging + (size_t)work->staging * k_fs_uring_staging_size;
+		}
+		else
+		{
+			work->buffer = heap_alloc(work->heap, work->null_terminate ? request->size + 1 : request->size, 8);
+		}
+	}
+
+	bool fixed_file = uring->fixed_files;
+	if (!request->error && !request->eof && request->done < request->size)
+	{
+		char* buffer = (char*)work->buffer + request->done;
+		uint32_t size = (uint32_t)__min(request->size - request->done, (size_t)k_fs_uring_max_io);
+		uint64_t tag = fs_uring_tag(index, k_fs_uring_op_io);
+		if (work->op == k_fs_work_op_read)
+		{
+			fs_uring_queued(request, uring_read(uring->ring, request->fd, fixed_file, buffer, size, request->done, work->staging, tag));
+		}
+		else
+		{
+			fs_uring_queued(request, uring_write(uring->ring, request->fd, fixed_file, buffer, size, request->done, tag));
+		}
+	}
+	else if (request->fd >= 0)
+	{
+		fs_uring_queued(request, uring_close(uring->ring, request->fd, fixed_file, fs_uring_tag(index, k_fs_uring_op_close)));
+		request->fd = -1;
+	}
+	else
+	{
+		fs_uring_finish(uring, index);
+		return;
+	}
+
+	// Nothing was queued if the ring refused; the error moves it on.
+	if (request->pending == 0)
+	{
+		fs_uring_advance(uring, index);
+	}
+}
+
+static void fs_uring_complete(fs_uring_t* uring, const uring_completion_t* completion)
+{
+	fs_uring_op_t op = (fs_uring_op_t)(completion->user_data & 0xff);
+	if (op == k_fs_uring_op_wake)
+	{
+		fs_uring_arm_wake(uring);
+		return;
+	}
+
+	int index = (int)(completion->user_data >> 8);
+	fs_uring_request_t* request = &uring->requests[index];
+	request->pending--;
+	int result = completion->result;
+	if (result < 0 && !request->error)
+	{
+		request->error = -result;
+	}
+	else if (result >= 0)
+	{
+		switch (op)
+		{
+		case k_fs_uring_op_open:
+			request->fd = uring->fixed_files ? index : result;
+			break;
+		case k_fs_uring_op_statx:
+			request->size = (size_t)request->statx.stx_size;
+			break;
+		case k_fs_uring_op_io:
+			request->done += (size_t)result;
+			if (result == 0)
+			{
+				// The file shrank under a read, or a write made no progress.
+				request->eof = true;
+				if (request->work->op == k_fs_work_op_write)
+				{
+					request->error = EIO;
+				}
+			}
 			break;
-		case k_fs_work_op_write:
-			file_write(work);
+		default:
 			break;
 		}
 	}
-	return 0;
+	if (request->pending == 0)
+	{
+		fs_uring_advance(uring, index);
+	}
 }
 
-static int comp_thread_func(void* user)
+static int fs_uring_thread_func(void* user)
 {
-	fs_t* fs = user;
+	fs_uring_t* uring = user;
+	fs_uring_arm_wake(uring);
+	uring_completion_t completions[k_fs_uring_reap_batch];
 	while (true)
 	{
-		fs_work_t* work = queue_pop(fs->comp_queue);
-		if (work == NULL)
+		// Nothing is pushed once quit is set, so the queue drained after
+		// seeing it stays empty.
+		bool quit = atomic_load(&uring->quit);
+		fs_uring_take_work(uring);
+		if (quit && uring->ready_count == 0 && uring->free_request_count == k_fs_uring_depth)
 		{
 			break;
 		}
 
-		int dst_buff_size;
-		char* dst_buff;
+		// Sleep only if the queue is still empty and quit is still clear
+		// once pushes and fs_uring_destroy know to wake us.
+		atomic_store(&uring->sleeping, 1);
+		atomic_fence(k_atomic_order_seq_cst);
+		bool started = fs_uring_take_work(uring);
+		bool idle = atomic_load(&uring->quit) && uring->free_request_count == k_fs_uring_depth;
+		int result = uring_submit(uring->ring, started || idle ? 0 : 1);
+		atomic_store(&uring->sleeping, 0);
+		if (result < 0 && result != -EBUSY && result != -EAGAIN)
+		{
+			debug_print(k_print_error, "io_uring submit failed: %d\n", -result);
+		}
 
-		switch (work->op)
+		int count;
+		while ((count = uring_reap(uring->ring, completions, _countof(completions))) > 0)
 		{
-		case k_fs_work_op_read:
-			//decompress data
-			//Copy the size data stored at the front of buffer into the new size
-			memcpy(&dst_buff_size, (int*)work->buffer, 1);
-			//Allocate a new buffer and decompress into it
-			dst_buff = heap_alloc(fs->heap, dst_buff_size, 8);
-			int decomp_size = LZ4_decompress_safe((char*)(work->buffer) + 4, dst_buff, (int)work->size - 4, dst_buff_size);
-			//Restore original size, free previous buffer, and write decompressed text to buffer
-			work->size = decomp_size;
-			heap_free(fs->heap, work->buffer);
-			work->buffer = dst_buff;
-			//If null terminate, add null terminate to the end of the text
-			if (work->null_terminate)
+			for (int i = 0; i < count; ++i)
 			{
-				((char*)work->buffer)[work->size] = '\0';
+				fs_uring_complete(uring, &completions[i]);
 			}
-			//Signal the work is done for decompression reading
-			event_signal(work->done);
-			break;
-		case k_fs_work_op_write:
-			//compress data
-			//Get a size for the compressed text and allocate buffer to store the compressed text
-			dst_buff_size = LZ4_compressBound((int)work->size);
-			dst_buff = heap_alloc(fs->heap, (size_t)(dst_buff_size) + 4, 8);
-			//At the front of the buffer, store the original file size to be used in read
-			((size_t*)dst_buff)[0] = (char)work->size;
-			//Compress the work into the new buffer, store it and the compressed size into work
-			int comp_size = LZ4_compress_default(work->buffer, (char*)(dst_buff)+4, (int)work->size, dst_buff_size) + 4;
-			work->size = comp_size;
-			work->buffer = dst_buff;
-			//Add work to the file queue
-			queue_push(fs->file_queue, work);
-			break;
 		}
 	}
 	return 0;
 }
+
+static fs_uring_t* fs_uring_create(fs_t* fs, int queue_capacity)
+{
+	uring_t* ring = uring_create(fs->heap, k_fs_uring_entries);
+	if (!ring)
+	{
+		return NULL;
+	}
+	int wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (wake_fd < 0)
+	{
+		uring_destroy(ring);
+		return NULL;
+	}
+
+	fs_uring_t* uring = heap_alloc(fs->heap, sizeof(fs_uring_t), 8);
+	uring->fs = fs;
+	uring->ring = ring;
+	uring->queue = queue_create(fs->heap, queue_capacity);
+	uring->fixed_files = uring_register_file_slots(ring, k_fs_uring_depth);
+	uring->wake_fd = wake_fd;
+	uring->wake_value = 0;
+	uring->sleeping = 0;
+	for (int i = 0; i < k_fs_uring_depth; ++i)
+	{
+		uring->requests[i].work = NULL;
+		uring->free_requests[i] = k_fs_uring_depth - 1 - i;
+	}
+	uring->free_request_count = k_fs_uring_depth;
+	memset(&uring->paths, 0, sizeof(uring->paths));
+	uring->ready_count = 0;
+	uring->quit = 0;
+
+	// Without registered buffers, compressed reads use the heap like the
+	// rest, and the staging block goes straight back to the budget.
+	uring->free_staging = queue_create(fs->heap, k_fs_uring_staging_count);
+	uring->staging = heap_alloc(fs->heap, (size_t)k_fs_uring_staging_count * k_fs_uring_staging_size, 4096);
+	bool registered = false;
+	if (uring->staging)
+	{
+		void* buffers[k_fs_uring_staging_count];
+		size_t sizes[k_fs_uring_staging_count];
+		for (int i = 0; i < k_fs_uring_staging_count; ++i)
+		{
+			buffers[i] = uring->staging + (size_t)i * k_fs_uring_staging_size;
+			sizes[i] = k_fs_uring_staging_size;
+		}
+		registered = uring_register_buffers(ring, buffers, sizes, k_fs_uring_staging_count);
+	}
+	if (registered)
+	{
+		for (int i = 0; i < k_fs_uring_staging_count; ++i)
+		{
+			fs_uring_release_staging(uring, i);
+		}
+	}
+	else
+	{
+		heap_free(fs->heap, uring->staging);
+		uring->staging = NULL;
+	}
+
+	thread_info_t thread_info = { .function = fs_uring_thread_func, .data = uring, .name = "fs io_uring" };
+	uring->thread = thread_create_ex(&thread_info);
+	return uring;
+}
+
+static void fs_uring_destroy(fs_uring_t* uring)
+{
+	atomic_store(&uring->quit, 1);
+	fs_uring_wake(uring);
+	thread_destroy(uring->thread);
+	uring_destroy(uring->ring);
+	close(uring->wake_fd);
+	queue_destroy(uring->free_staging);
+	heap_free(uring->fs->heap, uring->staging);
+	queue_destroy(uring->queue);
+	heap_free(uring->fs->heap, uring);
+}
+
+
+#endif
+
+// A NULL tells one worker to quit. Workers share the queue, so NULLs meant
+// for others that came in the same batch go back on it. Returns true if
+// the calling worker should quit.
+static bool fs_stage_quit(fs_stage_t* stage, int quit_count)
+{
+	for (int i = 1; i < quit_count; ++i)
+	{
+		queue_push(stage->queue, NULL);
+	}
+	return quit_count > 0;
+}
+
+static int file_thread_func(void* user)
+{
+	fs_stage_t* stage = user;
+	void* works[k_fs_work_batch];
+	while (true)
+	{
+		// Take everything queued in one go.
+		int count = queue_pop_n(stage->queue, works, _countof(works));
+		int quit_count = 0;
+		for (int i = 0; i < count; ++i)
+		{
+			quit_count += works[i] == NULL;
+
+			// Run the work, then whatever waited on its path meanwhile.
+			fs_work_t* work = works[i];
+			while (work)
+			{
+				switch (work->op)
+				{
+				case k_fs_work_op_read:
+					file_read(work);
+					break;
+				case k_fs_work_op_write:
+					file_write(work);
+					break;
+				}
+				fs_work_t* next = fs_stage_release(stage, work);
+				fs_file_finished(stage->fs, work);
+				work = next;
+			}
+		}
+		if (fs_stage_quit(stage, quit_count))
+		{
+			return 0;
+		}
+	}
+}
+
+// Compress a write or decompress a read, replacing its buffer.
+static void comp_run(fs_t* fs, fs_work_t* work)
+{
+	int dst_buff_size;
+	char* dst_buff;
+
+	switch (work->op)
+	{
+	case k_fs_work_op_read:
+		//decompress data
+		//Copy the size data stored at the front of buffer into the new size
+		memcpy(&dst_buff_size, (int*)work->buffer, 1);
+		//Allocate a new buffer from the caller's heap and decompress into it
+		dst_buff = heap_alloc(work->heap, dst_buff_size, 8);
+		int decomp_size = LZ4_decompress_safe((char*)(work->buffer) + 4, dst_buff, (int)work->size - 4, dst_buff_size);
+		//Restore original size, free previous buffer, and write decompressed text to buffer
+		work->size = decomp_size;
+		if (work->staging >= 0)
+		{
+			fs_uring_release_staging(fs->uring, work->staging);
+			work->staging = -1;
+		}
+		else
+		{
+			heap_free(work->heap, work->buffer);
+		}
+		work->buffer = dst_buff;
+		//If null terminate, add null terminate to the end of the text
+		if (work->null_terminate)
+		{
+			((char*)work->buffer)[work->size] = '\0';
+		}
+		break;
+	case k_fs_work_op_write:
+		//compress data
+		//Get a size for the compressed text and allocate buffer to store the compressed text
+		dst_buff_size = LZ4_compressBound((int)work->size);
+		dst_buff = heap_alloc(fs->heap, (size_t)(dst_buff_size) + 4, 8);
+		//At the front of the buffer, store the original file size to be used in read
+		((size_t*)dst_buff)[0] = (char)work->size;
+		//Compress the work into the new buffer, store it and the compressed size into work
+		int comp_size = LZ4_compress_default(work->buffer, (char*)(dst_buff)+4, (int)work->size, dst_buff_size) + 4;
+		work->size = comp_size;
+		//The bound is a worst case; give the unused tail back, usually in place
+		work->buffer = heap_realloc(fs->heap, dst_buff, comp_size, 8);
+		break;
+	}
+}
+
+static int comp_thread_func(void* user)
+{
+	fs_stage_t* stage = user;
+	void* works[k_fs_work_batch];
+	while (true)
+	{
+		// Take everything queued in one go.
+		int count = queue_pop_n(stage->queue, works, _countof(works));
+		int quit_count = 0;
+		for (int i = 0; i < count; ++i)
+		{
+			quit_count += works[i] == NULL;
+
+			// Run the work, then whatever waited on its path meanwhile.
+			fs_work_t* work = works[i];
+			while (work)
+			{
+				comp_run(stage->fs, work);
+				fs_work_t* next = fs_stage_release(stage, work);
+				if (work->op == k_fs_work_op_read)
+				{
+					//Signal the work is done for decompression reading
+					fs_work_signal(work);
+				}
+				else
+				{
+					//Add work to the path's file queue
+					fs_push_file_work(stage->fs, work);
+				}
+				work = next;
+			}
+		}
+		if (fs_stage_quit(stage, quit_count))
+		{
+			return 0;
+		}
+	}
+}
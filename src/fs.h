@@ -1,8 +1,20 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stddef.h>
 
 // Asynchronous read/write file system.
+//
+// File operations run on a pool of file worker threads and compression
+// on a pool of compression workers, each pool sharing one queue. Work on
+// a path waits while earlier work on the same path is queued or running
+// in that pool, so work on one path runs in the order it reaches the pool
+// while work on other paths goes on around it. Compressed writes reach
+// the file workers once compressed.
+//
+// On Linux, file operations instead run on one thread that keeps many in
+// flight with io_uring, starting work on a path only once earlier work on
+// it is done.
 
 // Handle to file system.
 typedef struct fs_t fs_t;
@@ -11,15 +23,53 @@ typedef struct fs_t fs_t;
 typedef struct fs_work_t fs_work_t;
 
 typedef struct heap_t heap_t;
+typedef struct job_system_t job_system_t;
+
+// How file operations are performed.
+typedef enum fs_backend_t
+{
+	// io_uring where the kernel supports it, otherwise worker threads.
+	k_fs_backend_default,
+	// Worker threads making blocking system calls.
+	k_fs_backend_threads,
+	// One thread submitting operations to io_uring in batches.
+	k_fs_backend_io_uring,
+} fs_backend_t;
+
+// Parameters for creating a file system with fs_create_ex.
+typedef struct fs_info_t
+{
+	// Heap used to allocate space for queue and work buffers.
+	heap_t* heap;
+	// Number of queued file operations per worker.
+	int queue_capacity;
+	// Threads doing file operations with the threads backend. Zero means one.
+	int file_thread_count;
+	// Threads compressing and decompressing. Zero means one.
+	int comp_thread_count;
+	// If not NULL, waiting on file work from inside a job parks the job
+	// instead of blocking its worker thread. Must outlive the file system.
+	job_system_t* jobs;
+	fs_backend_t backend;
+} fs_info_t;
 
 // Create a new file system.
 // Provided heap will be used to allocate space for queue and work buffers.
 // Provided queue size defines number of in-flight file operations.
 fs_t* fs_create(heap_t* heap, int queue_capacity);
 
+// Create a new file system with explicit parameters.
+fs_t* fs_create_ex(const fs_info_t* info);
+
 // Destroy a previously created file system.
+// Waits for all queued work to complete first; the work objects must still
+// be destroyed by their owners.
 void fs_destroy(fs_t* fs);
 
+// Returns the backend performing file operations: k_fs_backend_threads or
+// k_fs_backend_io_uring.
+fs_backend_t fs_get_backend(fs_t* fs);
+
 // Queue a file read.
 // File at the specified path will be read in full.
 // Memory for the file will be allocated out of the provided heap.
@@ -36,6 +86,9 @@ fs_work_t* fs_write(fs_t* fs, const char* path, const void* buffer, size_t size,
 bool fs_work_is_done(fs_work_t* work);
 
 // Block for the file work to complete.
+// With a job system, a job that waits is parked rather than blocked, and
+// may resume on another thread; it must not hold a mutex_t across the
+// wait. The same applies to the fs_work_get_* functions, which wait.
 void fs_work_wait(fs_work_t* work);
 
 // Get the error code for the file work.
@@ -0,0 +1,253 @@
+#include "fs_bench.h"
+
+#include "debug.h"
+#include "fs.h"
+#include "heap.h"
+#include "timer.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum
+{
+	k_fs_bench_default_files = 256,
+	k_fs_bench_max_files = 4096,
+	k_fs_bench_default_threads = 16,
+	k_fs_bench_max_threads = 64,
+	k_fs_bench_min_size = 4 * 1024,
+	// Sizes double from the smallest this many times, then start over.
+	k_fs_bench_size_steps = 9,
+	// Reads of the whole set per worker count; the median is reported.
+	k_fs_bench_repeat = 3,
+};
+
+typedef struct fs_bench_file_t
+{
+	char path[256];
+	size_t size;
+	uint64_t checksum;
+} fs_bench_file_t;
+
+static uint64_t fs_bench_checksum(const void* buffer, size_t size)
+{
+	const uint64_t* words = buffer;
+	uint64_t checksum = 0;
+	for (size_t i = 0; i < size / sizeof(uint64_t); ++i)
+	{
+		checksum = checksum * 31 + words[i];
+	}
+	return checksum;
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+// Write every file with pseudorandom contents.
+static bool fs_bench_write_files(heap_t* heap, fs_bench_file_t* files, int file_count)
+{
+	fs_info_t info = { .heap = heap, .queue_capacity = file_count, .file_thread_count = 4, .backend = k_fs_backend_threads };
+	fs_t* fs = fs_create_ex(&info);
+	fs_work_t** works = heap_alloc(heap, sizeof(fs_work_t*) * file_count, 8);
+	uint64_t** buffers = heap_alloc(heap, sizeof(uint64_t*) * file_count, 8);
+	uint64_t seed = 0x9e3779b97f4a7c15ull;
+	for (int i = 0; i < file_count; ++i)
+	{
+		fs_bench_file_t* file = &files[i];
+		file->size = (size_t)k_fs_bench_min_size << (i % k_fs_bench_size_steps);
+		buffers[i] = heap_alloc(heap, file->size, 8);
+		for (size_t j = 0; j < file->size / sizeof(uint64_t); ++j)
+		{
+			seed ^= seed << 13;
+			seed ^= seed >> 7;
+			seed ^= seed << 17;
+			buffers[i][j] = seed;
+		}
+		file->checksum = fs_bench_checksum(buffers[i], file->size);
+		works[i] = fs_write(fs, file->path, buffers[i], file->size, false);
+	}
+
+	bool ok = true;
+	for (int i = 0; i < file_count; ++i)
+	{
+		if (fs_work_get_result(works[i]) != 0)
+		{
+			debug_print(k_print_error, "Unable to write %s\n", files[i].path);
+			ok = false;
+		}
+		fs_work_destroy(works[i]);
+		heap_free(heap, buffers[i]);
+	}
+	heap_free(heap, buffers);
+	heap_free(heap, works);
+	fs_destroy(fs);
+	return ok;
+}
+
+// Read every file back with a backend, and thread_count file workers for
+// the threads backend. Returns the ticks taken, or zero if the backend is
+// unavailable, and clears ok if a file came back wrong.
+static uint64_t fs_bench_read_files(heap_t* heap, const fs_bench_file_t* files, int file_count, fs_backend_t backend, int thread_count, bool* ok)
+{
+	fs_info_t info =
+	{
+		.heap = heap,
+		.queue_capacity = file_count,
+		.file_thread_count = thread_count,
+		.backend = backend,
+	};
+	fs_t* fs = fs_create_ex(&info);
+	if (fs_get_backend(fs) != backend)
+	{
+		fs_destroy(fs);
+		return 0;
+	}
+	fs_work_t** works = heap_alloc(heap, sizeof(fs_work_t*) * file_count, 8);
+
+	uint64_t t0 = timer_get_ticks();
+	for (int i = 0; i < file_count; ++i)
+	{
+		works[i] = fs_read(fs, files[i].path, heap, false, false);
+	}
+	for (int i = 0; i < file_count; ++i)
+	{
+		fs_work_wait(works[i]);
+	}
+	uint64_t ticks = timer_get_ticks() - t0;
+
+	for (int i = 0; i < file_count; ++i)
+	{
+		void* buffer = fs_work_get_buffer(works[i]);
+		size_t size = fs_work_get_size(works[i]);
+		if (fs_work_get_result(works[i]) != 0 || size != files[i].size || fs_bench_checksum(buffer, size) != files[i].checksum)
+		{
+			*ok = false;
+		}
+		heap_free(heap, buffer);
+		fs_work_destroy(works[i]);
+	}
+	heap_free(heap, works);
+	fs_destroy(fs);
+	return ticks;
+}
+
+// Read the files k_fs_bench_repeat times and print the median. Returns
+// the median ticks, or zero if the backend is unavailable.
+static uint64_t fs_bench_run(heap_t* heap, const fs_bench_file_t* files, int file_count, size_t total_size,
+	fs_backend_t backend, int thread_count, uint64_t baseline_ticks, bool* ok)
+{
+	bool match = true;
+	uint64_t ticks[k_fs_bench_repeat];
+	for (int r = 0; r < k_fs_bench_repeat; ++r)
+	{
+		ticks[r] = fs_bench_read_files(heap, files, file_count, backend, thread_count, &match);
+		if (ticks[r] == 0)
+		{
+			debug_print(k_print_warning, "fs   %s unavailable\n", backend == k_fs_backend_io_uring ? "io_uring" : "threads");
+			return 0;
+		}
+	}
+	qsort(ticks, k_fs_bench_repeat, sizeof(uint64_t), compare_u64);
+	uint64_t median = ticks[k_fs_bench_repeat / 2];
+	*ok = *ok && match;
+
+	char label[32];
+	if (backend == k_fs_backend_io_uring)
+	{
+		snprintf(label, sizeof(label), "io_uring");
+	}
+	else
+	{
+		snprintf(label, sizeof(label), "threads=%d", thread_count);
+	}
+	double seconds = (double)median / (double)timer_get_ticks_per_second();
+	debug_print(k_print_warning, "fs   %-10s files=%-4d files/s=%-9.0f MB/s=%-8.1f speedup=%.2fx %s\n",
+		label, file_count, file_count / seconds, total_size / seconds / (1024.0 * 1024.0),
+		(double)(baseline_ticks ? baseline_ticks : median) / (double)median, match ? "ok" : "READ MISMATCH");
+	return median;
+}
+
+int fs_bench_main(int argc, const char** argv)
+{
+	int file_count = k_fs_bench_default_files;
+	int max_threads = k_fs_bench_default_threads;
+	const char* dir = ".";
+	const char* backend = "all";
+	bool quick = false;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--files") == 0 && i + 1 < argc)
+		{
+			int files = atoi(argv[++i]);
+			file_count = __max(__min(files, k_fs_bench_max_files), 1);
+		}
+		else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+		{
+			int threads = atoi(argv[++i]);
+			max_threads = __max(__min(threads, k_fs_bench_max_threads), 1);
+		}
+		else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc)
+		{
+			dir = argv[++i];
+		}
+		else if (strcmp(argv[i], "--backend") == 0 && i + 1 < argc)
+		{
+			backend = argv[++i];
+		}
+		else if (strcmp(argv[i], "--quick") == 0)
+		{
+			quick = true;
+		}
+		else
+		{
+			debug_print(k_print_error, "Unknown option: %s\n", argv[i]);
+			return 1;
+		}
+	}
+	if (quick)
+	{
+		file_count = __max(file_count / 4, 1);
+	}
+
+	heap_t* heap = heap_create(4 * 1024 * 1024);
+	fs_bench_file_t* files = heap_alloc(heap, sizeof(fs_bench_file_t) * file_count, 8);
+	size_t total_size = 0;
+	for (int i = 0; i < file_count; ++i)
+	{
+		snprintf(files[i].path, sizeof(files[i].path), "%s/fs_bench_%04d.bin", dir, i);
+		total_size += (size_t)k_fs_bench_min_size << (i % k_fs_bench_size_steps);
+	}
+
+	bool ok = fs_bench_write_files(heap, files, file_count);
+	bool run_threads = strcmp(backend, "all") == 0 || strcmp(backend, "threads") == 0;
+	bool run_io_uring = strcmp(backend, "all") == 0 || strcmp(backend, "io_uring") == 0;
+	// Speedups are over one worker thread, or over io_uring run alone.
+	uint64_t baseline_ticks = 0;
+	// 1, 2, 4, ... workers, always ending with the maximum.
+	for (int threads = 1; ok && run_threads; threads = __min(threads * 2, max_threads))
+	{
+		uint64_t ticks = fs_bench_run(heap, files, file_count, total_size, k_fs_backend_threads, threads, baseline_ticks, &ok);
+		baseline_ticks = baseline_ticks ? baseline_ticks : ticks;
+		if (threads == max_threads)
+		{
+			break;
+		}
+	}
+	if (ok && run_io_uring)
+	{
+		fs_bench_run(heap, files, file_count, total_size, k_fs_backend_io_uring, 1, baseline_ticks, &ok);
+	}
+
+	for (int i = 0; i < file_count; ++i)
+	{
+		remove(files[i].path);
+	}
+	heap_free(heap, files);
+	heap_destroy(heap);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+// File system benchmarks.
+//
+// Writes a set of files of varying size, 4KB to 1MB, then reads them all
+// back through fs_t, with every read queued up front: with the threads
+// backend for a sweep of file worker counts, then with the io_uring
+// backend where available. Reports files and megabytes per second and
+// speedup over a single worker, and checks every file read back intact.
+//
+// The files were just written, so reads usually come from the OS page
+// cache: the numbers show how much of the queue's parallelism fs keeps,
+// more than the device's. Point --dir at a device with a cold cache to
+// measure the device.
+
+// Run the benchmark suite. Accepts these options:
+//   --files N    number of files (default: 256)
+//   --threads N  largest file worker count in the sweep (default: 16)
+//   --dir PATH   directory for the files, which must exist (default: .)
+//   --backend B  threads, io_uring or all (default: all)
+//   --quick      a quarter of the files, for smoke testing
+// Returns zero on success, nonzero if a file read back wrong.
+int fs_bench_main(int argc, const char** argv);
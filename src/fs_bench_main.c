@@ -0,0 +1,11 @@
+#include "fs_bench.h"
+#include "timer.h"
+
+// Standalone entry point for the file system benchmarks; see the Makefile.
+// The game runs the same suite with: ga2022 --fs-bench [options]
+
+int main(int argc, const char* argv[])
+{
+	timer_startup();
+	return fs_bench_main(argc, argv);
+}
@@ -0,0 +1,47 @@
+#include "futex.h"
+
+#if defined(_WIN32)
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+#pragma comment(lib, "Synchronization.lib")
+
+void futex_wait(int* address, int expected)
+{
+	WaitOnAddress(address, &expected, sizeof(int), INFINITE);
+}
+
+void futex_wake_one(int* address)
+{
+	WakeByAddressSingle(address);
+}
+
+void futex_wake_all(int* address)
+{
+	WakeByAddressAll(address);
+}
+
+#else
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+void futex_wait(int* address, int expected)
+{
+	syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0);
+}
+
+void futex_wake_one(int* address)
+{
+	syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+void futex_wake_all(int* address)
+{
+	syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+#endif
@@ -0,0 +1,14 @@
+#pragma once
+
+// Wait on and wake an address, without a kernel object per waiter.
+// WaitOnAddress on Windows, futex on Linux.
+
+// Block while the integer at address equals expected.
+// May return spuriously; callers recheck their condition in a loop.
+void futex_wait(int* address, int expected);
+
+// Wake one thread waiting on address.
+void futex_wake_one(int* address);
+
+// Wake every thread waiting on address.
+void futex_wake_all(int* address);
@@ -1,36 +1,180 @@
 #include "heap.h"
 
+#include "atomic.h"
 #include "debug.h"
 #include "mutex.h"
+#include "thread.h"
+#include "trace.h"
 #include "tlsf/tlsf.h"
+#include "vm.h"
 
+#include <math.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
-#include <DbgHelp.h>
+enum
+{
+	k_heap_cache_line_size = 64,
+	// Smallest size class served by the per-thread caches (log2).
+	k_heap_cache_min_class_log2 = 4,
+	// Number of power-of-two size classes: 16, 32, ... 2048 bytes.
+	k_heap_cache_class_count = 8,
+	// Maximum number of blocks a thread holds per size class.
+	k_heap_cache_capacity = 64,
+	// Number of blocks moved to or from the shared heap under one lock.
+	k_heap_cache_batch = 32,
+	// Frames captured per sampled call stack.
+	k_heap_stack_max_frames = 10,
+	// Number of distinct call stacks the side table can hold (power of two).
+	k_heap_stack_table_capacity = 4096,
+	// Number of frees between scans for empty arenas.
+	k_heap_trim_interval = 256,
+	// Number of released address ranges remembered for reuse.
+	k_heap_max_free_ranges = 256,
+	// Longest heap name kept, including the terminator.
+	k_heap_name_max = 32,
+	// Number of counter tracks emitted by heap_trace_counters.
+	k_heap_counter_count = 4,
+};
+
+// Address space reserved per heap when heap_info_t does not say.
+#if defined(_WIN64) || defined(__LP64__)
+static const size_t k_heap_default_reserve_size = (size_t)16 * 1024 * 1024 * 1024;
+#else
+static const size_t k_heap_default_reserve_size = (size_t)512 * 1024 * 1024;
+#endif
 
 typedef struct arena_t
 {
 	pool_t pool;
+	size_t size;
 	struct arena_t* next;
 } arena_t;
 
+// Header of an allocation that bypassed the arenas.
+// The word just before the returned address holds the header address with
+// the low bit set. A live TLSF block keeps its size there with the low
+// (free) bit clear, which is how heap_free tells the two apart.
+typedef struct large_alloc_t
+{
+	struct large_alloc_t* next;
+	struct large_alloc_t* prev;
+	size_t size;
+	char* mapped_base;
+	size_t mapped_size;
+	uint32_t stack_id;
+} large_alloc_t;
+
+// A span of decommitted address space inside the heap's reservation.
+typedef struct vm_range_t
+{
+	size_t offset;
+	size_t size;
+} vm_range_t;
+
+// Per-thread magazine of free blocks, one stack per size class.
+// Only the owning thread touches a cache outside of heap_destroy, until it
+// exits and the cache is released.
+typedef struct heap_cache_t
+{
+	struct heap_cache_t* next;
+	heap_t* heap;
+	// Sampling countdown and random state for this thread.
+	int64_t sample_countdown;
+	uint32_t random;
+	// Statistics, only written by the owning thread.
+	uint64_t alloc_count;
+	uint64_t free_count;
+	size_t cached_bytes;
+	int counts[k_heap_cache_class_count];
+	void* blocks[k_heap_cache_class_count][k_heap_cache_capacity];
+} heap_cache_t;
+
+// Deduplicated call stack, keyed by a hash of its frames.
+typedef struct callstack_t
+{
+	int64_t hash;
+	int frames;
+	void* stack[k_heap_stack_max_frames];
+} callstack_t;
+
 typedef struct heap_t
 {
+	// Blocks freed while another thread held the mutex, linked through their
+	// first word. Whoever takes the mutex next returns them to TLSF. Kept on
+	// its own cache line since contending threads hit it.
+	void* remote_frees;
+	char pad[k_heap_cache_line_size - sizeof(void*)];
+
 	tlsf_t tlsf;
 	size_t grow_increment;
+	// Children take arenas and large allocations from their parent.
+	heap_t* parent;
+	char name[k_heap_name_max];
+	// Counter track names; trace events keep pointers to them.
+	char counter_names[k_heap_counter_count][k_heap_name_max + 32];
+	// Cap on committed_bytes, or zero for none.
+	size_t budget;
 	arena_t* arena;
 	mutex_t* mutex;
+	heap_cache_t* caches;
+	uint64_t cache_tls;
+
+	// All arenas and large allocations are committed from this reservation,
+	// unless they got a dedicated large page mapping. Space below
+	// reserve_top has been handed out at some point; released spans below
+	// it are kept sorted in free_ranges.
+	char* reserve_base;
+	size_t reserve_size;
+	size_t reserve_top;
+	// The reservation as returned by the OS; larger than reserve_size when
+	// the base had to be aligned to a large page.
+	char* reserve_mapping;
+	size_t reserve_mapping_size;
+	// Granularity of arenas and large allocations: the OS page size, or the
+	// large page size if the heap uses large pages.
+	size_t page_size;
+	bool large_pages;
+	int free_range_count;
+	vm_range_t free_ranges[k_heap_max_free_ranges];
+
+	// Statistics for allocations that take the mutex; guarded by it.
+	uint64_t alloc_count;
+	uint64_t free_count;
+	size_t live_bytes;
+	size_t peak_live_bytes;
+	size_t arena_bytes;
+	int arena_count;
+	int arenas_released;
+	int large_alloc_count;
+	size_t large_alloc_bytes;
+	size_t large_page_bytes;
+	// Bytes of arenas and large allocation spans, counted against the budget.
+	size_t committed_bytes;
+
+	size_t large_alloc_threshold;
+	size_t retain_bytes;
+	int frees_since_trim;
+	large_alloc_t* large_allocs;
+
+	heap_leak_mode_t leak_mode;
+	size_t sample_bytes;
+	size_t sample_allocations;
+	// Bytes at the end of every block holding its call stack id.
+	// Zero when leak tracking is off.
+	size_t trailer_size;
+	// Open-addressed table of call stacks; a block's id is index + 1.
+	callstack_t* stacks;
 } heap_t;
 
-//Struct to store the number of frames and the pointer to a callstack
-typedef struct callstack_t
-{
-	int frames;
-	void* stack[10];
-} callstack_t;
+#if defined(_WIN32)
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <DbgHelp.h>
 
 void bt_print(int frames, void** stack)
 {
@@ -62,10 +206,98 @@ void bt_print(int frames, void** stack)
 	SymCleanup(process);
 }
 
+#else
+
+#include <execinfo.h>
+
+void bt_print(int frames, void** stack)
+{
+	char** symbols = backtrace_symbols(stack, frames);
+	for (int i = 0; symbols && i < frames; i++)
+	{
+		debug_print(k_print_error, "[%i] %s\n", i, symbols[i]);
+	}
+	free(symbols);
+}
+
+#endif
+
 heap_t* heap_create(size_t grow_increment)
 {
-	heap_t* heap = VirtualAlloc(NULL, sizeof(heap_t) + tlsf_size(),
-		MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+	heap_info_t info =
+	{
+		.grow_increment = grow_increment,
+#if defined(_DEBUG)
+		.leak_mode = k_heap_leak_full,
+#else
+		.leak_mode = k_heap_leak_off,
+#endif
+	};
+	return heap_create_ex(&info);
+}
+
+heap_t* heap_create_child(heap_t* parent, const char* name, size_t grow_increment, size_t budget)
+{
+	heap_info_t info =
+	{
+		.grow_increment = grow_increment,
+		.parent = parent,
+		.name = name,
+		.budget = budget,
+#if defined(_DEBUG)
+		.leak_mode = k_heap_leak_full,
+#else
+		.leak_mode = k_heap_leak_off,
+#endif
+	};
+	return heap_create_ex(&info);
+}
+
+// Reserve and commit a standalone range for heap bookkeeping.
+static void* heap_map_standalone(size_t size)
+{
+	void* address = vm_reserve(size);
+	if (address && !vm_commit(address, size))
+	{
+		vm_release(address, size);
+		address = NULL;
+	}
+	return address;
+}
+
+static void heap_cache_release(void* value);
+
+heap_t* heap_create_ex(const heap_info_t* info)
+{
+	heap_t* parent = info->parent;
+	size_t page_size = vm_page_size();
+	size_t large_page_size = info->large_pages && !parent ? vm_large_page_size() : 0;
+	size_t granule = __max(page_size, large_page_size);
+
+	size_t reserve_size = 0;
+	size_t reserve_mapping_size = 0;
+	char* reserve_mapping = NULL;
+	heap_t* heap = NULL;
+	if (parent)
+	{
+		// Children reserve nothing; all of their memory, this header
+		// included, comes from the parent.
+		heap = heap_alloc(parent, sizeof(heap_t) + tlsf_size(), k_heap_cache_line_size);
+	}
+	else
+	{
+		// Spans carved from the reservation are multiples of the granule, so
+		// an aligned base keeps them all eligible for transparent large pages.
+		reserve_size = info->reserve_size ? info->reserve_size : k_heap_default_reserve_size;
+		reserve_size = (reserve_size + granule - 1) & ~(granule - 1);
+		reserve_mapping_size = reserve_size + (granule > page_size ? granule : 0);
+		reserve_mapping = vm_reserve(reserve_mapping_size);
+		heap = reserve_mapping ? heap_map_standalone(sizeof(heap_t) + tlsf_size()) : NULL;
+		if (!heap && reserve_mapping)
+		{
+			vm_release(reserve_mapping, reserve_mapping_size);
+		}
+	}
 	if (!heap)
 	{
 		debug_print(
@@ -74,28 +306,307 @@ heap_t* heap_create(size_t grow_increment)
 		return NULL;
 	}
 
+	heap->remote_frees = NULL;
 	heap->mutex = mutex_create();
-	heap->grow_increment = grow_increment;
+	heap->grow_increment = info->grow_increment;
+	heap->parent = parent;
+	snprintf(heap->name, sizeof(heap->name), "%s", info->name ? info->name : "heap");
+	snprintf(heap->counter_names[0], sizeof(heap->counter_names[0]), "%s live bytes", heap->name);
+	snprintf(heap->counter_names[1], sizeof(heap->counter_names[1]), "%s cached bytes", heap->name);
+	snprintf(heap->counter_names[2], sizeof(heap->counter_names[2]), "%s arena bytes", heap->name);
+	snprintf(heap->counter_names[3], sizeof(heap->counter_names[3]), "%s outstanding allocations", heap->name);
+	heap->budget = info->budget;
 	heap->tlsf = tlsf_create(heap + 1);
 	heap->arena = NULL;
+	heap->caches = NULL;
+	heap->cache_tls = thread_local_alloc_ex(heap_cache_release);
+
+	heap->reserve_base = (char*)(((uintptr_t)reserve_mapping + granule - 1) & ~(uintptr_t)(granule - 1));
+	heap->reserve_size = reserve_size;
+	heap->reserve_top = 0;
+	heap->reserve_mapping = reserve_mapping;
+	heap->reserve_mapping_size = reserve_mapping_size;
+	heap->page_size = granule;
+	heap->large_pages = large_page_size != 0;
+	heap->free_range_count = 0;
+
+	heap->alloc_count = 0;
+	heap->free_count = 0;
+	heap->live_bytes = 0;
+	heap->peak_live_bytes = 0;
+	heap->arena_bytes = 0;
+	heap->arena_count = 0;
+	heap->arenas_released = 0;
+	heap->large_alloc_count = 0;
+	heap->large_alloc_bytes = 0;
+	heap->large_page_bytes = 0;
+	heap->committed_bytes = 0;
+
+	heap->large_alloc_threshold = info->large_alloc_threshold ? info->large_alloc_threshold : info->grow_increment / 2;
+	heap->retain_bytes = info->retain_bytes ? info->retain_bytes : info->grow_increment;
+	heap->frees_since_trim = 0;
+	heap->large_allocs = NULL;
+
+	heap->leak_mode = info->leak_mode;
+	heap->sample_bytes = info->sample_bytes;
+	heap->sample_allocations = __max(info->sample_allocations, 1);
+	heap->trailer_size = 0;
+	heap->stacks = NULL;
+	if (heap->leak_mode != k_heap_leak_off)
+	{
+		heap->stacks = heap_map_standalone(sizeof(callstack_t) * k_heap_stack_table_capacity);
+		if (heap->stacks)
+		{
+			heap->trailer_size = sizeof(uint32_t);
+		}
+		else
+		{
+			heap->leak_mode = k_heap_leak_off;
+		}
+	}
 
 	return heap;
 }
 
-void* heap_alloc(heap_t* heap, size_t size, size_t alignment)
+// Claim a page-aligned span of the reservation, first fit.
+// The span is not committed. Returns NULL if the reservation is exhausted.
+// Must be called with the heap mutex held.
+static void* heap_range_alloc_locked(heap_t* heap, size_t size)
+{
+	for (int i = 0; i < heap->free_range_count; ++i)
+	{
+		vm_range_t* range = &heap->free_ranges[i];
+		if (range->size >= size)
+		{
+			void* address = heap->reserve_base + range->offset;
+			range->offset += size;
+			range->size -= size;
+			if (range->size == 0)
+			{
+				memmove(range, range + 1, sizeof(vm_range_t) * (heap->free_range_count - i - 1));
+				heap->free_range_count--;
+			}
+			return address;
+		}
+	}
+
+	if (size > heap->reserve_size - heap->reserve_top)
+	{
+		return NULL;
+	}
+	void* address = heap->reserve_base + heap->reserve_top;
+	heap->reserve_top += size;
+	return address;
+}
+
+// Give a decommitted span back to the reservation, merging with neighbors.
+// Must be called with the heap mutex held.
+static void heap_range_free_locked(heap_t* heap, void* address, size_t size)
+{
+	size_t offset = (char*)address - heap->reserve_base;
+
+	int i = 0;
+	while (i < heap->free_range_count && heap->free_ranges[i].offset < offset)
+	{
+		++i;
+	}
+
+	bool merge_prev = i > 0 && heap->free_ranges[i - 1].offset + heap->free_ranges[i - 1].size == offset;
+	bool merge_next = i < heap->free_range_count && offset + size == heap->free_ranges[i].offset;
+	if (merge_prev && merge_next)
+	{
+		heap->free_ranges[i - 1].size += size + heap->free_ranges[i].size;
+		memmove(&heap->free_ranges[i], &heap->free_ranges[i + 1], sizeof(vm_range_t) * (heap->free_range_count - i - 1));
+		heap->free_range_count--;
+		i = i - 1;
+	}
+	else if (merge_prev)
+	{
+		heap->free_ranges[i - 1].size += size;
+		i = i - 1;
+	}
+	else if (merge_next)
+	{
+		heap->free_ranges[i].offset = offset;
+		heap->free_ranges[i].size += size;
+	}
+	else if (heap->free_range_count < k_heap_max_free_ranges)
+	{
+		memmove(&heap->free_ranges[i + 1], &heap->free_ranges[i], sizeof(vm_range_t) * (heap->free_range_count - i));
+		heap->free_ranges[i] = (vm_range_t) { .offset = offset, .size = size };
+		heap->free_range_count++;
+	}
+	else
+	{
+		// Table full: the span stays decommitted but is not reused.
+		return;
+	}
+
+	// A span that reaches the top just lowers the top.
+	vm_range_t* range = &heap->free_ranges[i];
+	if (i == heap->free_range_count - 1 && range->offset + range->size == heap->reserve_top)
+	{
+		heap->reserve_top = range->offset;
+		heap->free_range_count--;
+	}
+}
+
+static size_t heap_page_round(heap_t* heap, size_t size)
+{
+	return (size + heap->page_size - 1) & ~(heap->page_size - 1);
+}
+
+static bool heap_in_reservation(heap_t* heap, const void* address)
+{
+	return (const char*)address >= heap->reserve_base &&
+		(const char*)address < heap->reserve_base + heap->reserve_top;
+}
+
+// Obtain committed memory for an arena or large allocation.
+// Children allocate it from their parent. Large page heaps try a dedicated
+// large page mapping first; otherwise the span is claimed from the
+// reservation. Returns NULL if out of memory.
+// The mutex is only held to claim the span, not to commit it, unless the
+// caller already holds it.
+static void* heap_map_pages(heap_t* heap, size_t size)
+{
+	if (heap->parent)
+	{
+		return heap_alloc(heap->parent, size, k_heap_cache_line_size);
+	}
+
+	if (heap->large_pages)
+	{
+		void* address = vm_map_large_pages(size);
+		if (address)
+		{
+			mutex_lock(heap->mutex);
+			heap->large_page_bytes += size;
+			mutex_unlock(heap->mutex);
+			return address;
+		}
+	}
+
+	mutex_lock(heap->mutex);
+	void* address = heap_range_alloc_locked(heap, size);
+	mutex_unlock(heap->mutex);
+	if (address && !vm_commit(address, size))
+	{
+		mutex_lock(heap->mutex);
+		heap_range_free_locked(heap, address, size);
+		mutex_unlock(heap->mutex);
+		address = NULL;
+	}
+	if (address && heap->large_pages)
+	{
+		// No large pages reserved up front; let the OS promote the span.
+		vm_advise_large_pages(address, size);
+	}
+	return address;
+}
+
+// heap_map_pages, held to the heap's budget.
+static void* heap_map_span(heap_t* heap, size_t size)
 {
 	mutex_lock(heap->mutex);
-	// Add more allocated memory for the callstack
-	void* address = tlsf_memalign(heap->tlsf, alignment, size + sizeof(callstack_t)); 
+	bool over_budget = heap->budget && heap->committed_bytes + size > heap->budget;
+	if (!over_budget)
+	{
+		heap->committed_bytes += size;
+	}
+	mutex_unlock(heap->mutex);
+	if (over_budget)
+	{
+		debug_print(
+			k_print_error,
+			"HEAP '%s' OVER BUDGET OF %llu BYTES!\n", heap->name, (unsigned long long)heap->budget);
+		return NULL;
+	}
 
+	void* address = heap_map_pages(heap, size);
 	if (!address)
 	{
-		size_t arena_size =
+		mutex_lock(heap->mutex);
+		heap->committed_bytes -= size;
+		mutex_unlock(heap->mutex);
+	}
+	return address;
+}
+
+// Give back memory obtained with heap_map_span.
+static void heap_unmap_span(heap_t* heap, void* address, size_t size)
+{
+	mutex_lock(heap->mutex);
+	heap->committed_bytes -= size;
+	mutex_unlock(heap->mutex);
+
+	if (heap->parent)
+	{
+		heap_free(heap->parent, address);
+		return;
+	}
+
+	if (!heap_in_reservation(heap, address))
+	{
+		vm_release(address, size);
+		mutex_lock(heap->mutex);
+		heap->large_page_bytes -= size;
+		mutex_unlock(heap->mutex);
+		return;
+	}
+
+	vm_decommit(address, size);
+	mutex_lock(heap->mutex);
+	heap_range_free_locked(heap, address, size);
+	mutex_unlock(heap->mutex);
+}
+
+static void heap_free_locked(heap_t* heap, void* address);
+
+// Hand a chain of blocks linked through their first word to the next
+// mutex holder. Lock-free; pushes never suffer from ABA since blocks are
+// only ever taken off by swapping out the whole stack.
+static void heap_push_remote_frees(heap_t* heap, void* first, void* last)
+{
+	void* head = atomic_load_pointer(&heap->remote_frees);
+	while (true)
+	{
+		*(void**)last = head;
+		void* observed = atomic_compare_and_exchange_pointer(&heap->remote_frees, head, first);
+		if (observed == head)
+		{
+			break;
+		}
+		head = observed;
+	}
+}
+
+// Return every block freed by other threads to TLSF.
+// Must be called with the heap mutex held.
+static void heap_drain_remote_frees_locked(heap_t* heap)
+{
+	void* block = atomic_exchange_pointer(&heap->remote_frees, NULL);
+	while (block)
+	{
+		void* next = *(void**)block;
+		heap_free_locked(heap, block);
+		block = next;
+	}
+}
+
+// Allocate a raw block from TLSF, growing the heap if needed.
+// Must be called with the heap mutex held.
+static void* heap_alloc_locked(heap_t* heap, size_t size, size_t alignment)
+{
+	heap_drain_remote_frees_locked(heap);
+
+	void* address = tlsf_memalign(heap->tlsf, alignment, size);
+	if (!address)
+	{
+		size_t arena_size = heap_page_round(heap,
 			__max(heap->grow_increment, size * 2) +
-			sizeof(arena_t);
-		arena_t* arena = VirtualAlloc(NULL,
-			arena_size + tlsf_pool_overhead(),
-			MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+			sizeof(arena_t) + tlsf_pool_overhead() + alignment);
+		arena_t* arena = heap_map_span(heap, arena_size);
 		if (!arena)
 		{
 			debug_print(
@@ -104,61 +615,840 @@ void* heap_alloc(heap_t* heap, size_t size, size_t alignment)
 			return NULL;
 		}
 
-		arena->pool = tlsf_add_pool(heap->tlsf, arena + 1, arena_size);
+		arena->pool = tlsf_add_pool(heap->tlsf, arena + 1, arena_size - sizeof(arena_t));
+		arena->size = arena_size;
 
 		arena->next = heap->arena;
 		heap->arena = arena;
+		heap->arena_bytes += arena_size;
+		heap->arena_count++;
 
-		address = tlsf_memalign(heap->tlsf, alignment, size + sizeof(callstack_t));
+		address = tlsf_memalign(heap->tlsf, alignment, size);
 	}
+	if (address)
+	{
+		heap->live_bytes += tlsf_block_size(address);
+		heap->peak_live_bytes = __max(heap->peak_live_bytes, heap->live_bytes);
+	}
+	return address;
+}
 
-	// If address was allocated, create a callstack for the allocation and store it
-	// behind the actual chunk of memory
-	if (address) {
-		callstack_t* callstack = (callstack_t*)((char*)address + size);
-		callstack->frames = debug_backtrace(callstack->stack, 10);
+static void heap_trim_locked(heap_t* heap);
+
+// Return a raw block to TLSF.
+// Must be called with the heap mutex held.
+static void heap_free_locked(heap_t* heap, void* address)
+{
+	heap->live_bytes -= tlsf_block_size(address);
+	tlsf_free(heap->tlsf, address);
+
+	if (++heap->frees_since_trim >= k_heap_trim_interval)
+	{
+		heap_trim_locked(heap);
 	}
+}
 
+// Release empty arenas beyond the retain budget.
+// Must be called with the heap mutex held.
+static void heap_trim_locked(heap_t* heap)
+{
+	heap->frees_since_trim = 0;
+
+	size_t retained = 0;
+	arena_t** link = &heap->arena;
+	while (*link)
+	{
+		arena_t* arena = *link;
+		if (tlsf_pool_is_empty(arena->pool))
+		{
+			if (retained + arena->size <= heap->retain_bytes)
+			{
+				retained += arena->size;
+			}
+			else
+			{
+				tlsf_remove_pool(heap->tlsf, arena->pool);
+				*link = arena->next;
+				heap->arena_bytes -= arena->size;
+				heap->arena_count--;
+				heap->arenas_released++;
+				heap_unmap_span(heap, arena, arena->size);
+				continue;
+			}
+		}
+		link = &arena->next;
+	}
+}
+
+static large_alloc_t* heap_large_header(void* address)
+{
+	uintptr_t marker = ((uintptr_t*)address)[-1];
+	return (marker & 1) ? (large_alloc_t*)(marker & ~(uintptr_t)1) : NULL;
+}
+
+// Allocate dedicated pages, bypassing TLSF.
+static void* heap_alloc_large(heap_t* heap, size_t size, size_t alignment)
+{
+	alignment = __max(alignment, sizeof(uintptr_t));
+	size_t offset = (sizeof(large_alloc_t) + sizeof(uintptr_t) + (alignment - 1)) & ~(alignment - 1);
+	// Spans are page aligned; larger alignments need slack to slide into.
+	size_t slack = alignment > heap->page_size ? alignment : 0;
+	size_t mapped_size = heap_page_round(heap, offset + size + slack);
+
+	char* base = heap_map_span(heap, mapped_size);
+	if (!base)
+	{
+		debug_print(
+			k_print_error,
+			"OUT OF MEMORY!\n");
+		return NULL;
+	}
+
+	char* address = (char*)(((uintptr_t)base + offset + (alignment - 1)) & ~(uintptr_t)(alignment - 1));
+	large_alloc_t* large = (large_alloc_t*)(address - offset);
+	((uintptr_t*)address)[-1] = (uintptr_t)large | 1;
+	large->size = size;
+	large->mapped_base = base;
+	large->mapped_size = mapped_size;
+	large->stack_id = 0;
+	large->prev = NULL;
+
+	mutex_lock(heap->mutex);
+	large->next = heap->large_allocs;
+	if (large->next)
+	{
+		large->next->prev = large;
+	}
+	heap->large_allocs = large;
+	heap->large_alloc_count++;
+	heap->large_alloc_bytes += size;
+	heap->live_bytes += size;
+	heap->peak_live_bytes = __max(heap->peak_live_bytes, heap->live_bytes);
+	heap->alloc_count++;
 	mutex_unlock(heap->mutex);
 
 	return address;
 }
 
+static void heap_free_large(heap_t* heap, large_alloc_t* large)
+{
+	mutex_lock(heap->mutex);
+	if (large->prev)
+	{
+		large->prev->next = large->next;
+	}
+	else
+	{
+		heap->large_allocs = large->next;
+	}
+	if (large->next)
+	{
+		large->next->prev = large->prev;
+	}
+	heap->large_alloc_count--;
+	heap->large_alloc_bytes -= large->size;
+	heap->live_bytes -= large->size;
+	heap->free_count++;
+	mutex_unlock(heap->mutex);
+
+	heap_unmap_span(heap, large->mapped_base, large->mapped_size);
+}
+
+// Find the cache size class that can satisfy an allocation of size bytes.
+// Returns -1 if the allocation is too large to be cached.
+static int heap_cache_class_for_alloc(size_t size)
+{
+	for (int c = 0; c < k_heap_cache_class_count; ++c)
+	{
+		if (size <= ((size_t)1 << (c + k_heap_cache_min_class_log2)))
+		{
+			return c;
+		}
+	}
+	return -1;
+}
+
+// Find the cache size class that a block with the given usable size can serve.
+// Returns -1 if the block should go straight back to TLSF.
+static int heap_cache_class_for_free(size_t usable_size)
+{
+	int c = -1;
+	while (c + 1 < k_heap_cache_class_count &&
+		usable_size >= ((size_t)1 << (c + 1 + k_heap_cache_min_class_log2)))
+	{
+		++c;
+	}
+	if (c >= 0 && usable_size >= ((size_t)2 << (c + k_heap_cache_min_class_log2)))
+	{
+		// Far larger than the biggest class; caching it would strand memory.
+		return -1;
+	}
+	return c;
+}
+
+static uint32_t heap_random(heap_cache_t* cache)
+{
+	uint32_t x = cache->random;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	cache->random = x;
+	return x;
+}
+
+// Draw the distance to the next sampled allocation.
+// Exponentially distributed intervals make sampling a Poisson process, so
+// every byte (or allocation) has the same chance of being picked.
+static int64_t heap_next_sample_interval(heap_t* heap, heap_cache_t* cache)
+{
+	double mean = (double)(heap->sample_bytes ? heap->sample_bytes : heap->sample_allocations);
+	double u = ((heap_random(cache) >> 8) + 1) / (double)(1 << 24);
+	return (int64_t)(-log(u) * mean) + 1;
+}
+
+static heap_cache_t* heap_get_cache(heap_t* heap)
+{
+	heap_cache_t* cache = thread_local_get(heap->cache_tls);
+	if (!cache)
+	{
+		mutex_lock(heap->mutex);
+		cache = heap_alloc_locked(heap, sizeof(heap_cache_t), 8);
+		if (cache)
+		{
+			// The block may be reused memory; start every count at zero.
+			memset(cache, 0, sizeof(*cache));
+			cache->random = (uint32_t)(uintptr_t)cache ^ thread_get_id() ^ 0x9e3779b9u;
+			cache->random = cache->random ? cache->random : 1;
+			cache->next = heap->caches;
+			cache->heap = heap;
+			heap->caches = cache;
+		}
+		mutex_unlock(heap->mutex);
+		if (cache)
+		{
+			cache->sample_countdown = heap_next_sample_interval(heap, cache);
+		}
+		thread_local_set(heap->cache_tls, cache);
+	}
+	return cache;
+}
+
+// Decide whether an allocation of size bytes should record its call stack.
+static bool heap_should_sample(heap_t* heap, heap_cache_t* cache, size_t size)
+{
+	if (heap->leak_mode == k_heap_leak_full)
+	{
+		return true;
+	}
+	if (heap->leak_mode != k_heap_leak_sampled || !cache)
+	{
+		return false;
+	}
+	cache->sample_countdown -= heap->sample_bytes ? (int64_t)size : 1;
+	if (cache->sample_countdown > 0)
+	{
+		return false;
+	}
+	cache->sample_countdown = heap_next_sample_interval(heap, cache);
+	return true;
+}
+
+// Capture the current call stack and find or insert it in the side table.
+// Returns the stack id, or zero if the table is full.
+// Lock-free: a slot is claimed by swapping its hash in from zero.
+static uint32_t heap_record_stack(heap_t* heap)
+{
+	void* stack[k_heap_stack_max_frames];
+	int frames = debug_backtrace(stack, k_heap_stack_max_frames);
+
+	// FNV-1a over the frame addresses.
+	uint64_t hash = 14695981039346656037ULL;
+	for (int i = 0; i < frames; ++i)
+	{
+		hash ^= (uint64_t)(uintptr_t)stack[i];
+		hash *= 1099511628211ULL;
+	}
+	int64_t key = hash ? (int64_t)hash : 1;
+
+	for (uint32_t probe = 0; probe < k_heap_stack_table_capacity; ++probe)
+	{
+		uint32_t index = (uint32_t)(hash + probe) & (k_heap_stack_table_capacity - 1);
+		callstack_t* entry = &heap->stacks[index];
+		int64_t existing = atomic_load64(&entry->hash);
+		if (existing == 0)
+		{
+			existing = atomic_compare_and_exchange64(&entry->hash, 0, key);
+			if (existing == 0)
+			{
+				entry->frames = frames;
+				memcpy(entry->stack, stack, sizeof(void*) * frames);
+				return index + 1;
+			}
+		}
+		if (existing == key)
+		{
+			return index + 1;
+		}
+	}
+	return 0;
+}
+
+// Return count blocks of a size class from a cache to TLSF.
+// Must be called with the heap mutex held.
+static void heap_cache_flush_locked(heap_t* heap, heap_cache_t* cache, int size_class, int count)
+{
+	for (int i = 0; i < count && cache->counts[size_class] > 0; ++i)
+	{
+		void* block = cache->blocks[size_class][--cache->counts[size_class]];
+		cache->cached_bytes -= tlsf_block_size(block);
+		heap_free_locked(heap, block);
+	}
+}
+
+// Return an exiting thread's cached blocks to TLSF, fold its statistics
+// into the heap's and free the cache. Destructor of the cache slot.
+static void heap_cache_release(void* value)
+{
+	heap_cache_t* cache = value;
+	heap_t* heap = cache->heap;
+	mutex_lock(heap->mutex);
+	for (int c = 0; c < k_heap_cache_class_count; ++c)
+	{
+		heap_cache_flush_locked(heap, cache, c, k_heap_cache_capacity);
+	}
+	heap->alloc_count += cache->alloc_count;
+	heap->free_count += cache->free_count;
+	heap_cache_t** link = &heap->caches;
+	while (*link != cache)
+	{
+		link = &(*link)->next;
+	}
+	*link = cache->next;
+	heap_free_locked(heap, cache);
+	mutex_unlock(heap->mutex);
+}
+
+static void* heap_cache_alloc(heap_t* heap, heap_cache_t* cache, int size_class)
+{
+	if (cache->counts[size_class] == 0)
+	{
+		size_t block_size = ((size_t)1 << (size_class + k_heap_cache_min_class_log2)) + heap->trailer_size;
+		mutex_lock(heap->mutex);
+		for (int i = 0; i < k_heap_cache_batch; ++i)
+		{
+			void* block = heap_alloc_locked(heap, block_size, tlsf_align_size());
+			if (!block)
+			{
+				break;
+			}
+			cache->blocks[size_class][cache->counts[size_class]++] = block;
+			cache->cached_bytes += tlsf_block_size(block);
+		}
+		mutex_unlock(heap->mutex);
+
+		if (cache->counts[size_class] == 0)
+		{
+			return NULL;
+		}
+	}
+	void* address = cache->blocks[size_class][--cache->counts[size_class]];
+	cache->cached_bytes -= tlsf_block_size(address);
+	return address;
+}
+
+// Return count blocks of a size class from a cache without waiting for the
+// mutex, as one chain on the remote free stack.
+static void heap_cache_flush_remote(heap_t* heap, heap_cache_t* cache, int size_class, int count)
+{
+	void* first = NULL;
+	void* last = NULL;
+	for (int i = 0; i < count && cache->counts[size_class] > 0; ++i)
+	{
+		void* block = cache->blocks[size_class][--cache->counts[size_class]];
+		cache->cached_bytes -= tlsf_block_size(block);
+		*(void**)block = first;
+		first = block;
+		last = last ? last : block;
+	}
+	if (first)
+	{
+		heap_push_remote_frees(heap, first, last);
+	}
+}
+
+static void heap_cache_free(heap_t* heap, heap_cache_t* cache, int size_class, void* address)
+{
+	if (cache->counts[size_class] == k_heap_cache_capacity)
+	{
+		// A thread that only frees, such as the consumer of a queue, should
+		// not stall behind the threads allocating what it frees.
+		if (mutex_try_lock(heap->mutex))
+		{
+			heap_drain_remote_frees_locked(heap);
+			heap_cache_flush_locked(heap, cache, size_class, k_heap_cache_batch);
+			mutex_unlock(heap->mutex);
+		}
+		else
+		{
+			heap_cache_flush_remote(heap, cache, size_class, k_heap_cache_batch);
+		}
+	}
+	cache->blocks[size_class][cache->counts[size_class]++] = address;
+	cache->cached_bytes += tlsf_block_size(address);
+}
+
+// Location of the call stack id stored at the end of a block.
+static uint32_t* heap_block_trailer(void* address, size_t block_size)
+{
+	return (uint32_t*)((char*)address + block_size - sizeof(uint32_t));
+}
+
+// Call stack id of a live block, or zero if it was not sampled.
+static uint32_t heap_get_stack_id(heap_t* heap, void* address)
+{
+	if (!heap->trailer_size)
+	{
+		return 0;
+	}
+	large_alloc_t* large = heap_large_header(address);
+	return large ? large->stack_id : *heap_block_trailer(address, tlsf_block_size(address));
+}
+
+static void heap_set_stack_id(heap_t* heap, void* address, uint32_t stack_id)
+{
+	if (!heap->trailer_size)
+	{
+		return;
+	}
+	large_alloc_t* large = heap_large_header(address);
+	if (large)
+	{
+		large->stack_id = stack_id;
+	}
+	else
+	{
+		*heap_block_trailer(address, tlsf_block_size(address)) = stack_id;
+	}
+}
+
+void* heap_alloc(heap_t* heap, size_t size, size_t alignment)
+{
+	void* address = NULL;
+
+	if (size > heap->large_alloc_threshold)
+	{
+		address = heap_alloc_large(heap, size, alignment);
+		if (address && heap->trailer_size)
+		{
+			heap_cache_t* cache = heap_get_cache(heap);
+			heap_large_header(address)->stack_id = heap_should_sample(heap, cache, size) ? heap_record_stack(heap) : 0;
+		}
+		return address;
+	}
+
+	// Small, naturally aligned allocations are served from the thread's cache
+	// without taking the heap mutex.
+	heap_cache_t* cache = heap_get_cache(heap);
+	int size_class = alignment <= tlsf_align_size() ? heap_cache_class_for_alloc(size) : -1;
+	if (cache && size_class >= 0)
+	{
+		address = heap_cache_alloc(heap, cache, size_class);
+		cache->alloc_count++;
+	}
+	else
+	{
+		mutex_lock(heap->mutex);
+		// Add room for the call stack id
+		address = heap_alloc_locked(heap, size + heap->trailer_size, alignment);
+		heap->alloc_count++;
+		mutex_unlock(heap->mutex);
+	}
+
+	// Tag the block with its call stack, or zero if it was not sampled.
+	if (address && heap->trailer_size)
+	{
+		uint32_t stack_id = heap_should_sample(heap, cache, size) ? heap_record_stack(heap) : 0;
+		*heap_block_trailer(address, tlsf_block_size(address)) = stack_id;
+	}
+
+	return address;
+}
+
 void heap_free(heap_t* heap, void* address)
 {
+	if (!address)
+	{
+		return;
+	}
+
+	large_alloc_t* large = heap_large_header(address);
+	if (large)
+	{
+		heap_free_large(heap, large);
+		return;
+	}
+
+	int size_class = heap_cache_class_for_free(tlsf_block_size(address) - heap->trailer_size);
+	heap_cache_t* cache = size_class >= 0 ? heap_get_cache(heap) : NULL;
+	if (cache)
+	{
+		heap_cache_free(heap, cache, size_class, address);
+		cache->free_count++;
+		return;
+	}
+
+	// If another thread holds the mutex, leave the block for it to free.
+	if (!mutex_try_lock(heap->mutex))
+	{
+		cache = heap_get_cache(heap);
+		if (cache)
+		{
+			heap_push_remote_frees(heap, address, address);
+			cache->free_count++;
+			return;
+		}
+		mutex_lock(heap->mutex);
+	}
+	heap_drain_remote_frees_locked(heap);
+	heap_free_locked(heap, address);
+	heap->free_count++;
+	mutex_unlock(heap->mutex);
+}
+
+void* heap_realloc(heap_t* heap, void* address, size_t size, size_t alignment)
+{
+	if (!address)
+	{
+		return heap_alloc(heap, size, alignment);
+	}
+	if (size == 0)
+	{
+		heap_free(heap, address);
+		return NULL;
+	}
+
+	size_t old_size;
+	large_alloc_t* large = heap_large_header(address);
+	if (large)
+	{
+		// The committed pages usually have slack past the end of the block.
+		size_t capacity = large->mapped_size - ((char*)address - large->mapped_base);
+		if (size > heap->large_alloc_threshold && size <= capacity)
+		{
+			mutex_lock(heap->mutex);
+			heap->large_alloc_bytes = heap->large_alloc_bytes - large->size + size;
+			heap->live_bytes = heap->live_bytes - large->size + size;
+			heap->peak_live_bytes = __max(heap->peak_live_bytes, heap->live_bytes);
+			mutex_unlock(heap->mutex);
+			large->size = size;
+			return address;
+		}
+		old_size = large->size;
+	}
+	else
+	{
+		size_t block_size = tlsf_block_size(address);
+		old_size = block_size - heap->trailer_size;
+		if (size <= heap->large_alloc_threshold && alignment <= tlsf_align_size())
+		{
+			// Shrinking the block may write a free block header over the
+			// trailer, so read the stack id first.
+			uint32_t stack_id = heap_get_stack_id(heap, address);
+
+			// TLSF grows in place when the next physical block is free.
+			// Otherwise it moves the block within the existing arenas.
+			mutex_lock(heap->mutex);
+			void* resized = tlsf_realloc(heap->tlsf, address, size + heap->trailer_size);
+			if (resized)
+			{
+				heap->live_bytes = heap->live_bytes - block_size + tlsf_block_size(resized);
+				heap->peak_live_bytes = __max(heap->peak_live_bytes, heap->live_bytes);
+			}
+			mutex_unlock(heap->mutex);
+
+			if (resized)
+			{
+				heap_set_stack_id(heap, resized, stack_id);
+				return resized;
+			}
+			// No arena has room; fall through and let heap_alloc grow the heap.
+		}
+		else if (size <= old_size && size <= heap->large_alloc_threshold && ((uintptr_t)address & (alignment - 1)) == 0)
+		{
+			// TLSF only keeps its natural alignment when it moves a block,
+			// so over-aligned blocks are resized in place only when shrinking.
+			return address;
+		}
+	}
+
+	// Move the block, keeping the call stack of the original allocation.
+	void* resized = heap_alloc(heap, size, alignment);
+	if (resized)
+	{
+		memcpy(resized, address, __min(old_size, size));
+		heap_set_stack_id(heap, resized, heap_get_stack_id(heap, address));
+		heap_free(heap, address);
+	}
+	return resized;
+}
+
+bool heap_owns(heap_t* heap, const void* address)
+{
+	if (heap_in_reservation(heap, address) || !(heap->large_pages || heap->parent))
+	{
+		return heap_in_reservation(heap, address);
+	}
+
+	// Large page mappings and memory from a parent live outside the reservation.
+	bool owned = false;
 	mutex_lock(heap->mutex);
-	tlsf_free(heap->tlsf, address);
+	for (arena_t* arena = heap->arena; arena && !owned; arena = arena->next)
+	{
+		owned = (const char*)address >= (const char*)arena && (const char*)address < (const char*)arena + arena->size;
+	}
+	for (large_alloc_t* large = heap->large_allocs; large && !owned; large = large->next)
+	{
+		owned = (const char*)address >= large->mapped_base && (const char*)address < large->mapped_base + large->mapped_size;
+	}
+	mutex_unlock(heap->mutex);
+	return owned;
+}
+
+void heap_trim(heap_t* heap)
+{
+	heap_cache_t* cache = thread_local_get(heap->cache_tls);
+
+	mutex_lock(heap->mutex);
+	if (cache)
+	{
+		for (int c = 0; c < k_heap_cache_class_count; ++c)
+		{
+			heap_cache_flush_locked(heap, cache, c, k_heap_cache_capacity);
+		}
+	}
+	heap_drain_remote_frees_locked(heap);
+	heap_trim_locked(heap);
+	mutex_unlock(heap->mutex);
+}
+
+void heap_get_stats(heap_t* heap, heap_stats_t* stats)
+{
+	mutex_lock(heap->mutex);
+	stats->live_bytes = heap->live_bytes;
+	stats->peak_live_bytes = heap->peak_live_bytes;
+	stats->arena_bytes = heap->arena_bytes;
+	stats->arena_count = heap->arena_count;
+	stats->arenas_released = heap->arenas_released;
+	stats->large_alloc_count = heap->large_alloc_count;
+	stats->large_alloc_bytes = heap->large_alloc_bytes;
+	stats->large_page_bytes = heap->large_page_bytes;
+	stats->committed_bytes = heap->committed_bytes;
+	stats->budget = heap->budget;
+	stats->alloc_count = heap->alloc_count;
+	stats->free_count = heap->free_count;
+	stats->cached_bytes = 0;
+	for (heap_cache_t* cache = heap->caches; cache; cache = cache->next)
+	{
+		// Owned by other threads; a slightly stale read is fine for statistics.
+		stats->alloc_count += cache->alloc_count;
+		stats->free_count += cache->free_count;
+		stats->cached_bytes += cache->cached_bytes;
+	}
+	mutex_unlock(heap->mutex);
+}
+
+// State of a fragmentation walk: the report and the arena being walked.
+typedef struct fragmentation_walk_t
+{
+	heap_fragmentation_t* report;
+	heap_arena_report_t arena;
+} fragmentation_walk_t;
+
+static void fragmentation_walker(void* ptr, size_t size, int used, void* user)
+{
+	fragmentation_walk_t* walk = user;
+	heap_fragmentation_t* report = walk->report;
+	heap_arena_report_t* arena = &walk->arena;
+	if (used)
+	{
+		arena->used_bytes += size;
+		return;
+	}
+
+	report->free_bytes += size;
+	report->free_block_count++;
+	report->largest_free_block = __max(report->largest_free_block, size);
+
+	int bucket = 0;
+	while (bucket + 1 < k_heap_report_histogram_buckets && size >= ((size_t)32 << bucket))
+	{
+		++bucket;
+	}
+	report->free_block_histogram[bucket]++;
+
+	arena->free_bytes += size;
+	arena->largest_free_block = __max(arena->largest_free_block, size);
+}
+
+void heap_get_fragmentation(heap_t* heap, heap_fragmentation_t* report)
+{
+	memset(report, 0, sizeof(*report));
+
+	mutex_lock(heap->mutex);
+	heap_drain_remote_frees_locked(heap);
+	for (arena_t* arena = heap->arena; arena; arena = arena->next)
+	{
+		fragmentation_walk_t walk = { .report = report, .arena = { .base = arena, .size = arena->size } };
+		tlsf_walk_pool(arena->pool, fragmentation_walker, &walk);
+		if (report->arena_count < k_heap_report_max_arenas)
+		{
+			report->arenas[report->arena_count] = walk.arena;
+		}
+		report->arena_count++;
+
+		heap_arena_report_t* emptiest = &report->emptiest_arena;
+		if (walk.arena.used_bytes > 0 &&
+			(!emptiest->size || walk.arena.used_bytes * emptiest->size < emptiest->used_bytes * walk.arena.size))
+		{
+			*emptiest = walk.arena;
+		}
+	}
 	mutex_unlock(heap->mutex);
 }
 
-void check_pool(void* ptr, size_t size, int used, void* user)
+void heap_trace_counters(heap_t* heap, trace_t* trace)
+{
+	heap_stats_t stats;
+	heap_get_stats(heap, &stats);
+	trace_counter(trace, heap->counter_names[0], (int64_t)stats.live_bytes);
+	trace_counter(trace, heap->counter_names[1], (int64_t)stats.cached_bytes);
+	trace_counter(trace, heap->counter_names[2], (int64_t)stats.arena_bytes);
+	trace_counter(trace, heap->counter_names[3], (int64_t)(stats.alloc_count - stats.free_count));
+}
+
+const char* heap_get_name(heap_t* heap)
+{
+	return heap->name;
+}
+
+typedef struct leak_report_t
+{
+	heap_t* heap;
+	int untraced_count;
+	size_t untraced_bytes;
+} leak_report_t;
+
+static void check_pool(void* ptr, size_t size, int used, void* user)
 {
 	if (used) {
 		//LEAK
-		debug_print(k_print_error, "Memory leak of size %d bytes with callstack:\n", (int)size - (int)sizeof(callstack_t));
-		//get callstack_t of ptr with pointer arithmetic (current place + size + callstack size)
-		callstack_t* cs = (callstack_t*)((char*)ptr + size - sizeof(callstack_t));
-		//use bt_print to output info
-		bt_print(cs->frames, cs->stack);
+		leak_report_t* report = user;
+		heap_t* heap = report->heap;
+		uint32_t stack_id = heap->trailer_size ? *heap_block_trailer(ptr, size) : 0;
+		if (stack_id)
+		{
+			callstack_t* cs = &heap->stacks[stack_id - 1];
+			debug_print(k_print_error, "Memory leak of size %d bytes with callstack:\n", (int)(size - heap->trailer_size));
+			bt_print(cs->frames, cs->stack);
+		}
+		else if (heap->leak_mode == k_heap_leak_off)
+		{
+			debug_print(k_print_error, "Memory leak of size %d bytes\n", (int)size);
+		}
+		else
+		{
+			// Not sampled; summarized once the walk is done.
+			report->untraced_count++;
+			report->untraced_bytes += size - heap->trailer_size;
+		}
 	}
 }
 
 void heap_destroy(heap_t* heap)
 {
+	// Free the slot first: on Windows that may release the caches of live
+	// threads through the destructor, which must find them still linked.
+	thread_local_free(heap->cache_tls);
+
+	// Return every thread's cached blocks so the leak walk only sees live allocations.
+	heap_cache_t* cache = heap->caches;
+	while (cache)
+	{
+		heap_cache_t* next = cache->next;
+		for (int c = 0; c < k_heap_cache_class_count; ++c)
+		{
+			heap_cache_flush_locked(heap, cache, c, k_heap_cache_capacity);
+		}
+		heap_free_locked(heap, cache);
+		cache = next;
+	}
+	heap_drain_remote_frees_locked(heap);
+
 	tlsf_destroy(heap->tlsf);
 
+	leak_report_t report = { .heap = heap };
 	arena_t* arena = heap->arena;
 	while (arena)
 	{
-		//Check then free
-		tlsf_walk_pool(arena->pool, check_pool, NULL);
+		//Check; the memory goes away with the reservation below
+		tlsf_walk_pool(arena->pool, check_pool, &report);
+		arena = arena->next;
+	}
+	for (large_alloc_t* large = heap->large_allocs; large; large = large->next)
+	{
+		if (large->stack_id)
+		{
+			callstack_t* cs = &heap->stacks[large->stack_id - 1];
+			debug_print(k_print_error, "Memory leak of size %d bytes with callstack:\n", (int)large->size);
+			bt_print(cs->frames, cs->stack);
+		}
+		else
+		{
+			debug_print(k_print_error, "Memory leak of size %d bytes\n", (int)large->size);
+		}
+	}
+
+	if (report.untraced_count)
+	{
+		debug_print(k_print_error, "%d more leaked allocations (%d bytes) were not sampled for call stacks.\n",
+			report.untraced_count, (int)report.untraced_bytes);
+	}
+
+	if (heap->stacks)
+	{
+		vm_release(heap->stacks, sizeof(callstack_t) * k_heap_stack_table_capacity);
+	}
 
+	// Large page mappings and memory from a parent are separate from the
+	// reservation.
+	for (arena = heap->arena; arena; )
+	{
 		arena_t* next = arena->next;
-		VirtualFree(arena, 0, MEM_RELEASE);
+		if (!heap_in_reservation(heap, arena))
+		{
+			heap_unmap_span(heap, arena, arena->size);
+		}
 		arena = next;
 	}
+	for (large_alloc_t* large = heap->large_allocs; large; )
+	{
+		large_alloc_t* next = large->next;
+		if (!heap_in_reservation(heap, large->mapped_base))
+		{
+			heap_unmap_span(heap, large->mapped_base, large->mapped_size);
+		}
+		large = next;
+	}
 
 	mutex_destroy(heap->mutex);
 
-	VirtualFree(heap, 0, MEM_RELEASE);
+	if (heap->parent)
+	{
+		heap_free(heap->parent, heap);
+	}
+	else
+	{
+		vm_release(heap->reserve_mapping, heap->reserve_mapping_size);
+		vm_release(heap, sizeof(heap_t) + tlsf_size());
+	}
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 /*
 ====    CODING STANDARD     ====
@@ -13,10 +15,142 @@
 // 
 // Main object, heap_t, represents a dynamic memory heap.
 // Once created, memory can be allocated and free from the heap.
+//
+// Heaps form a hierarchy. A child heap carves its arenas out of a parent
+// heap but keeps its own allocator, statistics and budget, so that each
+// subsystem's memory can be measured and capped on its own.
 
 // Handle to a heap.
 typedef struct heap_t heap_t;
 
+typedef struct trace_t trace_t;
+
+enum
+{
+	// Number of arenas described individually in a fragmentation report.
+	k_heap_report_max_arenas = 32,
+	// Number of power-of-two buckets in the free block histogram.
+	k_heap_report_histogram_buckets = 16,
+};
+
+// How a heap records call stacks for leak reporting.
+typedef enum heap_leak_mode_t
+{
+	// No call stacks and no per-block overhead. Leaks are reported by size only.
+	k_heap_leak_off,
+	// Call stacks are captured for a random sample of allocations.
+	// See heap_info_t for the sampling interval.
+	k_heap_leak_sampled,
+	// Call stacks are captured for every allocation.
+	k_heap_leak_full,
+} heap_leak_mode_t;
+
+// Parameters for creating a heap with heap_create_ex.
+typedef struct heap_info_t
+{
+	// Default size with which the heap grows.
+	// Should be a multiple of OS page size.
+	size_t grow_increment;
+	// Heap that provides this heap's memory, or NULL to get it from the OS.
+	// The parent must outlive the child.
+	heap_t* parent;
+	// Name shown in budget errors and trace counters. Defaults to "heap".
+	const char* name;
+	// Most bytes of arenas and large allocations the heap may hold at once.
+	// Allocations that would exceed it fail. If zero, there is no budget.
+	size_t budget;
+	// Bytes of address space reserved up front. Arenas and large
+	// allocations are committed from this range as the heap grows, so it
+	// bounds the heap's size. If zero, a large platform default is used.
+	// Child heaps reserve nothing.
+	size_t reserve_size;
+	// Leak tracking mode.
+	heap_leak_mode_t leak_mode;
+	// Sampled mode: average number of allocated bytes between samples.
+	// Sampling points are drawn from an exponential distribution, so large
+	// allocations are proportionally more likely to be sampled.
+	// If zero, sample_allocations is used instead.
+	size_t sample_bytes;
+	// Sampled mode: average number of allocations between samples.
+	size_t sample_allocations;
+	// Allocations larger than this bypass the arenas and get their own OS
+	// mapping, which is released as soon as they are freed.
+	// If zero, half the grow increment is used.
+	size_t large_alloc_threshold;
+	// Bytes of completely free arenas kept instead of being returned to the
+	// OS, so a heap that repeatedly grows and shrinks does not thrash.
+	// If zero, one grow increment is kept.
+	size_t retain_bytes;
+	// Back arenas and large allocations with large pages (2 MB on x64) to
+	// cut TLB misses on big heaps. Arenas and large allocations are then
+	// rounded up to whole large pages.
+	// Windows requires the "Lock pages in memory" privilege. Linux uses
+	// pages set aside in /proc/sys/vm/nr_hugepages, or failing that asks
+	// for transparent huge pages. Falls back to normal pages when large
+	// pages are unavailable; see heap_stats_t.large_page_bytes.
+	// Child heaps use whatever pages back their parent.
+	bool large_pages;
+} heap_info_t;
+
+// Counters describing a heap's memory use.
+typedef struct heap_stats_t
+{
+	// Bytes in blocks currently taken from the arenas, including blocks
+	// parked in thread caches and allocator bookkeeping.
+	size_t live_bytes;
+	// Highest value live_bytes has reached.
+	size_t peak_live_bytes;
+	// Bytes parked in thread caches, free for reuse but not yet returned.
+	size_t cached_bytes;
+	// Bytes of memory obtained from the OS for arenas.
+	size_t arena_bytes;
+	// Number of arenas backing the heap.
+	int arena_count;
+	// Number of arenas returned to the OS after becoming empty.
+	int arenas_released;
+	// Allocations that bypassed the arenas, and their bytes.
+	int large_alloc_count;
+	size_t large_alloc_bytes;
+	// Bytes mapped with dedicated large pages. Memory the OS backs with
+	// transparent huge pages is not counted.
+	size_t large_page_bytes;
+	// Bytes of arenas and large allocations, and the cap on them, if any.
+	size_t committed_bytes;
+	size_t budget;
+	// Total number of heap_alloc and heap_free calls.
+	uint64_t alloc_count;
+	uint64_t free_count;
+} heap_stats_t;
+
+// Utilization of a single arena.
+typedef struct heap_arena_report_t
+{
+	// Address range the arena covers.
+	const void* base;
+	size_t size;
+	size_t used_bytes;
+	size_t free_bytes;
+	size_t largest_free_block;
+} heap_arena_report_t;
+
+// Snapshot of how fragmented a heap's free memory is.
+typedef struct heap_fragmentation_t
+{
+	size_t free_bytes;
+	size_t largest_free_block;
+	int free_block_count;
+	// Bucket i counts free blocks smaller than 32 << i bytes that did not fit
+	// a lower bucket; the last bucket also holds everything larger.
+	int free_block_histogram[k_heap_report_histogram_buckets];
+	// Total number of arenas; only the first k_heap_report_max_arenas are
+	// described in arenas.
+	int arena_count;
+	heap_arena_report_t arenas[k_heap_report_max_arenas];
+	// The least occupied arena that holds any used block, chosen from every
+	// arena. Its size is zero if no arena holds anything.
+	heap_arena_report_t emptiest_arena;
+} heap_fragmentation_t;
+
 // Function to print out the current call stack.
 // Given the number of frames and the pointer to the stack information.
 void bt_print(int frames, void** stack);
@@ -24,9 +158,19 @@ void bt_print(int frames, void** stack);
 // Creates a new memory heap.
 // The grow increment is the default size with which the heap grows.
 // Should be a multiple of OS page size.
+// Debug builds track every allocation for leaks; release builds track none.
 heap_t* heap_create(size_t grow_increment);
 
+// Creates a new memory heap with explicit parameters.
+heap_t* heap_create_ex(const heap_info_t* info);
+
+// Creates a named heap that takes its memory from a parent heap.
+// A budget of zero means no budget. Tracks leaks like heap_create.
+// Must be destroyed before its parent.
+heap_t* heap_create_child(heap_t* parent, const char* name, size_t grow_increment, size_t budget);
+
 // Destroy a previously created heap.
+// Reports any allocations that were not freed.
 void heap_destroy(heap_t* heap);
 
 // Allocate memory from a heap.
@@ -34,3 +178,37 @@ void* heap_alloc(heap_t* heap, size_t size, size_t alignment);
 
 // Free memory previously allocated from a heap.
 void heap_free(heap_t* heap, void* address);
+
+// Resize a block previously allocated from a heap.
+// Grows in place when the memory after the block is free, otherwise moves
+// the block and copies its contents. The block keeps the call stack of its
+// original allocation for leak reporting.
+// A NULL address allocates; a size of zero frees and returns NULL.
+// Returns NULL and leaves the block untouched if memory runs out.
+void* heap_realloc(heap_t* heap, void* address, size_t size, size_t alignment);
+
+// Determines if an address points into memory owned by the heap.
+// Constant time: all of a heap's memory comes from one reserved range,
+// except for large page mappings, which take a walk under the heap lock.
+bool heap_owns(heap_t* heap, const void* address);
+
+// Return completely free arenas to the OS, beyond the heap's retain budget.
+// Also flushes the calling thread's allocation cache first.
+// The heap trims itself periodically as memory is freed; call this after
+// unloading a level to shrink immediately.
+void heap_trim(heap_t* heap);
+
+// Read a heap's counters.
+// Counters are maintained on the allocation path, so this is cheap.
+void heap_get_stats(heap_t* heap, heap_stats_t* stats);
+
+// Walk every arena and describe how fragmented the free memory is.
+// Holds the heap lock for the duration of the walk; not for every frame.
+void heap_get_fragmentation(heap_t* heap, heap_fragmentation_t* report);
+
+// Get the name a heap was created with.
+const char* heap_get_name(heap_t* heap);
+
+// Emit the heap's counters as trace counter tracks, named after the heap.
+// Call once per frame to correlate memory growth with frame times.
+void heap_trace_counters(heap_t* heap, trace_t* trace);
@@ -0,0 +1,826 @@
+#include "heap_bench.h"
+
+#include "atomic.h"
+#include "debug.h"
+#include "ecs.h"
+#include "event.h"
+#include "heap.h"
+#include "heap_handle.h"
+#include "queue.h"
+#include "thread.h"
+#include "timer.h"
+#include "vm.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#endif
+
+enum
+{
+	k_bench_max_threads = 64,
+	k_bench_max_results = 256,
+	// Every this many operations, one is timed individually.
+	k_bench_sample_interval = 16,
+	k_bench_max_samples_per_thread = 64 * 1024,
+	k_bench_working_set = 1024,
+	k_bench_random_iterations = 1000000,
+	k_bench_frame_iterations = 2000,
+	k_bench_frame_commands = 256,
+	k_bench_aligned_iterations = 500000,
+	k_bench_handoff_iterations = 1000000,
+	k_bench_handoff_queue_capacity = 1024,
+	k_bench_load_cycles = 4,
+	k_bench_load_blocks = 64 * 1024,
+	k_bench_ecs_worlds = 64,
+	k_bench_ecs_entities = 512,
+	k_bench_ecs_state_size = 4096,
+	k_bench_ecs_passes = 50,
+	k_bench_handles = 8 * 1024,
+	k_bench_compact_budget_us = 1000,
+	k_bench_stats_threads = 8,
+	k_bench_stats_blocks = 1000,
+};
+
+typedef enum bench_allocator_kind_t
+{
+	k_bench_allocator_heap,
+	k_bench_allocator_system,
+	k_bench_allocator_count,
+} bench_allocator_kind_t;
+
+static const char* const k_bench_allocator_names[k_bench_allocator_count] = { "heap", "malloc" };
+
+// Allocator under test; a fresh heap_t is created for every run.
+typedef struct bench_allocator_t
+{
+	bench_allocator_kind_t kind;
+	heap_t* heap;
+} bench_allocator_t;
+
+typedef struct bench_worker_t
+{
+	const bench_allocator_t* allocator;
+	event_t* start;
+	// Handoff: the queue shared by a producer and its consumer.
+	queue_t* queue;
+	int iterations;
+	uint32_t seed;
+	uint64_t ticks;
+	uint64_t op_count;
+	uint32_t* samples;
+	int sample_count;
+} bench_worker_t;
+
+typedef struct bench_scenario_t
+{
+	const char* name;
+	int (*worker_func)(void*);
+	// Paired scenarios run a consumer thread for every worker.
+	int (*consumer_func)(void*);
+	int iterations;
+} bench_scenario_t;
+
+typedef struct bench_result_t
+{
+	const char* scenario;
+	const char* allocator;
+	int threads;
+	uint64_t ops;
+	uint64_t duration_us;
+	uint64_t p50_ns;
+	uint64_t p99_ns;
+	uint64_t p999_ns;
+	uint64_t max_ns;
+	size_t baseline_resident_bytes;
+	size_t peak_resident_bytes;
+	// False if the heap's statistics disagreed with the operations run.
+	bool ok;
+} bench_result_t;
+
+// Polls resident memory while a run is in progress.
+typedef struct bench_sampler_t
+{
+	thread_t* thread;
+	int stop;
+	size_t peak;
+} bench_sampler_t;
+
+typedef struct bench_t
+{
+	// Bookkeeping lives in its own heap so it does not disturb the one
+	// being measured.
+	heap_t* heap;
+	int max_threads;
+	bool quick;
+	const char* scenario_filter;
+	int result_count;
+	bench_result_t results[k_bench_max_results];
+} bench_t;
+
+static uint32_t bench_random(uint32_t* state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x;
+}
+
+// Log-uniform size between 16 bytes and 16 KB; small sizes dominate.
+static size_t bench_random_size(uint32_t* state)
+{
+	uint32_t r = bench_random(state);
+	size_t size = (size_t)16 << (r % 10);
+	return size + (r >> 8) % size;
+}
+
+static size_t get_resident_bytes()
+{
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters = { .cb = sizeof(counters) };
+	GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+	return counters.WorkingSetSize;
+#else
+	size_t resident_pages = 0;
+	FILE* statm = fopen("/proc/self/statm", "r");
+	if (statm)
+	{
+		if (fscanf(statm, "%*s %zu", &resident_pages) != 1)
+		{
+			resident_pages = 0;
+		}
+		fclose(statm);
+	}
+	return resident_pages * vm_page_size();
+#endif
+}
+
+static int bench_sampler_func(void* user)
+{
+	bench_sampler_t* sampler = user;
+	while (!atomic_load(&sampler->stop))
+	{
+		sampler->peak = __max(sampler->peak, get_resident_bytes());
+		thread_sleep(1);
+	}
+	sampler->peak = __max(sampler->peak, get_resident_bytes());
+	return 0;
+}
+
+static void* bench_system_alloc(size_t size, size_t alignment)
+{
+	if (alignment <= 16)
+	{
+		return malloc(size);
+	}
+#if defined(_WIN32)
+	return _aligned_malloc(size, alignment);
+#else
+	void* address = NULL;
+	return posix_memalign(&address, alignment, size) == 0 ? address : NULL;
+#endif
+}
+
+static void bench_system_free(void* address, size_t alignment)
+{
+#if defined(_WIN32)
+	if (alignment > 16)
+	{
+		_aligned_free(address);
+		return;
+	}
+#endif
+	free(address);
+}
+
+// Allocate through the allocator under test, timing one call in every
+// k_bench_sample_interval.
+static void* bench_alloc(bench_worker_t* worker, size_t size, size_t alignment)
+{
+	bool timed = worker->op_count++ % k_bench_sample_interval == 0;
+	uint64_t t0 = timed ? timer_get_ticks() : 0;
+	void* address = worker->allocator->kind == k_bench_allocator_heap ?
+		heap_alloc(worker->allocator->heap, size, alignment) :
+		bench_system_alloc(size, alignment);
+	if (timed && worker->sample_count < k_bench_max_samples_per_thread)
+	{
+		worker->samples[worker->sample_count++] = (uint32_t)__min(timer_get_ticks() - t0, UINT32_MAX);
+	}
+	return address;
+}
+
+static void bench_free(bench_worker_t* worker, void* address, size_t alignment)
+{
+	if (!address)
+	{
+		return;
+	}
+	bool timed = worker->op_count++ % k_bench_sample_interval == 0;
+	uint64_t t0 = timed ? timer_get_ticks() : 0;
+	if (worker->allocator->kind == k_bench_allocator_heap)
+	{
+		heap_free(worker->allocator->heap, address);
+	}
+	else
+	{
+		bench_system_free(address, alignment);
+	}
+	if (timed && worker->sample_count < k_bench_max_samples_per_thread)
+	{
+		worker->samples[worker->sample_count++] = (uint32_t)__min(timer_get_ticks() - t0, UINT32_MAX);
+	}
+}
+
+static int random_worker_func(void* user)
+{
+	bench_worker_t* worker = user;
+	void* blocks[k_bench_working_set] = { 0 };
+
+	event_wait(worker->start);
+	uint64_t t0 = timer_get_ticks();
+	for (int i = 0; i < worker->iterations; ++i)
+	{
+		int slot = bench_random(&worker->seed) % k_bench_working_set;
+		bench_free(worker, blocks[slot], 8);
+		blocks[slot] = bench_alloc(worker, bench_random_size(&worker->seed), 8);
+	}
+	worker->ticks = timer_get_ticks() - t0;
+
+	for (int i = 0; i < k_bench_working_set; ++i)
+	{
+		bench_free(worker, blocks[i], 8);
+	}
+	return 0;
+}
+
+// Render command churn: each frame allocates a command and a uniform copy
+// per draw, then frees the whole frame at once.
+static int frame_worker_func(void* user)
+{
+	bench_worker_t* worker = user;
+	void* blocks[k_bench_frame_commands * 2];
+
+	event_wait(worker->start);
+	uint64_t t0 = timer_get_ticks();
+	for (int frame = 0; frame < worker->iterations; ++frame)
+	{
+		for (int i = 0; i < k_bench_frame_commands; ++i)
+		{
+			blocks[i * 2 + 0] = bench_alloc(worker, 96 + bench_random(&worker->seed) % 64, 8);
+			blocks[i * 2 + 1] = bench_alloc(worker, (size_t)64 << (bench_random(&worker->seed) % 3), 8);
+		}
+		for (int i = 0; i < k_bench_frame_commands * 2; ++i)
+		{
+			bench_free(worker, blocks[i], 8);
+		}
+	}
+	worker->ticks = timer_get_ticks() - t0;
+	return 0;
+}
+
+static int aligned_worker_func(void* user)
+{
+	bench_worker_t* worker = user;
+	void* blocks[k_bench_working_set] = { 0 };
+	size_t alignments[k_bench_working_set] = { 0 };
+
+	event_wait(worker->start);
+	uint64_t t0 = timer_get_ticks();
+	for (int i = 0; i < worker->iterations; ++i)
+	{
+		int slot = bench_random(&worker->seed) % k_bench_working_set;
+		bench_free(worker, blocks[slot], alignments[slot]);
+		alignments[slot] = (size_t)16 << (bench_random(&worker->seed) % 9);
+		blocks[slot] = bench_alloc(worker, 16 + bench_random(&worker->seed) % 1008, alignments[slot]);
+	}
+	worker->ticks = timer_get_ticks() - t0;
+
+	for (int i = 0; i < k_bench_working_set; ++i)
+	{
+		bench_free(worker, blocks[i], alignments[i]);
+	}
+	return 0;
+}
+
+// Network packet pattern: this thread allocates, its consumer frees.
+static int handoff_producer_func(void* user)
+{
+	bench_worker_t* worker = user;
+
+	event_wait(worker->start);
+	uint64_t t0 = timer_get_ticks();
+	for (int i = 0; i < worker->iterations; ++i)
+	{
+		queue_push(worker->queue, bench_alloc(worker, 64 + bench_random(&worker->seed) % 1436, 8));
+	}
+	worker->ticks = timer_get_ticks() - t0;
+	return 0;
+}
+
+static int handoff_consumer_func(void* user)
+{
+	bench_worker_t* worker = user;
+
+	event_wait(worker->start);
+	uint64_t t0 = timer_get_ticks();
+	for (int i = 0; i < worker->iterations; ++i)
+	{
+		bench_free(worker, queue_pop(worker->queue), 8);
+	}
+	worker->ticks = timer_get_ticks() - t0;
+	return 0;
+}
+
+static const bench_scenario_t k_bench_scenarios[] =
+{
+	{ "random", random_worker_func, NULL, k_bench_random_iterations },
+	{ "frame", frame_worker_func, NULL, k_bench_frame_iterations },
+	{ "aligned", aligned_worker_func, NULL, k_bench_aligned_iterations },
+	{ "handoff", handoff_producer_func, handoff_consumer_func, k_bench_handoff_iterations },
+};
+
+static int compare_samples(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*)a;
+	uint32_t y = *(const uint32_t*)b;
+	return (x > y) - (x < y);
+}
+
+static uint64_t bench_ticks_to_ns(uint64_t ticks)
+{
+	return (uint64_t)((double)ticks * 1000000000.0 / (double)timer_get_ticks_per_second());
+}
+
+static bench_result_t* bench_add_result(bench_t* bench)
+{
+	if (bench->result_count == k_bench_max_results)
+	{
+		debug_print(k_print_warning, "Too many benchmark results; dropping the rest.\n");
+		return NULL;
+	}
+	bench_result_t* result = &bench->results[bench->result_count++];
+	memset(result, 0, sizeof(*result));
+	result->ok = true;
+	return result;
+}
+
+static void bench_print_result(const bench_result_t* result)
+{
+	uint64_t us = __max(result->duration_us, 1);
+	debug_print(k_print_warning, "%-8s %-16s threads=%-2d ops/s=%-10llu p50=%lluns p99=%lluns p99.9=%lluns peak=%dMB %s\n",
+		result->scenario, result->allocator, result->threads,
+		(unsigned long long)(result->ops * 1000000 / us),
+		(unsigned long long)result->p50_ns, (unsigned long long)result->p99_ns, (unsigned long long)result->p999_ns,
+		(int)(result->peak_resident_bytes / (1024 * 1024)), result->ok ? "ok" : "STATS MISMATCH");
+}
+
+// Returns false if the heap's statistics disagree with the operations run.
+static bool bench_run(bench_t* bench, const bench_scenario_t* scenario, bench_allocator_kind_t kind, int thread_count)
+{
+	bench_allocator_t allocator = { .kind = kind };
+	if (kind == k_bench_allocator_heap)
+	{
+		heap_info_t info = { .grow_increment = 2 * 1024 * 1024, .name = "bench", .leak_mode = k_heap_leak_off };
+		allocator.heap = heap_create_ex(&info);
+	}
+
+	int producer_count = scenario->consumer_func ? thread_count / 2 : thread_count;
+	int iterations = bench->quick ? scenario->iterations / 10 : scenario->iterations;
+	event_t* start = event_create();
+	bench_worker_t* workers = heap_alloc(bench->heap, sizeof(bench_worker_t) * thread_count, 8);
+	uint32_t* samples = heap_alloc(bench->heap, sizeof(uint32_t) * k_bench_max_samples_per_thread * thread_count, 8);
+	queue_t* queues[k_bench_max_threads] = { 0 };
+	thread_t* threads[k_bench_max_threads];
+
+	size_t baseline = get_resident_bytes();
+	bench_sampler_t sampler = { .peak = baseline };
+	sampler.thread = thread_create(bench_sampler_func, &sampler);
+
+	for (int i = 0; i < thread_count; ++i)
+	{
+		bool consumer = i >= producer_count;
+		if (scenario->consumer_func && !consumer)
+		{
+			queues[i] = queue_create(bench->heap, k_bench_handoff_queue_capacity);
+		}
+		workers[i] = (bench_worker_t)
+		{
+			.allocator = &allocator,
+			.start = start,
+			.queue = consumer ? queues[i - producer_count] : queues[i],
+			.iterations = iterations,
+			.seed = 0x9e3779b9u * (i + 1),
+			.samples = samples + (size_t)k_bench_max_samples_per_thread * i,
+		};
+		threads[i] = thread_create(consumer ? scenario->consumer_func : scenario->worker_func, &workers[i]);
+	}
+
+	// Go!
+	event_signal(start);
+
+	uint64_t max_ticks = 0;
+	uint64_t ops = 0;
+	int sample_count = 0;
+	for (int i = 0; i < thread_count; ++i)
+	{
+		thread_destroy(threads[i]);
+		max_ticks = __max(max_ticks, workers[i].ticks);
+		ops += workers[i].op_count;
+		// Pack the samples together for sorting.
+		memmove(samples + sample_count, workers[i].samples, sizeof(uint32_t) * workers[i].sample_count);
+		sample_count += workers[i].sample_count;
+	}
+
+	atomic_store(&sampler.stop, 1);
+	thread_destroy(sampler.thread);
+
+	// Every block has been freed and every worker has exited, releasing its
+	// cache, so the heap must count exactly the operations the workers ran.
+	bool ok = true;
+	if (allocator.heap)
+	{
+		heap_stats_t stats;
+		heap_get_stats(allocator.heap, &stats);
+		ok = stats.alloc_count == stats.free_count &&
+			stats.alloc_count + stats.free_count == ops &&
+			stats.cached_bytes == 0;
+	}
+
+	bench_result_t* result = bench_add_result(bench);
+	if (result)
+	{
+		qsort(samples, sample_count, sizeof(uint32_t), compare_samples);
+		result->scenario = scenario->name;
+		result->allocator = k_bench_allocator_names[kind];
+		result->threads = thread_count;
+		result->ops = ops;
+		result->duration_us = timer_ticks_to_us(max_ticks);
+		if (sample_count > 0)
+		{
+			result->p50_ns = bench_ticks_to_ns(samples[sample_count / 2]);
+			result->p99_ns = bench_ticks_to_ns(samples[(size_t)sample_count * 99 / 100]);
+			result->p999_ns = bench_ticks_to_ns(samples[(size_t)sample_count * 999 / 1000]);
+			result->max_ns = bench_ticks_to_ns(samples[sample_count - 1]);
+		}
+		result->baseline_resident_bytes = baseline;
+		result->peak_resident_bytes = sampler.peak;
+		result->ok = ok;
+		bench_print_result(result);
+	}
+
+	for (int i = 0; i < thread_count; ++i)
+	{
+		if (queues[i])
+		{
+			queue_destroy(queues[i]);
+		}
+	}
+	heap_free(bench->heap, samples);
+	heap_free(bench->heap, workers);
+	event_destroy(start);
+	if (allocator.heap)
+	{
+		heap_destroy(allocator.heap);
+	}
+	return ok;
+}
+
+// Iterate ECS queries over a working set far larger than the TLB covers.
+// Each entity's state component sits on its own 4 KB page, so with normal
+// pages nearly every entity visited costs a TLB miss.
+static void run_ecs_queries(bench_t* bench, bool large_pages)
+{
+	heap_info_t info =
+	{
+		.grow_increment = 2 * 1024 * 1024,
+		.name = "bench",
+		.large_pages = large_pages,
+	};
+	heap_t* heap = heap_create_ex(&info);
+	size_t baseline = get_resident_bytes();
+
+	ecs_t* worlds[k_bench_ecs_worlds];
+	int position_type = -1;
+	int state_type = -1;
+	for (int w = 0; w < k_bench_ecs_worlds; ++w)
+	{
+		worlds[w] = ecs_create(heap);
+		position_type = ecs_register_component_type(worlds[w], "position", sizeof(float) * 4, 16);
+		state_type = ecs_register_component_type(worlds[w], "state", k_bench_ecs_state_size, 64);
+		for (int e = 0; e < k_bench_ecs_entities; ++e)
+		{
+			ecs_entity_add(worlds[w], (1ULL << position_type) | (1ULL << state_type));
+		}
+		ecs_update(worlds[w]);
+	}
+
+	uint64_t mask = (1ULL << position_type) | (1ULL << state_type);
+	int passes = bench->quick ? k_bench_ecs_passes / 10 : k_bench_ecs_passes;
+	uint64_t t0 = timer_get_ticks();
+	for (int pass = 0; pass < passes; ++pass)
+	{
+		for (int w = 0; w < k_bench_ecs_worlds; ++w)
+		{
+			for (ecs_query_t query = ecs_query_create(worlds[w], mask); ecs_query_is_valid(worlds[w], &query); ecs_query_next(worlds[w], &query))
+			{
+				float* position = ecs_query_get_component(worlds[w], &query, position_type);
+				uint32_t* state = ecs_query_get_component(worlds[w], &query, state_type);
+				state[0]++;
+				position[0] += (float)state[0];
+			}
+		}
+	}
+	uint64_t ticks = timer_get_ticks() - t0;
+	size_t peak = get_resident_bytes();
+
+	heap_stats_t stats;
+	heap_get_stats(heap, &stats);
+	for (int w = 0; w < k_bench_ecs_worlds; ++w)
+	{
+		ecs_destroy(worlds[w]);
+	}
+	heap_destroy(heap);
+
+	bench_result_t* result = bench_add_result(bench);
+	if (result)
+	{
+		result->scenario = "ecs_query";
+		result->allocator = large_pages ? "heap_large_pages" : "heap";
+		result->threads = 1;
+		result->ops = (uint64_t)passes * k_bench_ecs_worlds * k_bench_ecs_entities;
+		result->duration_us = timer_ticks_to_us(ticks);
+		result->baseline_resident_bytes = baseline;
+		result->peak_resident_bytes = peak;
+		bench_print_result(result);
+	}
+	debug_print(k_print_warning, "ecs_query large_pages=%d large_page_bytes=%dMB\n",
+		large_pages, (int)(stats.large_page_bytes / (1024 * 1024)));
+}
+
+// Fragment a heap of relocatable buffers, then compact it a frame at a time
+// and watch the arenas go back to the OS. Returns false if nothing moved
+// although the heap was fragmented.
+static bool run_compaction()
+{
+	heap_t* heap = heap_create(1024 * 1024);
+	heap_handle_table_t* table = heap_handle_table_create(heap, k_bench_handles);
+	heap_handle_t* handles = heap_alloc(heap, sizeof(heap_handle_t) * k_bench_handles, 8);
+	uint32_t seed = 0xc0ffee11u;
+
+	// Sizes above the thread cache classes so blocks come straight from TLSF.
+	for (int i = 0; i < k_bench_handles; ++i)
+	{
+		handles[i] = heap_handle_alloc(table, 4096 + bench_random(&seed) % (28 * 1024), 8);
+	}
+	// Keep one buffer in four; every arena is left mostly empty.
+	for (int i = 0; i < k_bench_handles; ++i)
+	{
+		if (i % 4 != 0)
+		{
+			heap_handle_free(table, handles[i]);
+		}
+	}
+	heap_trim(heap);
+
+	heap_stats_t before;
+	heap_get_stats(heap, &before);
+	heap_fragmentation_t report;
+	heap_get_fragmentation(heap, &report);
+	bool fragmented = report.emptiest_arena.used_bytes * 2 < report.emptiest_arena.size;
+
+	// Step times include the scan that picks an arena, which the budget
+	// leaves out.
+	int steps = 0;
+	int moved = 0;
+	uint64_t max_step_us = 0;
+	heap_compact_status_t status = k_heap_compact_more;
+	while (status == k_heap_compact_more)
+	{
+		uint64_t t0 = timer_get_ticks();
+		status = heap_handle_compact(table, k_bench_compact_budget_us, &moved);
+		max_step_us = __max(max_step_us, timer_ticks_to_us(timer_get_ticks() - t0));
+		steps++;
+	}
+
+	heap_stats_t after;
+	heap_get_stats(heap, &after);
+	bool ok = moved > 0 || !fragmented;
+	debug_print(k_print_warning, "compaction moved=%d steps=%d max_step=%dus arenas=%d->%d arena_bytes=%dKB->%dKB %s\n",
+		moved, steps, (int)max_step_us, before.arena_count, after.arena_count,
+		(int)(before.arena_bytes / 1024), (int)(after.arena_bytes / 1024), ok ? "ok" : "NOTHING MOVED");
+
+	for (int i = 0; i < k_bench_handles; i += 4)
+	{
+		heap_handle_free(table, handles[i]);
+	}
+	heap_free(heap, handles);
+	heap_handle_table_destroy(table);
+	heap_destroy(heap);
+	return ok;
+}
+
+// Simulate level loads and unloads and watch resident memory.
+// After each unload the heap should shrink back close to its baseline.
+static void run_load_cycle()
+{
+	heap_t* heap = heap_create(2 * 1024 * 1024);
+	void** blocks = heap_alloc(heap, sizeof(void*) * k_bench_load_blocks, 8);
+	uint32_t seed = 0x12345678u;
+
+	size_t baseline = get_resident_bytes();
+	debug_print(k_print_warning, "load_cycle baseline resident=%dKB\n", (int)(baseline / 1024));
+
+	for (int cycle = 0; cycle < k_bench_load_cycles; ++cycle)
+	{
+		// Mostly small objects, with the odd large buffer mixed in.
+		for (int i = 0; i < k_bench_load_blocks; ++i)
+		{
+			size_t size = (i % 1024) == 0 ? 4 * 1024 * 1024 : 16 + bench_random(&seed) % 4080;
+			blocks[i] = heap_alloc(heap, size, 8);
+			memset(blocks[i], 0xcd, size);
+		}
+		size_t loaded = get_resident_bytes();
+
+		for (int i = 0; i < k_bench_load_blocks; ++i)
+		{
+			heap_free(heap, blocks[i]);
+		}
+		heap_trim(heap);
+		size_t unloaded = get_resident_bytes();
+
+		heap_stats_t stats;
+		heap_get_stats(heap, &stats);
+		debug_print(k_print_warning, "load_cycle %d loaded=%dKB unloaded=%dKB arenas=%d released=%d\n",
+			cycle, (int)(loaded / 1024), (int)(unloaded / 1024), stats.arena_count, stats.arenas_released);
+	}
+
+	heap_free(heap, blocks);
+	heap_destroy(heap);
+}
+
+static int stats_worker_func(void* user)
+{
+	heap_t* heap = user;
+	for (int i = 0; i < k_bench_stats_blocks; ++i)
+	{
+		heap_free(heap, heap_alloc(heap, 16 + (size_t)(i % 64) * 16, 8));
+	}
+	return 0;
+}
+
+// Check that the heap's statistics count exactly the operations made, when
+// threads come and go and their caches land on reused, dirty memory.
+static bool run_stats_check()
+{
+	heap_t* heap = heap_create(2 * 1024 * 1024);
+	void* dirty = heap_alloc(heap, 256 * 1024, 8);
+	memset(dirty, 0x7f, 256 * 1024);
+	heap_free(heap, dirty);
+
+	for (int i = 0; i < k_bench_stats_threads; ++i)
+	{
+		thread_destroy(thread_create(stats_worker_func, heap));
+	}
+
+	heap_stats_t stats;
+	heap_get_stats(heap, &stats);
+	uint64_t expected = 1 + (uint64_t)k_bench_stats_threads * k_bench_stats_blocks;
+	bool ok = stats.alloc_count == expected && stats.free_count == expected && stats.cached_bytes == 0;
+	debug_print(k_print_warning, "stats allocs=%llu frees=%llu expected=%llu cached=%llu %s\n",
+		(unsigned long long)stats.alloc_count, (unsigned long long)stats.free_count,
+		(unsigned long long)expected, (unsigned long long)stats.cached_bytes, ok ? "ok" : "STATS MISMATCH");
+	heap_destroy(heap);
+	return ok;
+}
+
+static void bench_write_json(bench_t* bench, FILE* file)
+{
+	fprintf(file, "{\n\t\"results\": [\n");
+	for (int i = 0; i < bench->result_count; ++i)
+	{
+		const bench_result_t* result = &bench->results[i];
+		uint64_t us = __max(result->duration_us, 1);
+		fprintf(file,
+			"\t\t{\"scenario\": \"%s\", \"allocator\": \"%s\", \"threads\": %d, \"ops\": %llu, \"duration_us\": %llu, "
+			"\"ops_per_second\": %llu, \"latency_ns\": {\"p50\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}, "
+			"\"baseline_resident_bytes\": %llu, \"peak_resident_bytes\": %llu, \"ok\": %s}%s\n",
+			result->scenario, result->allocator, result->threads,
+			(unsigned long long)result->ops, (unsigned long long)result->duration_us,
+			(unsigned long long)(result->ops * 1000000 / us),
+			(unsigned long long)result->p50_ns, (unsigned long long)result->p99_ns,
+			(unsigned long long)result->p999_ns, (unsigned long long)result->max_ns,
+			(unsigned long long)result->baseline_resident_bytes, (unsigned long long)result->peak_resident_bytes,
+			result->ok ? "true" : "false",
+			i + 1 < bench->result_count ? "," : "");
+	}
+	fprintf(file, "\t]\n}\n");
+}
+
+int heap_bench_main(int argc, const char** argv)
+{
+	heap_t* heap = heap_create(1024 * 1024);
+	bench_t* bench = heap_alloc(heap, sizeof(bench_t), 8);
+	bench->heap = heap;
+	bench->max_threads = __min(thread_get_core_count(), k_bench_max_threads);
+	bench->quick = false;
+	bench->scenario_filter = NULL;
+	bench->result_count = 0;
+	const char* json_path = NULL;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+		{
+			int threads = atoi(argv[++i]);
+			bench->max_threads = __max(__min(threads, k_bench_max_threads), 1);
+		}
+		else if (strcmp(argv[i], "--scenario") == 0 && i + 1 < argc)
+		{
+			bench->scenario_filter = argv[++i];
+		}
+		else if (strcmp(argv[i], "--quick") == 0)
+		{
+			bench->quick = true;
+		}
+		else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc)
+		{
+			json_path = argv[++i];
+		}
+		else
+		{
+			debug_print(k_print_error, "Unknown option: %s\n", argv[i]);
+			heap_free(heap, bench);
+			heap_destroy(heap);
+			return 1;
+		}
+	}
+
+	bool ok = true;
+	for (int s = 0; s < _countof(k_bench_scenarios); ++s)
+	{
+		const bench_scenario_t* scenario = &k_bench_scenarios[s];
+		if (bench->scenario_filter && strcmp(bench->scenario_filter, scenario->name) != 0)
+		{
+			continue;
+		}
+
+		// 1, 2, 4, ... threads, always ending with the maximum.
+		for (int threads = 1; ; threads = __min(threads * 2, bench->max_threads))
+		{
+			// Producer/consumer runs need whole pairs.
+			int thread_count = scenario->consumer_func ? __max(threads & ~1, 2) : threads;
+			for (int kind = 0; kind < k_bench_allocator_count; ++kind)
+			{
+				ok = bench_run(bench, scenario, (bench_allocator_kind_t)kind, thread_count) && ok;
+			}
+			if (threads == bench->max_threads)
+			{
+				break;
+			}
+		}
+	}
+
+	if (!bench->scenario_filter || strcmp(bench->scenario_filter, "ecs_query") == 0)
+	{
+		run_ecs_queries(bench, false);
+		run_ecs_queries(bench, true);
+	}
+	if (!bench->scenario_filter)
+	{
+		ok = run_compaction() && ok;
+		run_load_cycle();
+		ok = run_stats_check() && ok;
+	}
+
+	int status = ok ? 0 : 1;
+	if (json_path)
+	{
+		FILE* file = strcmp(json_path, "-") == 0 ? stdout : fopen(json_path, "w");
+		if (file)
+		{
+			bench_write_json(bench, file);
+			if (file != stdout)
+			{
+				fclose(file);
+			}
+		}
+		else
+		{
+			debug_print(k_print_error, "Unable to write %s\n", json_path);
+			status = 1;
+		}
+	}
+
+	heap_free(heap, bench);
+	heap_destroy(heap);
+	return status;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+// Heap allocator benchmarks.
+//
+// Runs a matrix of allocation workloads against heap_t and the system
+// malloc, for a sweep of thread counts:
+//   random   - alloc/free pairs of random sizes over a working set
+//   frame    - per-frame bursts of command-sized blocks, all freed together
+//   aligned  - random sizes with 16 to 4096 byte alignment
+//   handoff  - producer threads allocate packets that consumer threads free
+// Each run reports throughput, sampled per-operation latency percentiles
+// and peak resident memory. A few heap-only reports follow: large pages on
+// ECS query iteration, handle compaction, load/unload cycles, and a check
+// that the heap's statistics count every operation.
+//
+// Results are printed with debug_print and optionally written as JSON.
+
+// Run the benchmark suite. Accepts these options:
+//   --threads N      largest thread count in the sweep (default: core count)
+//   --scenario NAME  run only one workload of the matrix
+//   --quick          a tenth of the operations, for smoke testing
+//   --json PATH      write the results as JSON to PATH, or - for stdout
+// Returns zero on success, nonzero on a bad option, if a heap's
+// statistics disagree with the operations a run made, or if compaction
+// moves nothing out of a fragmented heap.
+int heap_bench_main(int argc, const char** argv);
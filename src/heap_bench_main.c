@@ -0,0 +1,11 @@
+#include "heap_bench.h"
+#include "timer.h"
+
+// Standalone entry point for the heap benchmarks; see the Makefile.
+// The game runs the same suite with: ga2022 --heap-bench [options]
+
+int main(int argc, const char* argv[])
+{
+	timer_startup();
+	return heap_bench_main(argc, argv);
+}
@@ -0,0 +1,141 @@
+#include "heap_frame_arena.h"
+
+#include "heap.h"
+#include "semaphore.h"
+
+#include <stdint.h>
+
+enum
+{
+	k_frame_arena_max_frames = 4,
+};
+
+typedef struct frame_block_t
+{
+	struct frame_block_t* next;
+	size_t capacity;
+	size_t used;
+} frame_block_t;
+
+typedef struct frame_t
+{
+	frame_block_t* head;
+	frame_block_t* current;
+} frame_t;
+
+typedef struct heap_frame_arena_t
+{
+	heap_t* heap;
+	size_t block_size;
+	int frame_count;
+	int frame_index;
+	semaphore_t* free_frames;
+	frame_t frames[k_frame_arena_max_frames];
+} heap_frame_arena_t;
+
+heap_frame_arena_t* heap_frame_arena_create(heap_t* heap, size_t block_size, int frame_count)
+{
+	frame_count = __max(__min(frame_count, k_frame_arena_max_frames), 1);
+
+	heap_frame_arena_t* arena = heap_alloc(heap, sizeof(heap_frame_arena_t), 8);
+	arena->heap = heap;
+	arena->block_size = block_size;
+	arena->frame_count = frame_count;
+	arena->frame_index = 0;
+	// The frame being filled is not free; the rest are.
+	arena->free_frames = semaphore_create(frame_count - 1, frame_count);
+	for (int i = 0; i < _countof(arena->frames); ++i)
+	{
+		arena->frames[i].head = NULL;
+		arena->frames[i].current = NULL;
+	}
+	return arena;
+}
+
+void heap_frame_arena_destroy(heap_frame_arena_t* arena)
+{
+	for (int i = 0; i < arena->frame_count; ++i)
+	{
+		frame_block_t* block = arena->frames[i].head;
+		while (block)
+		{
+			frame_block_t* next = block->next;
+			heap_free(arena->heap, block);
+			block = next;
+		}
+	}
+	semaphore_destroy(arena->free_frames);
+	heap_free(arena->heap, arena);
+}
+
+// Try to carve an allocation out of a block.
+static void* frame_block_alloc(frame_block_t* block, size_t size, size_t alignment)
+{
+	uintptr_t base = (uintptr_t)(block + 1);
+	uintptr_t address = (base + block->used + (alignment - 1)) & ~(uintptr_t)(alignment - 1);
+	if (address + size > base + block->capacity)
+	{
+		return NULL;
+	}
+	block->used = address + size - base;
+	return (void*)address;
+}
+
+void* heap_frame_arena_alloc(heap_frame_arena_t* arena, size_t size, size_t alignment)
+{
+	frame_t* frame = &arena->frames[arena->frame_index];
+
+	void* address = frame->current ? frame_block_alloc(frame->current, size, alignment) : NULL;
+	while (!address && frame->current && frame->current->next)
+	{
+		// Reuse blocks retained from earlier trips through this frame.
+		frame->current = frame->current->next;
+		frame->current->used = 0;
+		address = frame_block_alloc(frame->current, size, alignment);
+	}
+
+	if (!address)
+	{
+		size_t capacity = __max(arena->block_size, size + alignment);
+		frame_block_t* block = heap_alloc(arena->heap, sizeof(frame_block_t) + capacity, 16);
+		if (!block)
+		{
+			return NULL;
+		}
+		block->capacity = capacity;
+		block->used = 0;
+		block->next = NULL;
+		if (frame->current)
+		{
+			frame->current->next = block;
+		}
+		else
+		{
+			frame->head = block;
+		}
+		frame->current = block;
+		address = frame_block_alloc(block, size, alignment);
+	}
+
+	return address;
+}
+
+void heap_frame_arena_next_frame(heap_frame_arena_t* arena)
+{
+	semaphore_acquire(arena->free_frames);
+
+	arena->frame_index = (arena->frame_index + 1) % arena->frame_count;
+
+	// Recycle the frame in one step; its blocks are kept for reuse.
+	frame_t* frame = &arena->frames[arena->frame_index];
+	frame->current = frame->head;
+	if (frame->current)
+	{
+		frame->current->used = 0;
+	}
+}
+
+void heap_frame_arena_release_frame(heap_frame_arena_t* arena)
+{
+	semaphore_release(arena->free_frames);
+}
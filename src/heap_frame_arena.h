@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stddef.h>
+
+// Per-frame linear allocator.
+//
+// Memory is handed out by bumping a pointer through large blocks taken from a
+// heap_t. Nothing is freed individually; instead a whole frame's worth of
+// memory is recycled at once. The arena keeps several frames of blocks so a
+// producer can fill frame N+1 while a consumer still reads frame N.
+
+// Handle to a frame arena.
+typedef struct heap_frame_arena_t heap_frame_arena_t;
+
+typedef struct heap_t heap_t;
+
+// Create a frame arena.
+// Blocks of block_size bytes are allocated from heap as needed and reused
+// across frames. frame_count is the number of frames that may be in flight
+// at once; 2 for double buffering, 3 for triple buffering.
+heap_frame_arena_t* heap_frame_arena_create(heap_t* heap, size_t block_size, int frame_count);
+
+// Destroy a frame arena, returning all of its blocks to the heap.
+void heap_frame_arena_destroy(heap_frame_arena_t* arena);
+
+// Allocate memory from the frame currently being filled.
+// Memory is valid until the frame is released and recycled.
+// Only one thread may allocate from an arena at a time.
+void* heap_frame_arena_alloc(heap_frame_arena_t* arena, size_t size, size_t alignment);
+
+// Finish filling the current frame and start filling the next one.
+// Blocks until the consumer has released the frame that is about to be reused.
+void heap_frame_arena_next_frame(heap_frame_arena_t* arena);
+
+// Called by the consumer once it is done reading the oldest filled frame.
+// That frame's memory may then be recycled by heap_frame_arena_next_frame.
+void heap_frame_arena_release_frame(heap_frame_arena_t* arena);
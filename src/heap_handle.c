@@ -0,0 +1,252 @@
+#include "heap_handle.h"
+
+#include "atomic.h"
+#include "debug.h"
+#include "heap.h"
+#include "mutex.h"
+#include "timer.h"
+
+#include <string.h>
+
+enum
+{
+	// Arenas fuller than this percentage are not worth evacuating.
+	k_handle_compact_max_occupancy = 50,
+};
+
+typedef struct handle_entry_t
+{
+	void* address;
+	size_t size;
+	size_t alignment;
+	int generation;
+	// Number of pins, or -1 while the compactor is moving the block.
+	int pins;
+	int next_free;
+} handle_entry_t;
+
+typedef struct heap_handle_table_t
+{
+	heap_t* heap;
+	mutex_t* mutex;
+	handle_entry_t* entries;
+	int capacity;
+	int free_head;
+	// Where the next compaction step resumes its scan.
+	int compact_cursor;
+	// Arena being evacuated, and the entries visited and blocks moved since
+	// the current pass over the table began.
+	const void* compact_source;
+	int compact_visited;
+	int compact_moved;
+} heap_handle_table_t;
+
+heap_handle_table_t* heap_handle_table_create(heap_t* heap, int capacity)
+{
+	heap_handle_table_t* table = heap_alloc(heap, sizeof(heap_handle_table_t), 8);
+	table->heap = heap;
+	table->mutex = mutex_create();
+	table->entries = heap_alloc(heap, sizeof(handle_entry_t) * capacity, 8);
+	table->capacity = capacity;
+	table->compact_cursor = 0;
+	table->compact_source = NULL;
+	table->compact_visited = 0;
+	table->compact_moved = 0;
+	for (int i = 0; i < capacity; ++i)
+	{
+		table->entries[i] = (handle_entry_t) { .generation = 1, .next_free = i + 1 < capacity ? i + 1 : -1 };
+	}
+	table->free_head = capacity > 0 ? 0 : -1;
+	return table;
+}
+
+void heap_handle_table_destroy(heap_handle_table_t* table)
+{
+	for (int i = 0; i < table->capacity; ++i)
+	{
+		if (table->entries[i].address)
+		{
+			debug_print(k_print_warning, "Handle %d (%d bytes) was not freed.\n", i, (int)table->entries[i].size);
+			heap_free(table->heap, table->entries[i].address);
+		}
+	}
+	mutex_destroy(table->mutex);
+	heap_free(table->heap, table->entries);
+	heap_free(table->heap, table);
+}
+
+heap_handle_t heap_handle_alloc(heap_handle_table_t* table, size_t size, size_t alignment)
+{
+	void* address = heap_alloc(table->heap, size, alignment);
+	if (!address)
+	{
+		return (heap_handle_t) { .index = -1, .generation = -1 };
+	}
+
+	mutex_lock(table->mutex);
+	int index = table->free_head;
+	if (index >= 0)
+	{
+		handle_entry_t* entry = &table->entries[index];
+		table->free_head = entry->next_free;
+		entry->size = size;
+		entry->alignment = alignment;
+		entry->pins = 0;
+		entry->address = address;
+	}
+	mutex_unlock(table->mutex);
+
+	if (index < 0)
+	{
+		debug_print(k_print_warning, "Out of handles.\n");
+		heap_free(table->heap, address);
+		return (heap_handle_t) { .index = -1, .generation = -1 };
+	}
+	return (heap_handle_t) { .index = index, .generation = table->entries[index].generation };
+}
+
+void heap_handle_free(heap_handle_table_t* table, heap_handle_t handle)
+{
+	if (!heap_handle_is_valid(table, handle))
+	{
+		debug_print(k_print_warning, "Attempting to free an invalid handle.\n");
+		return;
+	}
+
+	// Wait out a compaction step that is moving the block.
+	handle_entry_t* entry = &table->entries[handle.index];
+	while (atomic_compare_and_exchange(&entry->pins, 0, -1) != 0)
+	{
+		if (atomic_load(&entry->pins) > 0)
+		{
+			debug_print(k_print_error, "Attempting to free a pinned handle.\n");
+			return;
+		}
+	}
+
+	heap_free(table->heap, entry->address);
+
+	mutex_lock(table->mutex);
+	entry->address = NULL;
+	entry->generation++;
+	entry->next_free = table->free_head;
+	table->free_head = handle.index;
+	atomic_store(&entry->pins, 0);
+	mutex_unlock(table->mutex);
+}
+
+bool heap_handle_is_valid(heap_handle_table_t* table, heap_handle_t handle)
+{
+	return handle.index >= 0 && handle.index < table->capacity &&
+		table->entries[handle.index].generation == handle.generation &&
+		table->entries[handle.index].address != NULL;
+}
+
+size_t heap_handle_get_size(heap_handle_table_t* table, heap_handle_t handle)
+{
+	return heap_handle_is_valid(table, handle) ? table->entries[handle.index].size : 0;
+}
+
+void* heap_handle_pin(heap_handle_table_t* table, heap_handle_t handle)
+{
+	if (!heap_handle_is_valid(table, handle))
+	{
+		return NULL;
+	}
+
+	handle_entry_t* entry = &table->entries[handle.index];
+	while (true)
+	{
+		// A negative count means the block is being copied; that is brief.
+		int pins = atomic_load(&entry->pins);
+		if (pins >= 0 && atomic_compare_and_exchange(&entry->pins, pins, pins + 1) == pins)
+		{
+			break;
+		}
+	}
+	return entry->address;
+}
+
+void heap_handle_unpin(heap_handle_table_t* table, heap_handle_t handle)
+{
+	if (heap_handle_is_valid(table, handle))
+	{
+		atomic_decrement(&table->entries[handle.index].pins);
+	}
+}
+
+static bool handle_in_arena(const heap_arena_report_t* arena, const void* address)
+{
+	return (const char*)address >= (const char*)arena->base &&
+		(const char*)address < (const char*)arena->base + arena->size;
+}
+
+heap_compact_status_t heap_handle_compact(heap_handle_table_t* table, uint64_t budget_us, int* moved)
+{
+	// Evacuate the emptiest arena that still holds something.
+	heap_fragmentation_t report;
+	heap_get_fragmentation(table->heap, &report);
+	const heap_arena_report_t* source = &report.emptiest_arena;
+	if (!source->size || table->capacity == 0 ||
+		source->used_bytes * 100 > source->size * k_handle_compact_max_occupancy)
+	{
+		table->compact_source = NULL;
+		return k_heap_compact_done;
+	}
+	if (source->base != table->compact_source)
+	{
+		table->compact_source = source->base;
+		table->compact_visited = 0;
+		table->compact_moved = 0;
+	}
+
+	uint64_t start = timer_get_ticks();
+	int step_moved = 0;
+	heap_compact_status_t status = k_heap_compact_more;
+	while (timer_ticks_to_us(timer_get_ticks() - start) < budget_us)
+	{
+		if (table->compact_visited == table->capacity)
+		{
+			// A whole pass that moved nothing will not do better next time.
+			// Otherwise the arena may now be empty; the next step picks
+			// the emptiest one afresh.
+			status = table->compact_moved ? k_heap_compact_more : k_heap_compact_done;
+			table->compact_source = NULL;
+			break;
+		}
+
+		handle_entry_t* entry = &table->entries[table->compact_cursor];
+		table->compact_cursor = (table->compact_cursor + 1) % table->capacity;
+		table->compact_visited++;
+		if (!entry->address || !handle_in_arena(source, entry->address) ||
+			atomic_compare_and_exchange(&entry->pins, 0, -1) != 0)
+		{
+			continue;
+		}
+
+		// Skip a block whose best fit is in the arena being emptied; there is
+		// no better home for it right now, but others may still have one.
+		void* address = heap_alloc(table->heap, entry->size, entry->alignment);
+		if (address && handle_in_arena(source, address))
+		{
+			heap_free(table->heap, address);
+			address = NULL;
+		}
+		if (address)
+		{
+			memcpy(address, entry->address, entry->size);
+			heap_free(table->heap, entry->address);
+			entry->address = address;
+			step_moved++;
+			table->compact_moved++;
+		}
+		atomic_store(&entry->pins, 0);
+	}
+
+	if (step_moved)
+	{
+		heap_trim(table->heap);
+	}
+	*moved += step_moved;
+	return status;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Relocatable heap allocations.
+//
+// Blocks allocated through a handle table are referred to by handle rather
+// than by address, so the table is free to move them. A block must be
+// pinned to get its address, and stays put until unpinned.
+//
+// heap_handle_compact moves unpinned blocks out of the emptiest arena of the
+// heap, a few at a time, so that the arena can be returned to the OS. Use
+// handles for large, long-lived payloads that are touched through short
+// critical sections: mesh data, file buffers, snapshots.
+
+// Handle to a table of relocatable allocations.
+typedef struct heap_handle_table_t heap_handle_table_t;
+
+typedef struct heap_t heap_t;
+
+// Reference to a relocatable allocation.
+// Becomes invalid once the allocation is freed.
+typedef struct heap_handle_t
+{
+	int index;
+	int generation;
+} heap_handle_t;
+
+// Create a table that can hold up to capacity allocations from heap.
+heap_handle_table_t* heap_handle_table_create(heap_t* heap, int capacity);
+
+// Destroy a handle table.
+// Allocations that were not freed are reported and returned to the heap.
+void heap_handle_table_destroy(heap_handle_table_t* table);
+
+// Allocate a relocatable block.
+// Returns an invalid handle (index -1) if the table or heap is full.
+heap_handle_t heap_handle_alloc(heap_handle_table_t* table, size_t size, size_t alignment);
+
+// Free a relocatable block. The block must not be pinned.
+void heap_handle_free(heap_handle_table_t* table, heap_handle_t handle);
+
+// Determines if a handle refers to a live allocation.
+bool heap_handle_is_valid(heap_handle_table_t* table, heap_handle_t handle);
+
+// Get the size a block was allocated with.
+size_t heap_handle_get_size(heap_handle_table_t* table, heap_handle_t handle);
+
+// Get the address of a block and keep it from moving.
+// Pins nest; each pin must be matched by an unpin.
+// Safe to call from any thread, including while a compaction is running.
+void* heap_handle_pin(heap_handle_table_t* table, heap_handle_t handle);
+
+// Release a pin; the block may move once its last pin is released.
+// Addresses obtained from heap_handle_pin must not be used afterwards.
+void heap_handle_unpin(heap_handle_table_t* table, heap_handle_t handle);
+
+// Outcome of a compaction step.
+typedef enum heap_compact_status_t
+{
+	// The budget ran out, or a pass over the table moved blocks; call
+	// again to continue.
+	k_heap_compact_more,
+	// No arena is worth evacuating, or a full pass over the least occupied
+	// one moved nothing: its blocks are pinned or have no better home.
+	k_heap_compact_done,
+} heap_compact_status_t;
+
+// Move unpinned blocks out of the heap's least occupied arena into free
+// space elsewhere, for at most budget_us microseconds, then trim the heap.
+// The budget covers moving blocks, not the scan of the heap that picks the
+// arena. Call once per frame; each call continues where the previous one
+// stopped. Adds the number of blocks moved to *moved.
+heap_compact_status_t heap_handle_compact(heap_handle_table_t* table, uint64_t budget_us, int* moved);
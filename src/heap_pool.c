@@ -0,0 +1,167 @@
+#include "heap_pool.h"
+
+#include "atomic.h"
+#include "debug.h"
+#include "heap.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+enum
+{
+	k_pool_cache_line_size = 64,
+	// Free list head packs a 48-bit pointer with a 16-bit ABA tag.
+	k_pool_pointer_bits = 48,
+};
+
+// Header at the start of each slab, padded out to a full cache line.
+typedef struct pool_slab_t
+{
+	struct pool_slab_t* next;
+} pool_slab_t;
+
+// Link stored in the first bytes of every free object.
+typedef struct pool_node_t
+{
+	struct pool_node_t* next;
+} pool_node_t;
+
+typedef struct heap_pool_t
+{
+	// Tagged free list head; kept on its own cache line since every thread
+	// that allocates or frees hits it.
+	int64_t free_head;
+	char pad[k_pool_cache_line_size - sizeof(int64_t)];
+
+	heap_t* heap;
+	pool_slab_t* slabs;
+	size_t object_size;
+	size_t object_offset;
+	size_t slab_alignment;
+	size_t slab_size;
+	int objects_per_slab;
+} heap_pool_t;
+
+static int64_t pool_pack(pool_node_t* node, int64_t tag)
+{
+	return (int64_t)(((uint64_t)tag << k_pool_pointer_bits) | ((uintptr_t)node & ((1ULL << k_pool_pointer_bits) - 1)));
+}
+
+static pool_node_t* pool_unpack(int64_t head)
+{
+	return (pool_node_t*)(uintptr_t)((uint64_t)head & ((1ULL << k_pool_pointer_bits) - 1));
+}
+
+static int64_t pool_tag(int64_t head)
+{
+	return (int64_t)((uint64_t)head >> k_pool_pointer_bits);
+}
+
+// Push a pre-linked chain of nodes onto the free list.
+static void pool_push_chain(heap_pool_t* pool, pool_node_t* first, pool_node_t* last)
+{
+	while (true)
+	{
+		int64_t head = atomic_load64(&pool->free_head);
+		last->next = pool_unpack(head);
+		int64_t new_head = pool_pack(first, pool_tag(head) + 1);
+		if (atomic_compare_and_exchange64(&pool->free_head, head, new_head) == head)
+		{
+			break;
+		}
+	}
+}
+
+heap_pool_t* heap_pool_create(heap_t* heap, size_t object_size, size_t alignment, int objects_per_slab)
+{
+	alignment = __max(alignment, sizeof(pool_node_t*));
+	object_size = __max(object_size, sizeof(pool_node_t));
+	object_size = (object_size + (alignment - 1)) & ~(alignment - 1);
+
+	heap_pool_t* pool = heap_alloc(heap, sizeof(heap_pool_t), k_pool_cache_line_size);
+	pool->free_head = 0;
+	pool->heap = heap;
+	pool->slabs = NULL;
+	pool->object_size = object_size;
+	// Objects start on the first aligned cache line after the slab header.
+	pool->slab_alignment = __max(alignment, k_pool_cache_line_size);
+	pool->object_offset = (sizeof(pool_slab_t) + (pool->slab_alignment - 1)) & ~(pool->slab_alignment - 1);
+	pool->slab_size = pool->object_offset + object_size * objects_per_slab;
+	pool->objects_per_slab = objects_per_slab;
+	return pool;
+}
+
+void heap_pool_destroy(heap_pool_t* pool)
+{
+	pool_slab_t* slab = pool->slabs;
+	while (slab)
+	{
+		pool_slab_t* next = slab->next;
+		heap_free(pool->heap, slab);
+		slab = next;
+	}
+	heap_free(pool->heap, pool);
+}
+
+// Allocate a fresh slab and put all of its objects on the free list.
+// Several threads may grow the pool at once; that only costs an extra slab.
+static bool pool_grow(heap_pool_t* pool)
+{
+	pool_slab_t* slab = heap_alloc(pool->heap, pool->slab_size, pool->slab_alignment);
+	if (!slab)
+	{
+		debug_print(k_print_error, "Pool failed to allocate slab!\n");
+		return false;
+	}
+
+	while (true)
+	{
+		slab->next = pool->slabs;
+		if (atomic_compare_and_exchange_pointer((void**)&pool->slabs, slab->next, slab) == slab->next)
+		{
+			break;
+		}
+	}
+
+	char* objects = (char*)slab + pool->object_offset;
+	for (int i = 0; i < pool->objects_per_slab - 1; ++i)
+	{
+		((pool_node_t*)(objects + i * pool->object_size))->next = (pool_node_t*)(objects + (i + 1) * pool->object_size);
+	}
+	pool_push_chain(pool, (pool_node_t*)objects, (pool_node_t*)(objects + (pool->objects_per_slab - 1) * pool->object_size));
+	return true;
+}
+
+void* heap_pool_alloc(heap_pool_t* pool)
+{
+	while (true)
+	{
+		int64_t head = atomic_load64(&pool->free_head);
+		pool_node_t* node = pool_unpack(head);
+		if (!node)
+		{
+			if (!pool_grow(pool))
+			{
+				return NULL;
+			}
+			continue;
+		}
+
+		// Slabs are never freed while the pool lives, so reading next is safe
+		// even if another thread popped the node first; the tag makes the
+		// exchange fail in that case.
+		int64_t new_head = pool_pack(node->next, pool_tag(head) + 1);
+		if (atomic_compare_and_exchange64(&pool->free_head, head, new_head) == head)
+		{
+			return node;
+		}
+	}
+}
+
+void heap_pool_free(heap_pool_t* pool, void* object)
+{
+	if (object)
+	{
+		pool_push_chain(pool, object, object);
+	}
+}
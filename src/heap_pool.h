@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h>
+
+// Fixed-size object pool.
+//
+// Objects of a single size are carved out of cache-line-aligned slabs taken
+// from a heap_t. Allocating and freeing an object is O(1) and lock-free, so a
+// pool is a good fit for high-churn objects that are allocated on one thread
+// and freed on another. Slabs are only returned to the heap when the pool is
+// destroyed.
+
+// Handle to an object pool.
+typedef struct heap_pool_t heap_pool_t;
+
+typedef struct heap_t heap_t;
+
+// Create a pool of objects of object_size bytes aligned to alignment.
+// Slabs holding objects_per_slab objects are allocated from heap on demand.
+heap_pool_t* heap_pool_create(heap_t* heap, size_t object_size, size_t alignment, int objects_per_slab);
+
+// Destroy a pool and return all of its slabs to the heap.
+// Any objects still allocated from the pool become invalid.
+void heap_pool_destroy(heap_pool_t* pool);
+
+// Allocate an object from a pool.
+// Safe for multiple threads to allocate at the same time.
+void* heap_pool_alloc(heap_pool_t* pool);
+
+// Return an object to the pool it was allocated from.
+// Safe to call from any thread, including one other than the allocator.
+void heap_pool_free(heap_pool_t* pool, void* object);
@@ -0,0 +1,741 @@
+#include "job.h"
+
+#include "atomic.h"
+#include "fiber.h"
+#include "futex.h"
+#include "heap.h"
+#include "heap_pool.h"
+#include "mutex.h"
+#include "queue.h"
+#include "thread.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+enum
+{
+	k_job_cache_line_size = 64,
+	// Per-worker deque slots; a power of two.
+	k_job_deque_capacity = 4096,
+	// Slots in the queue shared by threads that are not workers.
+	k_job_queue_capacity = 4096,
+	k_job_max_workers = 64,
+	// Failed attempts to find a job before a thread sleeps.
+	k_job_spin_count = 64,
+	k_job_objects_per_slab = 256,
+	// Pooled fibers on top of one per worker. Every job parked in
+	// job_wait holds one.
+	k_job_fiber_count = 128,
+	k_job_fiber_stack_size = 128 * 1024,
+};
+
+// A pooled fiber. Workers run their loop, and the jobs it picks up, on
+// these rather than on the thread's own stack, so a job that waits can be
+// set aside with its stack while the thread carries on.
+typedef struct job_fiber_t
+{
+	fiber_t* fiber;
+	job_system_t* system;
+	// Next fiber parked on the same counter.
+	struct job_fiber_t* next;
+} job_fiber_t;
+
+typedef struct job_t
+{
+	void (*function)(void*);
+	void* data;
+	job_counter_t* counter;
+	// Next job held back by the same dependency.
+	struct job_t* next;
+} job_t;
+
+typedef struct job_counter_t
+{
+	// Jobs queued against this counter that have not finished.
+	int pending;
+	// Jobs waiting for pending to reach zero.
+	// Guarded by the system's dependency mutex.
+	job_t* dependents;
+	// Fibers parked in job_wait until pending reaches zero.
+	// Guarded by the system's dependency mutex.
+	job_fiber_t* waiters;
+} job_counter_t;
+
+// Chase-Lev work-stealing deque.
+// The owning worker pushes and pops at the bottom; other threads steal from
+// the top. Only a steal, or a pop racing a steal for the last job, needs a
+// compare-and-exchange.
+typedef struct job_deque_t
+{
+	int64_t top;
+	char top_pad[k_job_cache_line_size - sizeof(int64_t)];
+	int64_t bottom;
+	char bottom_pad[k_job_cache_line_size - sizeof(int64_t)];
+	job_t* jobs[k_job_deque_capacity];
+} job_deque_t;
+
+// What to do with a fiber once it has been switched away from. It cannot
+// do this itself: another thread may resume it as soon as it is released.
+typedef enum job_switch_action_t
+{
+	k_job_switch_none,
+	// Return it to the pool of free fibers.
+	k_job_switch_release,
+	// Park it on a counter until the counter reaches zero.
+	k_job_switch_park,
+} job_switch_action_t;
+
+typedef struct job_worker_t
+{
+	job_deque_t deque;
+	job_system_t* system;
+	thread_t* thread;
+	uint32_t seed;
+	// The thread's own stack, resumed when the system quits.
+	fiber_t* thread_fiber;
+	// The pooled fiber running on this thread.
+	job_fiber_t* current;
+	// Left for the fiber switched to, to apply to the one switched from.
+	job_switch_action_t action;
+	job_fiber_t* action_fiber;
+	job_counter_t* action_counter;
+} job_worker_t;
+
+typedef struct job_system_t
+{
+	heap_t* heap;
+	heap_pool_t* job_pool;
+	heap_pool_t* counter_pool;
+	queue_t* queue;
+	mutex_t* dependency_mutex;
+	// The calling thread's job_worker_t, or NULL if it is not a worker.
+	uint64_t worker_tls;
+	job_worker_t* workers;
+	int worker_count;
+	job_fiber_t* fibers;
+	int fiber_count;
+	queue_t* free_fibers;
+	// Parked fibers whose counter has reached zero.
+	queue_t* ready_fibers;
+
+	// Futex word, bumped whenever there may be something new to do.
+	int epoch;
+	// Threads asleep on epoch.
+	int sleepers;
+	int quit;
+} job_system_t;
+
+static int job_worker_func(void* user);
+static void job_fiber_func(void* data);
+
+static bool job_deque_push(job_deque_t* deque, job_t* job)
+{
+	int64_t bottom = deque->bottom;
+	if (bottom - atomic_load64(&deque->top) >= k_job_deque_capacity)
+	{
+		return false;
+	}
+	deque->jobs[bottom & (k_job_deque_capacity - 1)] = job;
+	// Only the owner writes bottom; thieves need just the job before it.
+	atomic_store64_explicit(&deque->bottom, bottom + 1, k_atomic_order_release);
+	return true;
+}
+
+static job_t* job_deque_pop(job_deque_t* deque)
+{
+	int64_t bottom = deque->bottom - 1;
+	// Full barrier: a thief must see the lower bottom before we read top.
+	atomic_store64(&deque->bottom, bottom);
+	int64_t top = atomic_load64(&deque->top);
+	if (top > bottom)
+	{
+		// Empty.
+		atomic_store64(&deque->bottom, bottom + 1);
+		return NULL;
+	}
+	job_t* job = deque->jobs[bottom & (k_job_deque_capacity - 1)];
+	if (top == bottom)
+	{
+		// The last job; race any thief for it.
+		if (atomic_compare_and_exchange64(&deque->top, top, top + 1) != top)
+		{
+			job = NULL;
+		}
+		atomic_store64(&deque->bottom, bottom + 1);
+	}
+	return job;
+}
+
+static job_t* job_deque_steal(job_deque_t* deque)
+{
+	int64_t top = atomic_load64(&deque->top);
+	// Pairs with the full barrier in job_deque_pop, so a thief and the
+	// owner cannot both miss each other's claim on the last job.
+	atomic_fence(k_atomic_order_seq_cst);
+	int64_t bottom = atomic_load64(&deque->bottom);
+	if (top >= bottom)
+	{
+		return NULL;
+	}
+	job_t* job = atomic_load_pointer((void**)&deque->jobs[top & (k_job_deque_capacity - 1)]);
+	if (atomic_compare_and_exchange64(&deque->top, top, top + 1) != top)
+	{
+		// Lost to the owner or another thief.
+		return NULL;
+	}
+	return job;
+}
+
+job_system_t* job_system_create(heap_t* heap, int worker_count)
+{
+	if (worker_count <= 0)
+	{
+		worker_count = thread_get_core_count();
+	}
+	worker_count = __min(worker_count, k_job_max_workers);
+
+	job_system_t* system = heap_alloc(heap, sizeof(job_system_t), 8);
+	system->heap = heap;
+	system->job_pool = heap_pool_create(heap, sizeof(job_t), 8, k_job_objects_per_slab);
+	system->counter_pool = heap_pool_create(heap, sizeof(job_counter_t), 8, k_job_objects_per_slab);
+	system->queue = queue_create(heap, k_job_queue_capacity);
+	system->dependency_mutex = mutex_create();
+	system->worker_tls = thread_local_alloc();
+	system->worker_count = worker_count;
+	system->epoch = 0;
+	system->sleepers = 0;
+	system->quit = 0;
+
+	system->fiber_count = k_job_fiber_count + worker_count;
+	system->fibers = heap_alloc(heap, sizeof(job_fiber_t) * system->fiber_count, 8);
+	system->free_fibers = queue_create(heap, system->fiber_count);
+	system->ready_fibers = queue_create(heap, system->fiber_count);
+	for (int i = 0; i < system->fiber_count; ++i)
+	{
+		job_fiber_t* fiber = &system->fibers[i];
+		fiber->fiber = fiber_create(heap, k_job_fiber_stack_size, job_fiber_func, fiber);
+		fiber->system = system;
+		fiber->next = NULL;
+		// A fiber whose stack could not be mapped is never handed out.
+		if (fiber->fiber)
+		{
+			queue_push(system->free_fibers, fiber);
+		}
+	}
+
+	system->workers = heap_alloc(heap, sizeof(job_worker_t) * worker_count, k_job_cache_line_size);
+	for (int i = 0; i < worker_count; ++i)
+	{
+		job_worker_t* worker = &system->workers[i];
+		worker->deque.top = 0;
+		worker->deque.bottom = 0;
+		worker->system = system;
+		worker->seed = 0x9e3779b9u * (i + 1);
+		worker->thread_fiber = NULL;
+		worker->current = NULL;
+		worker->action = k_job_switch_none;
+		worker->action_fiber = NULL;
+		worker->action_counter = NULL;
+	}
+	// Start the threads once every deque is ready to be stolen from. Each
+	// worker stays on one physical core, free to move between its SMT
+	// siblings, so its deque and fibers stay in that core's caches.
+	thread_topology_t topology;
+	thread_get_topology(&topology);
+	for (int i = 0; i < worker_count; ++i)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "job worker %d", i);
+		thread_info_t thread_info =
+		{
+			.function = job_worker_func,
+			.data = &system->workers[i],
+			.name = name,
+			.affinity_mask = topology.core_masks[i % topology.core_count],
+		};
+		system->workers[i].thread = thread_create_ex(&thread_info);
+	}
+	return system;
+}
+
+void job_system_destroy(job_system_t* system)
+{
+	atomic_store(&system->quit, 1);
+	atomic_increment(&system->epoch);
+	futex_wake_all(&system->epoch);
+	for (int i = 0; i < system->worker_count; ++i)
+	{
+		thread_destroy(system->workers[i].thread);
+	}
+
+	// Fibers left parked or suspended are dropped with their stacks.
+	for (int i = 0; i < system->fiber_count; ++i)
+	{
+		if (system->fibers[i].fiber)
+		{
+			fiber_destroy(system->fibers[i].fiber);
+		}
+	}
+	queue_destroy(system->ready_fibers);
+	queue_destroy(system->free_fibers);
+	heap_free(system->heap, system->fibers);
+	heap_free(system->heap, system->workers);
+	thread_local_free(system->worker_tls);
+	mutex_destroy(system->dependency_mutex);
+	queue_destroy(system->queue);
+	heap_pool_destroy(system->counter_pool);
+	heap_pool_destroy(system->job_pool);
+	heap_free(system->heap, system);
+}
+
+int job_system_get_worker_count(job_system_t* system)
+{
+	return system->worker_count;
+}
+
+job_counter_t* job_counter_create(job_system_t* system)
+{
+	job_counter_t* counter = heap_pool_alloc(system->counter_pool);
+	counter->pending = 0;
+	counter->dependents = NULL;
+	counter->waiters = NULL;
+	return counter;
+}
+
+void job_counter_destroy(job_system_t* system, job_counter_t* counter)
+{
+	heap_pool_free(system->counter_pool, counter);
+}
+
+bool job_counter_is_done(job_counter_t* counter)
+{
+	return atomic_load(&counter->pending) == 0;
+}
+
+// Let sleeping threads know there may be something new to do.
+static void job_notify(job_system_t* system, bool all)
+{
+	atomic_increment(&system->epoch);
+	if (atomic_load(&system->sleepers) > 0)
+	{
+		if (all)
+		{
+			futex_wake_all(&system->epoch);
+		}
+		else
+		{
+			futex_wake_one(&system->epoch);
+		}
+	}
+}
+
+static void job_execute(job_system_t* system, job_t* job);
+
+// Queue a job that is ready to run, without waking anyone.
+static void job_enqueue(job_system_t* system, job_t* job)
+{
+	job_worker_t* worker = thread_local_get(system->worker_tls);
+	if (worker && job_deque_push(&worker->deque, job))
+	{
+		return;
+	}
+	if (worker)
+	{
+		// The deque is full. A worker must not block on the shared queue,
+		// since the workers are what drain it.
+		if (!queue_try_push(system->queue, job))
+		{
+			job_execute(system, job);
+		}
+		return;
+	}
+	queue_push(system->queue, job);
+}
+
+static void job_counter_finish(job_system_t* system, job_counter_t* counter)
+{
+	int pending = atomic_load(&counter->pending);
+	while (true)
+	{
+		if (pending > 1)
+		{
+			int old_pending = atomic_compare_and_exchange(&counter->pending, pending, pending - 1);
+			if (old_pending == pending)
+			{
+				return;
+			}
+			pending = old_pending;
+			continue;
+		}
+
+		// Reaching zero releases the dependents. Detach them first and touch
+		// nothing in the counter after the exchange: a waiter that sees zero
+		// may destroy the counter right away.
+		mutex_lock(system->dependency_mutex);
+		job_t* dependents = counter->dependents;
+		job_fiber_t* waiters = counter->waiters;
+		counter->dependents = NULL;
+		counter->waiters = NULL;
+		int old_pending = atomic_compare_and_exchange(&counter->pending, 1, 0);
+		if (old_pending != 1)
+		{
+			counter->dependents = dependents;
+			counter->waiters = waiters;
+		}
+		mutex_unlock(system->dependency_mutex);
+		if (old_pending != 1)
+		{
+			pending = old_pending;
+			continue;
+		}
+
+		while (dependents)
+		{
+			job_t* next = dependents->next;
+			job_enqueue(system, dependents);
+			dependents = next;
+		}
+		while (waiters)
+		{
+			job_fiber_t* next = waiters->next;
+			queue_push(system->ready_fibers, waiters);
+			waiters = next;
+		}
+		// Waiters, and workers free to resume parked fibers, sleep on the epoch.
+		job_notify(system, true);
+		return;
+	}
+}
+
+static void job_execute(job_system_t* system, job_t* job)
+{
+	job->function(job->data);
+	job_counter_t* counter = job->counter;
+	heap_pool_free(system->job_pool, job);
+	if (counter)
+	{
+		job_counter_finish(system, counter);
+	}
+}
+
+// Look for a job: the calling worker's own deque first, then the shared
+// queue, then the other workers' deques.
+static job_t* job_find(job_system_t* system, job_worker_t* worker)
+{
+	job_t* job = NULL;
+	if (worker)
+	{
+		job = job_deque_pop(&worker->deque);
+		if (job)
+		{
+			return job;
+		}
+	}
+	job = queue_try_pop(system->queue);
+	if (job)
+	{
+		return job;
+	}
+
+	uint32_t start;
+	if (worker)
+	{
+		worker->seed ^= worker->seed << 13;
+		worker->seed ^= worker->seed >> 17;
+		worker->seed ^= worker->seed << 5;
+		start = worker->seed;
+	}
+	else
+	{
+		// Drop the low bits, which the control block's alignment zeroes.
+		start = (uint32_t)(thread_get_self() >> 8);
+	}
+	for (int i = 0; i < system->worker_count; ++i)
+	{
+		job_worker_t* victim = &system->workers[(start + i) % system->worker_count];
+		if (victim != worker)
+		{
+			job = job_deque_steal(&victim->deque);
+			if (job)
+			{
+				return job;
+			}
+		}
+	}
+	return NULL;
+}
+
+// Apply the action left by the fiber the calling worker just switched from.
+static void job_after_switch(job_system_t* system)
+{
+	job_worker_t* worker = thread_local_get(system->worker_tls);
+	job_fiber_t* fiber = worker->action_fiber;
+	job_counter_t* counter = worker->action_counter;
+	job_switch_action_t action = worker->action;
+	worker->action = k_job_switch_none;
+
+	if (action == k_job_switch_release)
+	{
+		queue_push(system->free_fibers, fiber);
+		// A waiter may be out of fibers to park on.
+		job_notify(system, false);
+	}
+	else if (action == k_job_switch_park)
+	{
+		mutex_lock(system->dependency_mutex);
+		bool held = atomic_load(&counter->pending) != 0;
+		if (held)
+		{
+			fiber->next = counter->waiters;
+			counter->waiters = fiber;
+		}
+		mutex_unlock(system->dependency_mutex);
+		if (!held)
+		{
+			// The counter finished while we were switching.
+			queue_push(system->ready_fibers, fiber);
+			job_notify(system, false);
+		}
+	}
+}
+
+// Switch the calling worker from its current fiber to another; NULL means
+// the thread's own stack. The action is applied to the fiber switched from
+// once it is fully suspended. Returns when that fiber is resumed, which may
+// be on a different thread.
+static void job_switch(job_system_t* system, job_fiber_t* to, job_switch_action_t action, job_counter_t* counter)
+{
+	job_worker_t* worker = thread_local_get(system->worker_tls);
+	job_fiber_t* from = worker->current;
+	worker->current = to;
+	worker->action = action;
+	worker->action_fiber = from;
+	worker->action_counter = counter;
+	fiber_switch(from ? from->fiber : worker->thread_fiber, to ? to->fiber : worker->thread_fiber);
+	job_after_switch(system);
+}
+
+// Find something for a worker fiber to do: a parked fiber ready to resume,
+// then a job. A fiber that is about to park takes a free fiber too, since
+// it only needs somewhere to switch to.
+static bool job_take(job_system_t* system, bool parking, job_fiber_t** fiber, job_t** job)
+{
+	*fiber = queue_try_pop(system->ready_fibers);
+	if (!*fiber && parking)
+	{
+		*fiber = queue_try_pop(system->free_fibers);
+	}
+	// Look the worker up each time; a fiber moves between threads.
+	*job = *fiber ? NULL : job_find(system, thread_local_get(system->worker_tls));
+	return *fiber || *job;
+}
+
+// Run a worker fiber until done(counter) or, without a counter, until the
+// system quits. A waiting fiber parks on its counter as soon as there is
+// another fiber for the thread to run, and runs jobs itself until then.
+// The worker loop goes back to the pool when it hands its thread to a
+// resumed fiber. Sleeps on the epoch when there is nothing to do.
+static void job_fiber_loop(job_system_t* system, job_counter_t* counter)
+{
+	int spin = 0;
+	while (counter ? atomic_load(&counter->pending) != 0 : !atomic_load(&system->quit))
+	{
+		job_fiber_t* fiber = NULL;
+		job_t* job = NULL;
+		if (!job_take(system, counter != NULL, &fiber, &job) && spin++ >= k_job_spin_count)
+		{
+			// Register before the final check, so a thread that queues a job or
+			// finishes a counter after it is guaranteed to see us.
+			atomic_increment(&system->sleepers);
+			int epoch = atomic_load(&system->epoch);
+			bool done = counter ? atomic_load(&counter->pending) == 0 : atomic_load(&system->quit) != 0;
+			if (!done && !job_take(system, counter != NULL, &fiber, &job))
+			{
+				futex_wait(&system->epoch, epoch);
+			}
+			atomic_decrement(&system->sleepers);
+			spin = 0;
+		}
+		if (fiber)
+		{
+			job_switch(system, fiber, counter ? k_job_switch_park : k_job_switch_release, counter);
+			spin = 0;
+		}
+		else if (job)
+		{
+			job_execute(system, job);
+			spin = 0;
+		}
+		else
+		{
+			atomic_pause();
+		}
+	}
+}
+
+// Run jobs on a thread that is not a worker until done(counter).
+// Sleeps on the epoch when there is nothing to do.
+static void job_help(job_system_t* system, job_counter_t* counter)
+{
+	int spin = 0;
+	while (atomic_load(&counter->pending) != 0)
+	{
+		job_t* job = job_find(system, NULL);
+		if (job)
+		{
+			job_execute(system, job);
+			spin = 0;
+			continue;
+		}
+		if (spin++ < k_job_spin_count)
+		{
+			atomic_pause();
+			continue;
+		}
+
+		atomic_increment(&system->sleepers);
+		int epoch = atomic_load(&system->epoch);
+		job = atomic_load(&counter->pending) == 0 ? NULL : job_find(system, NULL);
+		if (atomic_load(&counter->pending) != 0 && !job)
+		{
+			futex_wait(&system->epoch, epoch);
+		}
+		atomic_decrement(&system->sleepers);
+		if (job)
+		{
+			job_execute(system, job);
+		}
+		spin = 0;
+	}
+}
+
+static void job_fiber_func(void* data)
+{
+	job_fiber_t* self = data;
+	job_after_switch(self->system);
+	job_fiber_loop(self->system, NULL);
+	// Quitting: give the thread back its own stack. Never resumed.
+	job_switch(self->system, NULL, k_job_switch_none, NULL);
+}
+
+static int job_worker_func(void* user)
+{
+	job_worker_t* worker = user;
+	job_system_t* system = worker->system;
+	thread_local_set(system->worker_tls, worker);
+	// The thread's own stack only starts the first fiber and waits for it
+	// to hand back when the system quits.
+	worker->thread_fiber = fiber_convert_thread(system->heap);
+	job_switch(system, queue_pop(system->free_fibers), k_job_switch_none, NULL);
+	fiber_revert_thread(worker->thread_fiber);
+	return 0;
+}
+
+static job_t* job_create(job_system_t* system, void (*function)(void*), void* data, job_counter_t* counter)
+{
+	job_t* job = heap_pool_alloc(system->job_pool);
+	job->function = function;
+	job->data = data;
+	job->counter = counter;
+	job->next = NULL;
+	if (counter)
+	{
+		atomic_increment(&counter->pending);
+	}
+	return job;
+}
+
+void job_run(job_system_t* system, void (*function)(void*), void* data, job_counter_t* counter, job_counter_t* dependency)
+{
+	job_t* job = job_create(system, function, data, counter);
+	if (dependency)
+	{
+		mutex_lock(system->dependency_mutex);
+		bool held = atomic_load(&dependency->pending) != 0;
+		if (held)
+		{
+			job->next = dependency->dependents;
+			dependency->dependents = job;
+		}
+		mutex_unlock(system->dependency_mutex);
+		if (held)
+		{
+			return;
+		}
+	}
+	job_enqueue(system, job);
+	job_notify(system, false);
+}
+
+void job_wait(job_system_t* system, job_counter_t* counter)
+{
+	// Workers only ever run jobs on pooled fibers.
+	if (thread_local_get(system->worker_tls))
+	{
+		job_fiber_loop(system, counter);
+	}
+	else
+	{
+		job_help(system, counter);
+	}
+}
+
+void job_counter_increment(job_counter_t* counter)
+{
+	atomic_increment(&counter->pending);
+}
+
+void job_counter_decrement(job_system_t* system, job_counter_t* counter)
+{
+	job_counter_finish(system, counter);
+}
+
+typedef struct job_range_t
+{
+	void (*function)(void* user, int begin, int end);
+	void* user;
+	int begin;
+	int end;
+} job_range_t;
+
+static void job_range_func(void* data)
+{
+	job_range_t* range = data;
+	range->function(range->user, range->begin, range->end);
+}
+
+void job_parallel_for(job_system_t* system, int count, int batch, void (*function)(void* user, int begin, int end), void* user)
+{
+	batch = __max(batch, 1);
+	int range_count = (count + batch - 1) / batch;
+	if (range_count <= 1)
+	{
+		if (count > 0)
+		{
+			function(user, 0, count);
+		}
+		return;
+	}
+
+	job_range_t* ranges = heap_alloc(system->heap, sizeof(job_range_t) * range_count, 8);
+	job_counter_t* counter = job_counter_create(system);
+	// The calling thread takes the first range itself.
+	for (int i = 1; i < range_count; ++i)
+	{
+		ranges[i] = (job_range_t)
+		{
+			.function = function,
+			.user = user,
+			.begin = i * batch,
+			.end = __min((i + 1) * batch, count),
+		};
+		job_enqueue(system, job_create(system, job_range_func, &ranges[i], counter));
+	}
+	job_notify(system, true);
+
+	function(user, 0, batch);
+	job_wait(system, counter);
+
+	job_counter_destroy(system, counter);
+	heap_free(system->heap, ranges);
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Job system.
+//
+// A pool of worker threads, one per core, runs small jobs. Each worker
+// keeps its own work-stealing deque: jobs queued from inside a job go to
+// the running worker's deque, and idle workers steal from the others.
+// Jobs queued from any other thread go through a shared queue.
+//
+// Completion is tracked with counters. A counter goes up when a job is
+// queued against it and down when that job finishes. Threads can wait for
+// a counter to reach zero, and jobs can be held back until it does.
+//
+// Workers run jobs on a pool of fibers. A job that waits on a counter
+// parks its fiber, stack and all, and the worker moves on to other jobs;
+// the fiber is resumed, perhaps by another worker, once the counter
+// reaches zero. Work done outside the job system, such as file I/O, can
+// be waited on the same way by raising a counter for it.
+//
+// Because a job may resume on a different thread, it must not hold a
+// mutex_t across a wait. Mutexes belong to threads, not jobs: the unlock
+// would come from the wrong thread, and while the job is parked, another
+// job on the original thread could lock the mutex recursively.
+
+// Handle to a job system.
+typedef struct job_system_t job_system_t;
+
+// Handle to a job counter.
+typedef struct job_counter_t job_counter_t;
+
+typedef struct heap_t heap_t;
+
+// Create a job system with worker_count worker threads.
+// If worker_count is zero, one worker is created per core.
+job_system_t* job_system_create(heap_t* heap, int worker_count);
+
+// Destroy a job system.
+// Jobs still queued are not run; wait for their counters first.
+void job_system_destroy(job_system_t* system);
+
+// Returns the number of worker threads.
+int job_system_get_worker_count(job_system_t* system);
+
+// Create a job counter, initially zero.
+job_counter_t* job_counter_create(job_system_t* system);
+
+// Destroy a job counter. No job may still be queued against it.
+void job_counter_destroy(job_system_t* system, job_counter_t* counter);
+
+// Returns true if every job queued against a counter has finished.
+bool job_counter_is_done(job_counter_t* counter);
+
+// Raise a counter for work done outside the job system.
+void job_counter_increment(job_counter_t* counter);
+
+// Lower a counter raised with job_counter_increment, once that work is done.
+// Safe to call from any thread.
+void job_counter_decrement(job_system_t* system, job_counter_t* counter);
+
+// Queue function(data) to run on a worker.
+// If counter is not NULL, it is raised now and lowered when the job
+// finishes. If dependency is not NULL, the job does not start until the
+// dependency counter reaches zero.
+// Safe to call from any thread, including from inside a job.
+void job_run(job_system_t* system, void (*function)(void*), void* data, job_counter_t* counter, job_counter_t* dependency);
+
+// Wait until a counter reaches zero.
+// Inside a job, parks the job's fiber so the worker can run other jobs,
+// and the job may resume on another thread; no mutex_t may be held.
+// Elsewhere, runs queued jobs while waiting.
+void job_wait(job_system_t* system, job_counter_t* counter);
+
+// Call function(user, begin, end) over [0, count) in ranges of up to batch
+// indices, spread across the workers. Returns once every range is done.
+void job_parallel_for(job_system_t* system, int count, int batch, void (*function)(void* user, int begin, int end), void* user);
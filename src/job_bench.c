@@ -0,0 +1,263 @@
+#include "job_bench.h"
+
+#include "debug.h"
+#include "heap.h"
+#include "job.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+enum
+{
+	k_job_bench_entities = 1024 * 1024,
+	k_job_bench_batch = 4096,
+	k_job_bench_chunks = k_job_bench_entities / k_job_bench_batch,
+	// Chunks damped by the jobs of one group.
+	k_job_bench_group_size = 16,
+	k_job_bench_groups = k_job_bench_chunks / k_job_bench_group_size,
+	k_job_bench_frames = 100,
+	k_job_bench_max_threads = 64,
+};
+
+// Components stored as parallel arrays, as an ECS stores them.
+typedef struct job_bench_world_t
+{
+	float* position_x;
+	float* position_y;
+	float* velocity_x;
+	float* velocity_y;
+	float dt;
+	// Per-chunk bounds, reduced in a fixed order so every run agrees.
+	float chunk_max_x[k_job_bench_chunks];
+	float chunk_max_y[k_job_bench_chunks];
+} job_bench_world_t;
+
+typedef struct job_bench_chunk_t
+{
+	job_bench_world_t* world;
+	int index;
+} job_bench_chunk_t;
+
+static void integrate_range(void* user, int begin, int end)
+{
+	job_bench_world_t* world = user;
+	for (int i = begin; i < end; ++i)
+	{
+		// Steer around a vortex, so each entity costs a little math.
+		float x = world->position_x[i];
+		float y = world->position_y[i];
+		float angle = atan2f(y, x);
+		world->velocity_x[i] += -sinf(angle) * world->dt;
+		world->velocity_y[i] += cosf(angle) * world->dt;
+		world->position_x[i] = x + world->velocity_x[i] * world->dt;
+		world->position_y[i] = y + world->velocity_y[i] * world->dt;
+	}
+}
+
+static void damp_chunk(void* data)
+{
+	job_bench_chunk_t* chunk = data;
+	job_bench_world_t* world = chunk->world;
+	for (int i = chunk->index * k_job_bench_batch; i < (chunk->index + 1) * k_job_bench_batch; ++i)
+	{
+		world->velocity_x[i] *= 0.99f;
+		world->velocity_y[i] *= 0.99f;
+	}
+}
+
+typedef struct job_bench_group_t
+{
+	job_system_t* system;
+	job_bench_chunk_t* chunks;
+} job_bench_group_t;
+
+// Fan out one job per chunk and wait for them from inside a job, so the
+// waiting job parks while its worker runs others.
+static void damp_group(void* data)
+{
+	job_bench_group_t* group = data;
+	job_counter_t* counter = job_counter_create(group->system);
+	for (int i = 0; i < k_job_bench_group_size; ++i)
+	{
+		job_run(group->system, damp_chunk, &group->chunks[i], counter, NULL);
+	}
+	job_wait(group->system, counter);
+	job_counter_destroy(group->system, counter);
+}
+
+static void bounds_chunk(void* data)
+{
+	job_bench_chunk_t* chunk = data;
+	job_bench_world_t* world = chunk->world;
+	float max_x = -INFINITY;
+	float max_y = -INFINITY;
+	for (int i = chunk->index * k_job_bench_batch; i < (chunk->index + 1) * k_job_bench_batch; ++i)
+	{
+		max_x = fmaxf(max_x, world->position_x[i]);
+		max_y = fmaxf(max_y, world->position_y[i]);
+	}
+	world->chunk_max_x[chunk->index] = max_x;
+	world->chunk_max_y[chunk->index] = max_y;
+}
+
+static void world_reset(job_bench_world_t* world)
+{
+	uint32_t seed = 0x2545f491u;
+	for (int i = 0; i < k_job_bench_entities; ++i)
+	{
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		world->position_x[i] = (float)(seed & 0xffff) / 65536.0f - 0.5f;
+		world->position_y[i] = (float)(seed >> 16) / 65536.0f - 0.5f;
+		world->velocity_x[i] = 0.0f;
+		world->velocity_y[i] = 0.0f;
+	}
+	world->dt = 1.0f / 60.0f;
+}
+
+static uint64_t world_checksum(job_bench_world_t* world)
+{
+	uint64_t checksum = 0;
+	for (int i = 0; i < k_job_bench_chunks; ++i)
+	{
+		uint32_t x;
+		uint32_t y;
+		memcpy(&x, &world->chunk_max_x[i], sizeof(x));
+		memcpy(&y, &world->chunk_max_y[i], sizeof(y));
+		checksum = checksum * 31 + x;
+		checksum = checksum * 31 + y;
+	}
+	return checksum;
+}
+
+// Run the frames with thread_count threads: the calling thread plus
+// thread_count - 1 workers. One thread runs everything inline.
+static uint64_t job_bench_run(heap_t* heap, job_bench_world_t* world, int thread_count, int frames, uint64_t* checksum)
+{
+	job_system_t* system = thread_count > 1 ? job_system_create(heap, thread_count - 1) : NULL;
+	job_bench_chunk_t* chunks = heap_alloc(heap, sizeof(job_bench_chunk_t) * k_job_bench_chunks, 8);
+	for (int i = 0; i < k_job_bench_chunks; ++i)
+	{
+		chunks[i].world = world;
+		chunks[i].index = i;
+	}
+	job_bench_group_t* groups = heap_alloc(heap, sizeof(job_bench_group_t) * k_job_bench_groups, 8);
+	for (int i = 0; i < k_job_bench_groups; ++i)
+	{
+		groups[i].system = system;
+		groups[i].chunks = &chunks[i * k_job_bench_group_size];
+	}
+	world_reset(world);
+
+	uint64_t t0 = timer_get_ticks();
+	for (int frame = 0; frame < frames; ++frame)
+	{
+		if (!system)
+		{
+			integrate_range(world, 0, k_job_bench_entities);
+			for (int i = 0; i < k_job_bench_chunks; ++i)
+			{
+				damp_chunk(&chunks[i]);
+			}
+			for (int i = 0; i < k_job_bench_chunks; ++i)
+			{
+				bounds_chunk(&chunks[i]);
+			}
+			continue;
+		}
+
+		job_parallel_for(system, k_job_bench_entities, k_job_bench_batch, integrate_range, world);
+
+		// Bounds jobs are queued up front but held back until every damping
+		// job is done, as a later system depending on an earlier one.
+		job_counter_t* damped = job_counter_create(system);
+		job_counter_t* done = job_counter_create(system);
+		for (int i = 0; i < k_job_bench_groups; ++i)
+		{
+			job_run(system, damp_group, &groups[i], damped, NULL);
+		}
+		for (int i = 0; i < k_job_bench_chunks; ++i)
+		{
+			job_run(system, bounds_chunk, &chunks[i], done, damped);
+		}
+		job_wait(system, done);
+		job_counter_destroy(system, done);
+		job_counter_destroy(system, damped);
+	}
+	uint64_t ticks = timer_get_ticks() - t0;
+
+	*checksum = world_checksum(world);
+	heap_free(heap, groups);
+	heap_free(heap, chunks);
+	if (system)
+	{
+		job_system_destroy(system);
+	}
+	return ticks;
+}
+
+int job_bench_main(int argc, const char** argv)
+{
+	int max_threads = __min(thread_get_core_count(), k_job_bench_max_threads);
+	int frames = k_job_bench_frames;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+		{
+			int threads = atoi(argv[++i]);
+			max_threads = __max(__min(threads, k_job_bench_max_threads), 1);
+		}
+		else if (strcmp(argv[i], "--quick") == 0)
+		{
+			frames /= 10;
+		}
+		else
+		{
+			debug_print(k_print_error, "Unknown option: %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	heap_t* heap = heap_create(4 * 1024 * 1024);
+	job_bench_world_t* world = heap_alloc(heap, sizeof(job_bench_world_t), 64);
+	world->position_x = heap_alloc(heap, sizeof(float) * k_job_bench_entities, 64);
+	world->position_y = heap_alloc(heap, sizeof(float) * k_job_bench_entities, 64);
+	world->velocity_x = heap_alloc(heap, sizeof(float) * k_job_bench_entities, 64);
+	world->velocity_y = heap_alloc(heap, sizeof(float) * k_job_bench_entities, 64);
+
+	bool ok = true;
+	uint64_t baseline_ticks = 0;
+	uint64_t baseline_checksum = 0;
+	// 1, 2, 4, ... threads, always ending with the maximum.
+	for (int threads = 1; ; threads = __min(threads * 2, max_threads))
+	{
+		uint64_t checksum = 0;
+		uint64_t ticks = job_bench_run(heap, world, threads, frames, &checksum);
+		if (threads == 1)
+		{
+			baseline_ticks = ticks;
+			baseline_checksum = checksum;
+		}
+		bool match = checksum == baseline_checksum;
+		ok = ok && match;
+		debug_print(k_print_warning, "job threads=%-2d frame=%-8lluus speedup=%.2fx %s\n",
+			threads, (unsigned long long)(timer_ticks_to_us(ticks) / __max(frames, 1)),
+			(double)baseline_ticks / (double)__max(ticks, 1), match ? "ok" : "RESULT MISMATCH");
+		if (threads == max_threads)
+		{
+			break;
+		}
+	}
+
+	heap_free(heap, world->velocity_y);
+	heap_free(heap, world->velocity_x);
+	heap_free(heap, world->position_y);
+	heap_free(heap, world->position_x);
+	heap_free(heap, world);
+	heap_destroy(heap);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+// Job system benchmarks.
+//
+// Runs an ECS-style frame over a million entities stored as component
+// arrays: a parallel_for that integrates motion, then per-chunk damping
+// jobs, then per-chunk bounds jobs that depend on the damping. Repeats the frame for a sweep of thread counts
+// and reports time per frame and speedup over a single thread. The
+// results are checked against the single thread run.
+
+// Run the benchmark suite. Accepts these options:
+//   --threads N  largest thread count in the sweep (default: core count)
+//   --quick      fewer frames, for smoke testing
+// Returns zero on success, nonzero if a run computed different results.
+int job_bench_main(int argc, const char** argv);
@@ -0,0 +1,11 @@
+#include "job_bench.h"
+#include "timer.h"
+
+// Standalone entry point for the job system benchmarks; see the Makefile.
+// The game runs the same suite with: ga2022 --job-bench [options]
+
+int main(int argc, const char* argv[])
+{
+	timer_startup();
+	return job_bench_main(argc, argv);
+}
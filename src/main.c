@@ -1,14 +1,23 @@
 #include "debug.h"
 #include "fs.h"
+#include "fs_bench.h"
 #include "heap.h"
+#include "heap_bench.h"
+#include "job.h"
+#include "job_bench.h"
+#include "queue_bench.h"
 #include "render.h"
+#include "sync_bench.h"
 #include "frogger_game.h"
+#include "thread.h"
 #include "timer.h"
 #include "wm.h"
 #include "audio.h"
 
 #include "cpp_test.h"
 
+#include <string.h>
+
 int main(int argc, const char* argv[])
 {
 	debug_set_print_mask(k_print_info | k_print_warning | k_print_error);
@@ -16,12 +25,49 @@ int main(int argc, const char* argv[])
 
 	timer_startup();
 
+	if (argc >= 2 && strcmp(argv[1], "--heap-bench") == 0)
+	{
+		return heap_bench_main(argc - 1, argv + 1);
+	}
+	if (argc >= 2 && strcmp(argv[1], "--queue-bench") == 0)
+	{
+		return queue_bench_main(argc - 1, argv + 1);
+	}
+	if (argc >= 2 && strcmp(argv[1], "--job-bench") == 0)
+	{
+		return job_bench_main(argc - 1, argv + 1);
+	}
+	if (argc >= 2 && strcmp(argv[1], "--sync-bench") == 0)
+	{
+		return sync_bench_main(argc - 1, argv + 1);
+	}
+	if (argc >= 2 && strcmp(argv[1], "--fs-bench") == 0)
+	{
+		return fs_bench_main(argc - 1, argv + 1);
+	}
+
+	thread_set_name("main");
+
 	cpp_test_function(42);
 
 	heap_t* heap = heap_create(2 * 1024 * 1024);
-	fs_t* fs = fs_create(heap, 8);
+	// Budgeted child heaps keep each subsystem's memory measurable and
+	// its fragmentation away from the others.
+	heap_t* fs_heap = heap_create_child(heap, "fs", 256 * 1024, 16 * 1024 * 1024);
+	heap_t* render_heap = heap_create_child(heap, "render", 1024 * 1024, 64 * 1024 * 1024);
+	job_system_t* jobs = job_system_create(heap, 0);
+	fs_info_t fs_info =
+	{
+		.heap = fs_heap,
+		.queue_capacity = 8,
+		// Enough reads in flight to keep an SSD busy while assets load.
+		.file_thread_count = 4,
+		.comp_thread_count = 2,
+		.jobs = jobs,
+	};
+	fs_t* fs = fs_create_ex(&fs_info);
 	wm_window_t* window = wm_create(heap);
-	render_t* render = render_create(heap, window);
+	render_t* render = render_create(render_heap, window);
 
 	// Init, fill, and load audio; start playing music
 	audio_t* audio = audio_init(heap, window);
@@ -44,6 +90,9 @@ int main(int argc, const char* argv[])
 
 	wm_destroy(window);
 	fs_destroy(fs);
+	job_system_destroy(jobs);
+	heap_destroy(render_heap);
+	heap_destroy(fs_heap);
 	heap_destroy(heap);
 
 	return 0;
@@ -0,0 +1,23 @@
+#pragma once
+
+// MSVC extensions used throughout the engine, for other compilers.
+// Force-included by the Makefile for non-Windows builds; MSVC builds never
+// see this file.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if !defined(_MSC_VER)
+
+// Format string annotation for MSVC code analysis.
+#define _Printf_format_string_
+
+#define __max(a, b) (((a) > (b)) ? (a) : (b))
+#define __min(a, b) (((a) < (b)) ? (a) : (b))
+#define _countof(array) (sizeof(array) / sizeof((array)[0]))
+
+// Truncates instead of invoking the invalid parameter handler.
+#define strcpy_s(dest, size, src) ((void)snprintf((dest), (size), "%s", (src)))
+
+#endif
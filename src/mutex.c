@@ -1,24 +1,142 @@
 #include "mutex.h"
 
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
+#include "atomic.h"
+#include "futex.h"
+#include "thread.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Futex-based mutex, after Drepper's "Futexes Are Tricky". The state is
+// 0 when unlocked, 1 when locked, and 2 when locked with threads parked
+// on it. Locking and unlocking without contention is one atomic each;
+// only parking and waking make system calls.
+//
+// A contended lock spins before it parks. The spin limit adapts: it
+// follows how long recent locks spun before getting the mutex, and shrinks
+// when spinning did not get it at all, so a mutex held for long stretches
+// stops wasting its waiters' time.
+
+enum
+{
+	k_mutex_unlocked = 0,
+	k_mutex_locked = 1,
+	k_mutex_contended = 2,
+	// Most spins before parking, whatever the history.
+	k_mutex_max_spin_count = 256,
+};
+
+typedef struct mutex_t
+{
+	int state;
+	// Thread holding the lock, or zero.
+	void* owner;
+	// Times the owner has locked it.
+	int depth;
+	// Running average of the spins recent contended locks took, counting
+	// a lock that had to park as zero. Written by owners only.
+	int spin_estimate;
+} mutex_t;
 
 mutex_t* mutex_create()
 {
-	return (mutex_t*)CreateMutex(NULL, FALSE, NULL);
+	mutex_t* mutex = malloc(sizeof(mutex_t));
+	mutex->state = k_mutex_unlocked;
+	mutex->owner = NULL;
+	mutex->depth = 0;
+	mutex->spin_estimate = 0;
+	return mutex;
 }
 
 void mutex_destroy(mutex_t* mutex)
 {
-	CloseHandle(mutex);
+	free(mutex);
+}
+
+static bool mutex_lock_recursive(mutex_t* mutex, uintptr_t thread_id)
+{
+	// Only this thread can have stored its own id.
+	if ((uintptr_t)atomic_load_pointer_explicit(&mutex->owner, k_atomic_order_relaxed) == thread_id)
+	{
+		mutex->depth++;
+		return true;
+	}
+	return false;
+}
+
+static void mutex_set_owner(mutex_t* mutex, uintptr_t thread_id)
+{
+	atomic_store_pointer_explicit(&mutex->owner, (void*)thread_id, k_atomic_order_relaxed);
+	mutex->depth = 1;
 }
 
 void mutex_lock(mutex_t* mutex)
 {
-	WaitForSingleObject(mutex, INFINITE);
+	uintptr_t thread_id = thread_get_self();
+	if (mutex_lock_recursive(mutex, thread_id))
+	{
+		return;
+	}
+
+	int state = atomic_compare_and_exchange_explicit(&mutex->state, k_mutex_unlocked, k_mutex_locked, k_atomic_order_acquire);
+	if (state != k_mutex_unlocked)
+	{
+		// Spin up to twice the recent average, then park.
+		int spin_limit = __min(mutex->spin_estimate * 2 + 16, k_mutex_max_spin_count);
+		int spin = 0;
+		for (; spin < spin_limit; ++spin)
+		{
+			atomic_pause();
+			if (atomic_load_explicit(&mutex->state, k_atomic_order_relaxed) == k_mutex_unlocked)
+			{
+				state = atomic_compare_and_exchange_explicit(&mutex->state, k_mutex_unlocked, k_mutex_locked, k_atomic_order_acquire);
+				if (state == k_mutex_unlocked)
+				{
+					break;
+				}
+			}
+		}
+
+		if (state != k_mutex_unlocked)
+		{
+			spin = 0;
+			// Mark the mutex contended, so the unlock knows to wake us.
+			state = atomic_exchange_explicit(&mutex->state, k_mutex_contended, k_atomic_order_acquire);
+			while (state != k_mutex_unlocked)
+			{
+				futex_wait(&mutex->state, k_mutex_contended);
+				state = atomic_exchange_explicit(&mutex->state, k_mutex_contended, k_atomic_order_acquire);
+			}
+		}
+		mutex->spin_estimate += (spin - mutex->spin_estimate) / 8;
+	}
+	mutex_set_owner(mutex, thread_id);
+}
+
+bool mutex_try_lock(mutex_t* mutex)
+{
+	uintptr_t thread_id = thread_get_self();
+	if (mutex_lock_recursive(mutex, thread_id))
+	{
+		return true;
+	}
+	if (atomic_compare_and_exchange_explicit(&mutex->state, k_mutex_unlocked, k_mutex_locked, k_atomic_order_acquire) != k_mutex_unlocked)
+	{
+		return false;
+	}
+	mutex_set_owner(mutex, thread_id);
+	return true;
 }
 
 void mutex_unlock(mutex_t* mutex)
 {
-	ReleaseMutex(mutex);
+	if (--mutex->depth > 0)
+	{
+		return;
+	}
+	atomic_store_pointer_explicit(&mutex->owner, NULL, k_atomic_order_relaxed);
+	if (atomic_exchange_explicit(&mutex->state, k_mutex_unlocked, k_atomic_order_release) == k_mutex_contended)
+	{
+		futex_wake_one(&mutex->state);
+	}
 }
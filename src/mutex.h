@@ -1,6 +1,14 @@
 #pragma once
 
+#include <stdbool.h>
+
 // Recursive mutex thread synchronization
+//
+// Built on futex: locking and unlocking stay in user space unless threads
+// contend, and a contended lock spins briefly before it sleeps.
+//
+// The owner is a thread. A job must not hold a mutex across job_wait or
+// fs_work_wait, since it may resume on another thread.
 
 // Handle to a mutex.
 typedef struct mutex_t mutex_t;
@@ -16,5 +24,9 @@ void mutex_destroy(mutex_t* mutex);
 // multiple times.
 void mutex_lock(mutex_t* mutex);
 
+// Locks a mutex only if no other thread holds it. Never blocks.
+// Returns true if the mutex was locked; it must then be unlocked.
+bool mutex_try_lock(mutex_t* mutex);
+
 // Unlocks a mutex.
 void mutex_unlock(mutex_t* mutex);
@@ -2,8 +2,9 @@
 
 #include "debug.h"
 #include "heap.h"
-#include "mutex.h"
-#include "queue.h"
+#include "heap_pool.h"
+#include "rwlock.h"
+#include "spsc_queue.h"
 #include "thread.h"
 #include "timer.h"
 
@@ -22,6 +23,7 @@ enum
 	k_max_entity_types = 32,
 	k_max_snapshots = 256,
 	k_max_entities = 32,
+	k_packets_per_slab = 16,
 };
 
 typedef struct entity_type_t
@@ -77,8 +79,8 @@ typedef struct connection_t
 
 	thread_t* send_thread;
 
-	queue_t* send_queue;
-	queue_t* recv_queue;
+	spsc_queue_t* send_queue;
+	spsc_queue_t* recv_queue;
 
 	uint32_t last_recv_ms;
 
@@ -90,12 +92,17 @@ typedef struct net_t
 	heap_t* heap;
 	ecs_t* ecs;
 
+	// Packets are allocated on one thread and freed on another.
+	heap_pool_t* packet_pool;
+
 	int sequence;
 
 	SOCKET sock;
 	thread_t* recv_thread;
 
-	mutex_t* connections_mutex;
+	// Read for every received packet; written only when connections come
+	// and go.
+	rwlock_t* connections_lock;
 	connection_t connections[3];
 
 	entity_type_t entity_types[k_max_entity_types];
@@ -117,12 +124,13 @@ net_t* net_create(heap_t* heap, ecs_t* ecs)
 	memset(net, 0, sizeof(net_t));
 	net->heap = heap;
 	net->ecs = ecs;
+	net->packet_pool = heap_pool_create(heap, sizeof(packet_t), 8, k_packets_per_slab);
 
 	WSADATA data;
 	WSAStartup(MAKEWORD(2, 2), &data);
 
 	net->sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	net->connections_mutex = mutex_create();
+	net->connections_lock = rwlock_create();
 
 	struct sockaddr_in address;
 	address.sin_family = AF_INET;
@@ -134,7 +142,8 @@ net_t* net_create(heap_t* heap, ecs_t* ecs)
 	getsockname(net->sock, (struct sockaddr*)&address, &address_len);
 	debug_print(k_print_info, "Net bound port %d\n", ntohs(address.sin_port));
 
-	net->recv_thread = thread_create(recv_thread_func, net);
+	thread_info_t recv_thread_info = { .function = recv_thread_func, .data = net, .name = "net recv" };
+	net->recv_thread = thread_create_ex(&recv_thread_info);
 
 	return net;
 }
@@ -145,7 +154,8 @@ void net_destroy(net_t* net)
 	closesocket(net->sock);
 	thread_destroy(net->recv_thread);
 	WSACleanup();
-	mutex_destroy(net->connections_mutex);
+	rwlock_destroy(net->connections_lock);
+	heap_pool_destroy(net->packet_pool);
 	heap_free(net->heap, net);
 }
 
@@ -172,22 +182,22 @@ void net_connect(net_t* net, const net_address_t* address)
 
 void net_disconnect_all(net_t* net)
 {
-	mutex_lock(net->connections_mutex);
+	rwlock_write_lock(net->connections_lock);
 
 	for (int i = 0; i < _countof(net->connections); ++i)
 	{
 		connection_t* c = &net->connections[i];
 		if (c->address.port)
 		{
-			queue_push(c->send_queue, NULL);
+			spsc_queue_push(c->send_queue, NULL);
 			thread_destroy(c->send_thread);
-			queue_destroy(c->send_queue);
-			queue_destroy(c->recv_queue);
+			spsc_queue_destroy(c->send_queue);
+			spsc_queue_destroy(c->recv_queue);
 		}
 	}
 	memset(net->connections, 0, sizeof(net->connections));
 
-	mutex_unlock(net->connections_mutex);
+	rwlock_write_unlock(net->connections_lock);
 }
 
 void net_state_register_entity_type(net_t* net, int type, uint64_t component_mask, uint64_t replicated_component_mask, net_configure_entity_callback_t configure_callback, void* configure_callback_data)
@@ -283,7 +293,7 @@ static int send_thread_func(void* user)
 
 	while (true)
 	{
-		packet_t* packet = queue_pop(connection->send_queue);
+		packet_t* packet = spsc_queue_pop(connection->send_queue);
 		if (!packet)
 		{
 			break;
@@ -293,7 +303,7 @@ static int send_thread_func(void* user)
 			packet->data, packet->size, 0,
 			(struct sockaddr*)&address, sizeof(address));
 
-		heap_free(connection->net->heap, packet);
+		heap_pool_free(connection->net->packet_pool, packet);
 
 		if (bytes <= 0)
 		{
@@ -304,21 +314,36 @@ static int send_thread_func(void* user)
 	return 0;
 }
 
-static connection_t* find_or_create_connection(net_t* net, const net_address_t* address)
+// Caller holds connections_lock.
+static connection_t* find_connection(net_t* net, const net_address_t* address)
 {
-	connection_t* result = NULL;
-
-	mutex_lock(net->connections_mutex);
-
 	for (int i = 0; i < _countof(net->connections); ++i)
 	{
 		connection_t* c = &net->connections[i];
 		if (memcmp(&c->address, address, sizeof(net_address_t)) == 0)
 		{
-			result = c;
-			break;
+			return c;
 		}
 	}
+	return NULL;
+}
+
+static connection_t* find_or_create_connection(net_t* net, const net_address_t* address)
+{
+	// Nearly every packet comes from a known connection, so look under the
+	// read lock first and take the write lock only to add one.
+	rwlock_read_lock(net->connections_lock);
+	connection_t* result = find_connection(net, address);
+	rwlock_read_unlock(net->connections_lock);
+	if (result)
+	{
+		return result;
+	}
+
+	rwlock_write_lock(net->connections_lock);
+
+	// Another thread may have added it meanwhile.
+	result = find_connection(net, address);
 	if (!result)
 	{
 		for (int i = 0; i < _countof(net->connections); ++i)
@@ -331,9 +356,10 @@ static connection_t* find_or_create_connection(net_t* net, const net_address_t*
 				c->incoming_sequence = -1;
 				c->ack_sequence = -1;
 				c->last_recv_ms = timer_ticks_to_ms(timer_get_ticks());
-				c->send_queue = queue_create(net->heap, 3);
-				c->recv_queue = queue_create(net->heap, 3);
-				c->send_thread = thread_create(send_thread_func, c);
+				c->send_queue = spsc_queue_create(net->heap, 3);
+				c->recv_queue = spsc_queue_create(net->heap, 3);
+				thread_info_t send_thread_info = { .function = send_thread_func, .data = c, .name = "net send" };
+				c->send_thread = thread_create_ex(&send_thread_info);
 
 				result = c;
 				break;
@@ -341,7 +367,7 @@ static connection_t* find_or_create_connection(net_t* net, const net_address_t*
 		}
 	}
 
-	mutex_unlock(net->connections_mutex);
+	rwlock_write_unlock(net->connections_lock);
 
 	return result;
 }
@@ -352,7 +378,7 @@ static int recv_thread_func(void* user)
 
 	while (true)
 	{
-		packet_t* packet = heap_alloc(net->heap, sizeof(packet_t), 8);
+		packet_t* packet = heap_pool_alloc(net->packet_pool);
 
 		struct sockaddr_in address;
 		int address_len = sizeof(address);
@@ -361,7 +387,7 @@ static int recv_thread_func(void* user)
 			(struct sockaddr*)&address, &address_len);
 		if (bytes <= 0)
 		{
-			heap_free(net->heap, packet);
+			heap_pool_free(net->packet_pool, packet);
 			break;
 		}
 
@@ -378,12 +404,12 @@ static int recv_thread_func(void* user)
 		if (!connection)
 		{
 			debug_print(k_print_info, "Too many connections!\n");
-			heap_free(net->heap, packet);
+			heap_pool_free(net->packet_pool, packet);
 			continue;
 		}
 		connection->last_recv_ms = timer_ticks_to_ms(timer_get_ticks());
 
-		queue_try_push(connection->recv_queue, packet);
+		spsc_queue_try_push(connection->recv_queue, packet);
 	}
 
 	return 0;
@@ -391,9 +417,23 @@ static int recv_thread_func(void* user)
 
 static void timeout_old_connections(net_t* net)
 {
-	mutex_lock(net->connections_mutex);
-
+	// Runs every update but rarely finds anything; look under the read
+	// lock, so packets keep arriving meanwhile.
 	uint32_t now = timer_ticks_to_ms(timer_get_ticks());
+	bool expired = false;
+	rwlock_read_lock(net->connections_lock);
+	for (int i = 0; i < _countof(net->connections); ++i)
+	{
+		connection_t* c = &net->connections[i];
+		expired = expired || (c->address.port && c->last_recv_ms + k_timeout_ms < now);
+	}
+	rwlock_read_unlock(net->connections_lock);
+	if (!expired)
+	{
+		return;
+	}
+
+	rwlock_write_lock(net->connections_lock);
 	for (int i = 0; i < _countof(net->connections); ++i)
 	{
 		connection_t* c = &net->connections[i];
@@ -401,15 +441,15 @@ static void timeout_old_connections(net_t* net)
 		{
 			debug_print(k_print_info, "Disconnecting old connection.\n");
 
-			queue_push(c->send_queue, NULL);
+			spsc_queue_push(c->send_queue, NULL);
 			thread_destroy(c->send_thread);
-			queue_destroy(c->send_queue);
-			queue_destroy(c->recv_queue);
+			spsc_queue_destroy(c->send_queue);
+			spsc_queue_destroy(c->recv_queue);
 			memset(c, 0, sizeof(*c));
 		}
 	}
 
-	mutex_unlock(net->connections_mutex);
+	rwlock_write_unlock(net->connections_lock);
 }
 
 static void snapshot_entities(net_t* net)
@@ -507,7 +547,7 @@ static void packet_send(connection_t* connection)
 {
 	net_t* net = connection->net;
 
-	packet_t* packet = heap_alloc(net->heap, sizeof(packet_t), 8);
+	packet_t* packet = heap_pool_alloc(net->packet_pool);
 
 	packet_header_t header =
 	{
@@ -519,7 +559,7 @@ static void packet_send(connection_t* connection)
 	packet->size = sizeof(header);
 	packet->size += (int)packet_add_entities(connection, &packet->data[packet->size], sizeof(packet->data) - packet->size);
 
-	queue_push(connection->send_queue, packet);
+	spsc_queue_push(connection->send_queue, packet);
 }
 
 static void packet_read_entities(connection_t* connection, char* packet, size_t packet_size)
@@ -600,7 +640,7 @@ static void packet_recv(connection_t* connection)
 
 	while (true)
 	{
-		packet_t* packet = queue_try_pop(connection->recv_queue);
+		packet_t* packet = spsc_queue_try_pop(connection->recv_queue);
 		if (!packet || !packet->size)
 		{
 			break;
@@ -610,6 +650,7 @@ static void packet_recv(connection_t* connection)
 		memcpy(&header, packet->data, sizeof(header));
 		if (header.sequence <= connection->incoming_sequence)
 		{
+			heap_pool_free(net->packet_pool, packet);
 			continue;
 		}
 
@@ -618,6 +659,6 @@ static void packet_recv(connection_t* connection)
 
 		packet_read_entities(connection, &packet->data[sizeof(header)], packet->size - sizeof(header));
 
-		heap_free(net->heap, packet);
+		heap_pool_free(net->packet_pool, packet);
 	}
 }
@@ -1,86 +1,294 @@
+#include "queue.h"
+
 #include "atomic.h"
 #include "heap.h"
 #include "semaphore.h"
-#include <stdbool.h>
+
+#include <limits.h>
+#include <stdint.h>
+
+// Bounded MPMC ring after Dmitry Vyukov's design.
+// Every slot carries a sequence number saying whose turn it is:
+//   sequence == position      the slot is free for the push at position
+//   sequence == position + 1  the slot holds the item for the pop at position
+// Pushes and pops claim positions with a compare-and-exchange on the tail
+// and head, so neither enters the kernel unless the queue is full or empty.
+
+enum
+{
+	k_queue_cache_line_size = 64,
+	// Failed attempts before a blocking call sleeps on its semaphore.
+	k_queue_spin_count = 64,
+};
+
+typedef struct queue_slot_t
+{
+	int64_t sequence;
+	void* item;
+} queue_slot_t;
 
 typedef struct queue_t
 {
+	// Written by producers only.
+	int64_t tail_index;
+	char tail_pad[k_queue_cache_line_size - sizeof(int64_t)];
+
+	// Written by consumers only.
+	int64_t head_index;
+	char head_pad[k_queue_cache_line_size - sizeof(int64_t)];
+
+	// Threads sleeping on a full or empty queue. A thread that makes progress
+	// claims one waiter and releases the matching semaphore once.
+	int push_waiters;
+	int pop_waiters;
+	semaphore_t* space_available;
+	semaphore_t* items_available;
+
 	heap_t* heap;
-	semaphore_t* used_items;
-	semaphore_t* free_items;
-	void** items;
+	queue_slot_t* slots;
 	int capacity;
-	int head_index;
-	int tail_index;
 } queue_t;
 
 queue_t* queue_create(heap_t* heap, int capacity)
 {
-	queue_t* queue = heap_alloc(heap, sizeof(queue_t), 8);
-	queue->items = heap_alloc(heap, sizeof(void*) * capacity, 8);
-	queue->used_items = semaphore_create(0, capacity);
-	queue->free_items = semaphore_create(capacity, capacity);
+	queue_t* queue = heap_alloc(heap, sizeof(queue_t), k_queue_cache_line_size);
+	queue->slots = heap_alloc(heap, sizeof(queue_slot_t) * capacity, 8);
+	for (int i = 0; i < capacity; ++i)
+	{
+		queue->slots[i].sequence = i;
+		queue->slots[i].item = NULL;
+	}
+	queue->space_available = semaphore_create(0, INT_MAX);
+	queue->items_available = semaphore_create(0, INT_MAX);
 	queue->heap = heap;
 	queue->capacity = capacity;
 	queue->head_index = 0;
 	queue->tail_index = 0;
+	queue->push_waiters = 0;
+	queue->pop_waiters = 0;
 	return queue;
 }
 
 void queue_destroy(queue_t* queue)
 {
-	semaphore_destroy(queue->used_items);
-	semaphore_destroy(queue->free_items);
-	heap_free(queue->heap, queue->items);
+	semaphore_destroy(queue->space_available);
+	semaphore_destroy(queue->items_available);
+	heap_free(queue->heap, queue->slots);
 	heap_free(queue->heap, queue);
 }
 
+// Take one registered waiter off the count, if there is any.
+static bool queue_claim_waiter(int* waiters)
+{
+	int count = atomic_load(waiters);
+	while (count > 0)
+	{
+		int old_count = atomic_compare_and_exchange(waiters, count, count - 1);
+		if (old_count == count)
+		{
+			return true;
+		}
+		count = old_count;
+	}
+	return false;
+}
+
+// Wake up to count registered waiters.
+static void queue_wake(int* waiters, semaphore_t* semaphore, int count)
+{
+	for (int i = 0; i < count && queue_claim_waiter(waiters); ++i)
+	{
+		semaphore_release(semaphore);
+	}
+}
+
+// A registered waiter succeeded without sleeping.
+// If another thread already claimed it, absorb the release that is coming.
+static void queue_cancel_wait(int* waiters, semaphore_t* semaphore)
+{
+	if (!queue_claim_waiter(waiters))
+	{
+		semaphore_acquire(semaphore);
+	}
+}
+
+// Push as many of the items as there are free slots, claiming the whole
+// run of slots with a single compare-and-exchange.
+// Returns the number of items pushed; zero if the queue is full.
+static int queue_try_push_some(queue_t* queue, void* const* items, int count)
+{
+	int64_t position = atomic_load64(&queue->tail_index);
+	while (true)
+	{
+		int64_t difference = atomic_load64(&queue->slots[position % queue->capacity].sequence) - position;
+		if (difference == 0)
+		{
+			int claim = 1;
+			while (claim < count && atomic_load64(&queue->slots[(position + claim) % queue->capacity].sequence) == position + claim)
+			{
+				claim++;
+			}
+			int64_t old_position = atomic_compare_and_exchange64(&queue->tail_index, position, position + claim);
+			if (old_position == position)
+			{
+				for (int i = 0; i < claim; ++i)
+				{
+					queue_slot_t* slot = &queue->slots[(position + i) % queue->capacity];
+					slot->item = items[i];
+					atomic_store64_explicit(&slot->sequence, position + i + 1, k_atomic_order_release);
+				}
+				// One full barrier for the batch, between the publishing stores
+				// and the check for sleeping consumers.
+				atomic_fence(k_atomic_order_seq_cst);
+				queue_wake(&queue->pop_waiters, queue->items_available, claim);
+				return claim;
+			}
+			position = old_position;
+		}
+		else if (difference < 0)
+		{
+			// The slot still holds the item from the previous lap: full.
+			return 0;
+		}
+		else
+		{
+			position = atomic_load64(&queue->tail_index);
+		}
+	}
+}
+
+// Pop up to max_count items that have been published, claiming them with a
+// single compare-and-exchange.
+// Returns the number of items popped; zero if the queue is empty.
+static int queue_try_pop_some(queue_t* queue, void** items, int max_count)
+{
+	int64_t position = atomic_load64(&queue->head_index);
+	while (true)
+	{
+		int64_t difference = atomic_load64(&queue->slots[position % queue->capacity].sequence) - (position + 1);
+		if (difference == 0)
+		{
+			int claim = 1;
+			while (claim < max_count && atomic_load64(&queue->slots[(position + claim) % queue->capacity].sequence) == position + claim + 1)
+			{
+				claim++;
+			}
+			int64_t old_position = atomic_compare_and_exchange64(&queue->head_index, position, position + claim);
+			if (old_position == position)
+			{
+				for (int i = 0; i < claim; ++i)
+				{
+					queue_slot_t* slot = &queue->slots[(position + i) % queue->capacity];
+					items[i] = slot->item;
+					atomic_store64_explicit(&slot->sequence, position + i + queue->capacity, k_atomic_order_release);
+				}
+				atomic_fence(k_atomic_order_seq_cst);
+				queue_wake(&queue->push_waiters, queue->space_available, claim);
+				return claim;
+			}
+			position = old_position;
+		}
+		else if (difference < 0)
+		{
+			// Nothing has been published at this position yet: empty.
+			return 0;
+		}
+		else
+		{
+			position = atomic_load64(&queue->head_index);
+		}
+	}
+}
+
+void queue_push_n(queue_t* queue, void* const* items, int count)
+{
+	int spin = 0;
+	while (count > 0)
+	{
+		int pushed = queue_try_push_some(queue, items, count);
+		if (pushed == 0 && spin++ >= k_queue_spin_count)
+		{
+			// Register before the final check, so a pop that frees a slot
+			// after it is guaranteed to see us.
+			atomic_increment(&queue->push_waiters);
+			pushed = queue_try_push_some(queue, items, count);
+			if (pushed > 0)
+			{
+				queue_cancel_wait(&queue->push_waiters, queue->space_available);
+			}
+			else
+			{
+				semaphore_acquire(queue->space_available);
+			}
+		}
+		else if (pushed == 0)
+		{
+			atomic_pause();
+		}
+		items += pushed;
+		count -= pushed;
+	}
+}
+
+int queue_pop_n(queue_t* queue, void** items, int max_count)
+{
+	int popped = 0;
+	for (int spin = 0; (popped = queue_try_pop_some(queue, items, max_count)) == 0; ++spin)
+	{
+		if (spin < k_queue_spin_count)
+		{
+			atomic_pause();
+			continue;
+		}
+		atomic_increment(&queue->pop_waiters);
+		popped = queue_try_pop_some(queue, items, max_count);
+		if (popped > 0)
+		{
+			queue_cancel_wait(&queue->pop_waiters, queue->items_available);
+			break;
+		}
+		semaphore_acquire(queue->items_available);
+	}
+	return popped;
+}
+
 void queue_push(queue_t* queue, void* item)
 {
-	semaphore_acquire(queue->free_items);
-	int index = atomic_increment(&queue->tail_index) % queue->capacity;
-	queue->items[index] = item;
-	semaphore_release(queue->used_items);
+	queue_push_n(queue, &item, 1);
 }
 
 void* queue_pop(queue_t* queue)
 {
-	semaphore_acquire(queue->used_items);
-	int index = atomic_increment(&queue->head_index) % queue->capacity;
-	void* item = queue->items[index];
-	semaphore_release(queue->free_items);
+	void* item = NULL;
+	queue_pop_n(queue, &item, 1);
 	return item;
 }
 
 void* dequeue(queue_t* queue)
 {
-	semaphore_acquire(queue->used_items);
-	int index = (atomic_decrement(&queue->tail_index)-1) % queue->capacity;
-	void* item = queue->items[index];
-	semaphore_release(queue->free_items);
+	int64_t position = queue->tail_index - 1;
+	if (position < queue->head_index)
+	{
+		return NULL;
+	}
+	// With no other thread in the queue, hand the slot back to the push
+	// that claimed it.
+	queue_slot_t* slot = &queue->slots[position % queue->capacity];
+	void* item = slot->item;
+	queue->tail_index = position;
+	atomic_store64(&slot->sequence, position);
+	queue_wake(&queue->push_waiters, queue->space_available, 1);
 	return item;
 }
 
 bool queue_try_push(queue_t* queue, void* item)
 {
-	if (semaphore_try_acquire(queue->free_items))
-	{
-		int index = atomic_increment(&queue->tail_index) % queue->capacity;
-		queue->items[index] = item;
-		semaphore_release(queue->used_items);
-		return true;
-	}
-	return false;
+	return queue_try_push_some(queue, &item, 1) == 1;
 }
 
 void* queue_try_pop(queue_t* queue)
 {
-	if (semaphore_try_acquire(queue->used_items))
-	{
-		int index = atomic_increment(&queue->head_index) % queue->capacity;
-		void* item = queue->items[index];
-		semaphore_release(queue->free_items);
-		return item;
-	}
-	return NULL;
+	void* item = NULL;
+	queue_try_pop_some(queue, &item, 1);
+	return item;
 }
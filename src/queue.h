@@ -1,9 +1,10 @@
 #pragma once
-#include <stdbool.h>
 
 #include <stdbool.h>
 
 // Thread-safe Queue container
+// A bounded lock-free ring: pushes and pops only block in the kernel when
+// the queue is full or empty.
 
 // Handle to a thread-safe queue.
 typedef struct queue_t queue_t;
@@ -26,7 +27,23 @@ void queue_push(queue_t* queue, void* item);
 // Safe for multiple threads to pop at the same time.
 void* queue_pop(queue_t* queue);
 
-// Remove an item from the queue (FILO order).
+// Push count items onto a queue, in order.
+// Claims runs of free slots with one synchronization instead of one per
+// item. If the queue fills up, blocks until all items are pushed.
+// Safe for multiple threads to push at the same time, though items from
+// different threads may interleave.
+void queue_push_n(queue_t* queue, void* const* items, int count);
+
+// Pop up to max_count items off a queue (FIFO order) into items.
+// Takes everything available, up to max_count, with one synchronization.
+// If the queue is empty, blocks until at least one item is available.
+// Returns the number of items popped.
+// Safe for multiple threads to pop at the same time.
+int queue_pop_n(queue_t* queue, void** items, int max_count);
+
+// Remove the most recently pushed item from the queue (FILO order).
+// If the queue is empty, returns NULL.
+// Not safe while other threads push or pop; callers must serialize.
 void* dequeue(queue_t* queue);
 
 // Push an item onto a queue if space is available.
@@ -0,0 +1,207 @@
+#include "queue_bench.h"
+
+#include "debug.h"
+#include "event.h"
+#include "heap.h"
+#include "queue.h"
+#include "spsc_queue.h"
+#include "thread.h"
+#include "timer.h"
+
+#include <stdint.h>
+#include <string.h>
+
+enum
+{
+	k_queue_bench_items = 2000000,
+	k_queue_bench_max_threads = 16,
+	k_queue_bench_max_batch = 64,
+};
+
+typedef struct queue_bench_config_t
+{
+	int producers;
+	int consumers;
+	int capacity;
+	// Use spsc_queue_t instead of queue_t; one producer and one consumer.
+	bool spsc;
+	// Items moved per push_n/pop_n call; zero for single item calls.
+	int batch;
+} queue_bench_config_t;
+
+static const queue_bench_config_t k_queue_bench_configs[] =
+{
+	{ 1, 1, 3 },
+	{ 1, 1, 3, true },
+	{ 1, 1, 1024 },
+	{ 1, 1, 1024, true },
+	{ 2, 2, 1024 },
+	{ 4, 4, 1024 },
+	{ 1, 4, 1024 },
+	{ 4, 1, 1024 },
+	{ 4, 4, 16 },
+	{ 1, 1, 1024, false, 32 },
+	{ 1, 1, 1024, true, 32 },
+	{ 4, 4, 1024, false, 32 },
+};
+
+typedef struct queue_bench_worker_t
+{
+	queue_t* queue;
+	spsc_queue_t* spsc_queue;
+	event_t* start;
+	// Producers push first..first+count-1; consumers pop count items.
+	uint64_t first;
+	int count;
+	int batch;
+	uint64_t checksum;
+} queue_bench_worker_t;
+
+static int producer_func(void* user)
+{
+	queue_bench_worker_t* worker = user;
+	void* items[k_queue_bench_max_batch];
+	int batch = __max(worker->batch, 1);
+	event_wait(worker->start);
+	for (int i = 0; i < worker->count; i += batch)
+	{
+		int count = __min(batch, worker->count - i);
+		for (int j = 0; j < count; ++j)
+		{
+			// Offset by one so no item is NULL.
+			items[j] = (void*)(uintptr_t)(worker->first + i + j + 1);
+		}
+		if (worker->spsc_queue)
+		{
+			spsc_queue_push_n(worker->spsc_queue, items, count);
+		}
+		else if (worker->batch)
+		{
+			queue_push_n(worker->queue, items, count);
+		}
+		else
+		{
+			queue_push(worker->queue, items[0]);
+		}
+	}
+	return 0;
+}
+
+static int consumer_func(void* user)
+{
+	queue_bench_worker_t* worker = user;
+	void* items[k_queue_bench_max_batch];
+	int batch = __max(worker->batch, 1);
+	event_wait(worker->start);
+	uint64_t checksum = 0;
+	for (int i = 0; i < worker->count; )
+	{
+		// Never take more than this consumer's share.
+		int max_count = __min(batch, worker->count - i);
+		int count;
+		if (worker->spsc_queue)
+		{
+			count = spsc_queue_pop_n(worker->spsc_queue, items, max_count);
+		}
+		else if (worker->batch)
+		{
+			count = queue_pop_n(worker->queue, items, max_count);
+		}
+		else
+		{
+			items[0] = queue_pop(worker->queue);
+			count = 1;
+		}
+		for (int j = 0; j < count; ++j)
+		{
+			checksum += (uintptr_t)items[j];
+		}
+		i += count;
+	}
+	worker->checksum = checksum;
+	return 0;
+}
+
+static bool queue_bench_run(heap_t* heap, const queue_bench_config_t* config, int items)
+{
+	int thread_count = config->producers + config->consumers;
+	queue_t* queue = config->spsc ? NULL : queue_create(heap, config->capacity);
+	spsc_queue_t* spsc_queue = config->spsc ? spsc_queue_create(heap, config->capacity) : NULL;
+	event_t* start = event_create();
+	queue_bench_worker_t workers[k_queue_bench_max_threads];
+	thread_t* threads[k_queue_bench_max_threads];
+
+	int per_producer = items / config->producers;
+	int total = per_producer * config->producers;
+	for (int i = 0; i < thread_count; ++i)
+	{
+		bool producer = i < config->producers;
+		int consumer_index = i - config->producers;
+		workers[i] = (queue_bench_worker_t)
+		{
+			.queue = queue,
+			.spsc_queue = spsc_queue,
+			.start = start,
+			.batch = config->batch,
+			.first = producer ? (uint64_t)per_producer * i : 0,
+			// The first consumer takes the remainder.
+			.count = producer ? per_producer :
+				total / config->consumers + (consumer_index == 0 ? total % config->consumers : 0),
+		};
+		threads[i] = thread_create(producer ? producer_func : consumer_func, &workers[i]);
+	}
+
+	uint64_t t0 = timer_get_ticks();
+	event_signal(start);
+	uint64_t checksum = 0;
+	for (int i = 0; i < thread_count; ++i)
+	{
+		thread_destroy(threads[i]);
+		checksum += workers[i].checksum;
+	}
+	uint64_t us = __max(timer_ticks_to_us(timer_get_ticks() - t0), 1);
+
+	event_destroy(start);
+	if (queue)
+	{
+		queue_destroy(queue);
+	}
+	if (spsc_queue)
+	{
+		spsc_queue_destroy(spsc_queue);
+	}
+
+	// Every value 1..total exactly once.
+	uint64_t expected = (uint64_t)total * (total + 1) / 2;
+	debug_print(k_print_warning, "%-5s producers=%d consumers=%d capacity=%-5d batch=%-2d items/s=%-10llu %s\n",
+		config->spsc ? "spsc" : "queue", config->producers, config->consumers, config->capacity, __max(config->batch, 1),
+		(unsigned long long)((uint64_t)total * 1000000 / us),
+		checksum == expected ? "ok" : "CHECKSUM MISMATCH");
+	return checksum == expected;
+}
+
+int queue_bench_main(int argc, const char** argv)
+{
+	int items = k_queue_bench_items;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--quick") == 0)
+		{
+			items /= 10;
+		}
+		else
+		{
+			debug_print(k_print_error, "Unknown option: %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	heap_t* heap = heap_create(1024 * 1024);
+	bool ok = true;
+	for (int i = 0; i < _countof(k_queue_bench_configs); ++i)
+	{
+		ok = queue_bench_run(heap, &k_queue_bench_configs[i], items) && ok;
+	}
+	heap_destroy(heap);
+	return ok ? 0 : 1;
+}
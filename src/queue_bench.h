@@ -0,0 +1,14 @@
+#pragma once
+
+// Queue throughput benchmarks.
+//
+// Producer threads push integers through a queue_t to consumer threads, for
+// several producer/consumer counts and queue capacities. One-to-one runs
+// are repeated with spsc_queue_t, and some runs move items in batches. A small capacity
+// exercises the blocking paths; a large one the lock-free fast path. Each
+// run reports items per second and checks that every item arrived once.
+
+// Run the benchmark suite. Accepts these options:
+//   --quick  a tenth of the items, for smoke testing
+// Returns zero on success, nonzero if an item was lost or duplicated.
+int queue_bench_main(int argc, const char** argv);
@@ -0,0 +1,11 @@
+#include "queue_bench.h"
+#include "timer.h"
+
+// Standalone entry point for the queue benchmarks; see the Makefile.
+// The game runs the same suite with: ga2022 --queue-bench [options]
+
+int main(int argc, const char* argv[])
+{
+	timer_startup();
+	return queue_bench_main(argc, argv);
+}
@@ -3,7 +3,8 @@
 #include "ecs.h"
 #include "gpu.h"
 #include "heap.h"
-#include "queue.h"
+#include "heap_frame_arena.h"
+#include "spsc_queue.h"
 #include "thread.h"
 #include "wm.h"
 
@@ -13,6 +14,14 @@
 enum
 {
 	k_render_max_drawables = 512,
+	k_render_arena_block_size = 64 * 1024,
+	k_render_arena_frame_count = 2,
+	// The frame arena bounds how far ahead the game thread runs; the queue
+	// only needs room for a few batches.
+	k_render_queue_capacity = 256,
+	// Commands the game thread collects before handing them over, and the
+	// render thread takes at once.
+	k_render_command_batch = 32,
 };
 
 typedef enum command_type_t
@@ -64,7 +73,11 @@ typedef struct render_t
 	wm_window_t* window;
 	thread_t* thread;
 	gpu_t* gpu;
-	queue_t* queue;
+	spsc_queue_t* queue;
+	heap_frame_arena_t* arena;
+	// Commands pushed by the game thread but not yet handed over.
+	void* pending_commands[k_render_command_batch];
+	int pending_count;
 
 	int frame_counter;
 	int gpu_frame_count;
@@ -82,47 +95,62 @@ static draw_shader_t* create_or_get_shader_for_model_command(render_t* render, m
 static draw_mesh_t* create_or_get_mesh_for_model_command(render_t* render, model_command_t* command);
 static draw_instance_t* create_or_get_instance_for_model_command(render_t* render, model_command_t* command, gpu_shader_t* shader);
 static void destroy_stale_data(render_t* render);
+static void push_command(render_t* render, command_type_t* command, bool flush);
 
 render_t* render_create(heap_t* heap, wm_window_t* window)
 {
 	render_t* render = heap_alloc(heap, sizeof(render_t), 8);
 	render->heap = heap;
 	render->window = window;
-	render->queue = queue_create(heap, 3);
+	render->queue = spsc_queue_create(heap, k_render_queue_capacity);
+	render->pending_count = 0;
+	render->arena = heap_frame_arena_create(heap, k_render_arena_block_size, k_render_arena_frame_count);
 	render->frame_counter = 0;
 	render->instance_count = 0;
 	render->mesh_count = 0;
 	render->shader_count = 0;
-	render->thread = thread_create(render_thread_func, render);
+	// Frames wait on this thread; keep it ahead of background work.
+	thread_info_t thread_info =
+	{
+		.function = render_thread_func,
+		.data = render,
+		.name = "render",
+		.priority = k_thread_priority_high,
+	};
+	render->thread = thread_create_ex(&thread_info);
 	return render;
 }
 
 void render_destroy(render_t* render)
 {
-	queue_push(render->queue, NULL);
+	push_command(render, NULL, true);
 	thread_destroy(render->thread);
-	queue_destroy(render->queue);
+	spsc_queue_destroy(render->queue);
+	heap_frame_arena_destroy(render->arena);
 	heap_free(render->heap, render);
 }
 
 void render_push_model(render_t* render, ecs_entity_ref_t* entity, gpu_mesh_info_t* mesh, gpu_shader_info_t* shader, gpu_uniform_buffer_info_t* uniform)
 {
-	model_command_t* command = heap_alloc(render->heap, sizeof(model_command_t), 8);
+	model_command_t* command = heap_frame_arena_alloc(render->arena, sizeof(model_command_t), 8);
 	command->type = k_command_model;
 	command->entity = *entity;
 	command->mesh = mesh;
 	command->shader = shader;
 	command->uniform_buffer.size = uniform->size;
-	command->uniform_buffer.data = heap_alloc(render->heap, uniform->size, 8);
+	command->uniform_buffer.data = heap_frame_arena_alloc(render->arena, uniform->size, 8);
 	memcpy(command->uniform_buffer.data, uniform->data, uniform->size);
-	queue_push(render->queue, command);
+	push_command(render, &command->type, false);
 }
 
 void render_push_done(render_t* render)
 {
-	frame_done_command_t* command = heap_alloc(render->heap, sizeof(frame_done_command_t), 8);
+	frame_done_command_t* command = heap_frame_arena_alloc(render->arena, sizeof(frame_done_command_t), 8);
 	command->type = k_command_frame_done;
-	queue_push(render->queue, command);
+	push_command(render, &command->type, true);
+
+	// Commands for the next frame go into the other half of the arena.
+	heap_frame_arena_next_frame(render->arena);
 }
 
 static int render_thread_func(void* user)
@@ -137,54 +165,60 @@ static int render_thread_func(void* user)
 	gpu_mesh_t* last_mesh = NULL;
 	int frame_index = 0;
 
-	while (true)
+	void* commands[k_render_command_batch];
+	bool running = true;
+	while (running)
 	{
-		command_type_t* type = queue_pop(render->queue);
-		if (!type)
+		int count = spsc_queue_pop_n(render->queue, commands, _countof(commands));
+		for (int i = 0; i < count; ++i)
 		{
-			break;
-		}
+			command_type_t* type = commands[i];
+			if (!type)
+			{
+				running = false;
+				break;
+			}
 
-		if (!cmdbuf)
-		{
-			cmdbuf = gpu_frame_begin(render->gpu);
-		}
+			if (!cmdbuf)
+			{
+				cmdbuf = gpu_frame_begin(render->gpu);
+			}
 
-		if (*type == k_command_frame_done)
-		{
-			gpu_frame_end(render->gpu);
-			cmdbuf = NULL;
-			last_pipeline = NULL;
-			last_mesh = NULL;
-
-			destroy_stale_data(render);
-			++render->frame_counter;
-			frame_index = render->frame_counter % render->gpu_frame_count;
-		}
-		else if (*type == k_command_model)
-		{
-			model_command_t* command = (model_command_t*)type;
-			draw_shader_t* shader = create_or_get_shader_for_model_command(render, command);
-			draw_mesh_t* mesh = create_or_get_mesh_for_model_command(render, command);
-			draw_instance_t* instance = create_or_get_instance_for_model_command(render, command, shader->shader);
+			if (*type == k_command_frame_done)
+			{
+				gpu_frame_end(render->gpu);
+				cmdbuf = NULL;
+				last_pipeline = NULL;
+				last_mesh = NULL;
 
-			heap_free(render->heap, command->uniform_buffer.data);
+				destroy_stale_data(render);
+				++render->frame_counter;
+				frame_index = render->frame_counter % render->gpu_frame_count;
 
-			if (last_pipeline != shader->pipeline)
-			{
-				gpu_cmd_pipeline_bind(render->gpu, cmdbuf, shader->pipeline);
-				last_pipeline = shader->pipeline;
+				// Every command of this frame has been consumed; recycle its memory.
+				heap_frame_arena_release_frame(render->arena);
 			}
-			if (last_mesh != mesh->mesh)
+			else if (*type == k_command_model)
 			{
-				gpu_cmd_mesh_bind(render->gpu, cmdbuf, mesh->mesh);
-				last_mesh = mesh->mesh;
+				model_command_t* command = (model_command_t*)type;
+				draw_shader_t* shader = create_or_get_shader_for_model_command(render, command);
+				draw_mesh_t* mesh = create_or_get_mesh_for_model_command(render, command);
+				draw_instance_t* instance = create_or_get_instance_for_model_command(render, command, shader->shader);
+
+				if (last_pipeline != shader->pipeline)
+				{
+					gpu_cmd_pipeline_bind(render->gpu, cmdbuf, shader->pipeline);
+					last_pipeline = shader->pipeline;
+				}
+				if (last_mesh != mesh->mesh)
+				{
+					gpu_cmd_mesh_bind(render->gpu, cmdbuf, mesh->mesh);
+					last_mesh = mesh->mesh;
+				}
+				gpu_cmd_descriptor_bind(render->gpu, cmdbuf, instance->descriptors[frame_index]);
+				gpu_cmd_draw(render->gpu, cmdbuf);
 			}
-			gpu_cmd_descriptor_bind(render->gpu, cmdbuf, instance->descriptors[frame_index]);
-			gpu_cmd_draw(render->gpu, cmdbuf);
 		}
-
-		heap_free(render->heap, type);
 	}
 
 	gpu_wait_until_idle(render->gpu);
@@ -197,6 +231,18 @@ static int render_thread_func(void* user)
 	return 0;
 }
 
+// Queue a command for the render thread, in batches.
+// Flushing hands over everything pending, so the render thread can finish the frame.
+static void push_command(render_t* render, command_type_t* command, bool flush)
+{
+	render->pending_commands[render->pending_count++] = command;
+	if (flush || render->pending_count == k_render_command_batch)
+	{
+		spsc_queue_push_n(render->queue, render->pending_commands, render->pending_count);
+		render->pending_count = 0;
+	}
+}
+
 static draw_shader_t* create_or_get_shader_for_model_command(render_t* render, model_command_t* command)
 {
 	draw_shader_t* shader = NULL;
@@ -0,0 +1,201 @@
+#include "rwlock.h"
+
+#include "atomic.h"
+#include "futex.h"
+
+#include <stdlib.h>
+
+// One word holds the whole lock state: the number of readers holding it,
+// a bit for readers asleep, a bit for the writer holding it, and the
+// number of writers waiting. Readers and writers sleep on separate futex
+// words, bumped by whoever may have let them in. Every change that lets
+// a sleeper in bumps its word after the state changes, and sleepers read
+// the word before they check the state, so no wakeup is lost.
+//
+// Waiting threads spin briefly before they sleep, since read-mostly
+// critical sections are usually short.
+
+enum
+{
+	k_rwlock_reader = 1,
+	k_rwlock_reader_mask = 0x7fff,
+	k_rwlock_readers_asleep = 1 << 15,
+	k_rwlock_writer = 1 << 16,
+	k_rwlock_waiting_writer = 1 << 17,
+	k_rwlock_waiting_writer_mask = 0x3fff << 17,
+	k_rwlock_spin_count = 64,
+};
+
+typedef struct rwlock_t
+{
+	int state;
+	// Futex words readers and writers sleep on.
+	int read_epoch;
+	int write_epoch;
+} rwlock_t;
+
+rwlock_t* rwlock_create()
+{
+	rwlock_t* rwlock = malloc(sizeof(rwlock_t));
+	rwlock->state = 0;
+	rwlock->read_epoch = 0;
+	rwlock->write_epoch = 0;
+	return rwlock;
+}
+
+void rwlock_destroy(rwlock_t* rwlock)
+{
+	free(rwlock);
+}
+
+// Readers wait for a writer holding the lock and for writers waiting on it.
+static bool rwlock_readers_blocked(int state)
+{
+	return (state & (k_rwlock_writer | k_rwlock_waiting_writer_mask)) != 0;
+}
+
+static bool rwlock_writers_blocked(int state)
+{
+	return (state & (k_rwlock_writer | k_rwlock_reader_mask)) != 0;
+}
+
+bool rwlock_try_read_lock(rwlock_t* rwlock)
+{
+	int state = atomic_load_explicit(&rwlock->state, k_atomic_order_relaxed);
+	while (!rwlock_readers_blocked(state))
+	{
+		int old_state = atomic_compare_and_exchange_explicit(&rwlock->state, state, state + k_rwlock_reader, k_atomic_order_acquire);
+		if (old_state == state)
+		{
+			return true;
+		}
+		state = old_state;
+	}
+	return false;
+}
+
+void rwlock_read_lock(rwlock_t* rwlock)
+{
+	for (int spin = 0; !rwlock_try_read_lock(rwlock); ++spin)
+	{
+		if (spin < k_rwlock_spin_count)
+		{
+			atomic_pause();
+			continue;
+		}
+
+		// Say a reader is asleep, unless the lock opened meanwhile.
+		int epoch = atomic_load(&rwlock->read_epoch);
+		int state = atomic_load(&rwlock->state);
+		while (rwlock_readers_blocked(state) && !(state & k_rwlock_readers_asleep))
+		{
+			int old_state = atomic_compare_and_exchange(&rwlock->state, state, state | k_rwlock_readers_asleep);
+			if (old_state == state)
+			{
+				state |= k_rwlock_readers_asleep;
+				break;
+			}
+			state = old_state;
+		}
+		if (rwlock_readers_blocked(state))
+		{
+			futex_wait(&rwlock->read_epoch, epoch);
+		}
+	}
+}
+
+static void rwlock_wake_writer(rwlock_t* rwlock)
+{
+	atomic_increment(&rwlock->write_epoch);
+	futex_wake_one(&rwlock->write_epoch);
+}
+
+void rwlock_read_unlock(rwlock_t* rwlock)
+{
+	int state = atomic_fetch_add_explicit(&rwlock->state, -k_rwlock_reader, k_atomic_order_release);
+	if ((state & k_rwlock_reader_mask) == k_rwlock_reader && (state & k_rwlock_waiting_writer_mask))
+	{
+		rwlock_wake_writer(rwlock);
+	}
+}
+
+bool rwlock_try_write_lock(rwlock_t* rwlock)
+{
+	int state = atomic_load_explicit(&rwlock->state, k_atomic_order_relaxed);
+	while (!rwlock_writers_blocked(state))
+	{
+		int old_state = atomic_compare_and_exchange_explicit(&rwlock->state, state, state | k_rwlock_writer, k_atomic_order_acquire);
+		if (old_state == state)
+		{
+			return true;
+		}
+		state = old_state;
+	}
+	return false;
+}
+
+void rwlock_write_lock(rwlock_t* rwlock)
+{
+	if (atomic_compare_and_exchange_explicit(&rwlock->state, 0, k_rwlock_writer, k_atomic_order_acquire) == 0)
+	{
+		return;
+	}
+
+	// Count as waiting, which holds back new readers.
+	atomic_fetch_add(&rwlock->state, k_rwlock_waiting_writer);
+	for (int spin = 0; ; ++spin)
+	{
+		int epoch = atomic_load(&rwlock->write_epoch);
+		int state = atomic_load_explicit(&rwlock->state, k_atomic_order_relaxed);
+		if (!rwlock_writers_blocked(state))
+		{
+			int new_state = (state - k_rwlock_waiting_writer) | k_rwlock_writer;
+			if (atomic_compare_and_exchange_explicit(&rwlock->state, state, new_state, k_atomic_order_acquire) == state)
+			{
+				return;
+			}
+		}
+		else if (spin < k_rwlock_spin_count)
+		{
+			atomic_pause();
+		}
+		else
+		{
+			futex_wait(&rwlock->write_epoch, epoch);
+		}
+	}
+}
+
+void rwlock_write_unlock(rwlock_t* rwlock)
+{
+	// Hand over to the next writer if there is one; readers wake only once
+	// no writer is left waiting, since they would wait behind it anyway.
+	int state = atomic_load_explicit(&rwlock->state, k_atomic_order_relaxed);
+	int new_state;
+	bool wake_readers;
+	while (true)
+	{
+		new_state = state & ~k_rwlock_writer;
+		wake_readers = (state & k_rwlock_readers_asleep) && !(state & k_rwlock_waiting_writer_mask);
+		if (wake_readers)
+		{
+			new_state &= ~k_rwlock_readers_asleep;
+		}
+		int old_state = atomic_compare_and_exchange_explicit(&rwlock->state, state, new_state, k_atomic_order_release);
+		if (old_state == state)
+		{
+			break;
+		}
+		state = old_state;
+	}
+
+	if (state & k_rwlock_waiting_writer_mask)
+	{
+		rwlock_wake_writer(rwlock);
+	}
+	if (wake_readers)
+	{
+		atomic_increment(&rwlock->read_epoch);
+		futex_wake_all(&rwlock->read_epoch);
+	}
+}
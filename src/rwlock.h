@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Reader-writer lock thread synchronization
+//
+// Any number of readers may hold the lock together; a writer holds it
+// alone. Writers are preferred: once a writer waits, new readers wait
+// behind it, so a steady stream of readers cannot starve writers.
+//
+// Built on futex: locking and unlocking stay in user space unless threads
+// contend. Not recursive; a thread holding a read lock must not take it
+// again while a writer may be waiting.
+
+// Handle to a reader-writer lock.
+typedef struct rwlock_t rwlock_t;
+
+// Creates a new reader-writer lock.
+rwlock_t* rwlock_create();
+
+// Destroys a previously created reader-writer lock.
+void rwlock_destroy(rwlock_t* rwlock);
+
+// Locks for reading. Blocks while a writer holds the lock or waits for it.
+void rwlock_read_lock(rwlock_t* rwlock);
+
+// Locks for reading only if that does not need to wait. Never blocks.
+// Returns true if the lock was taken; it must then be unlocked.
+bool rwlock_try_read_lock(rwlock_t* rwlock);
+
+// Releases a read lock.
+void rwlock_read_unlock(rwlock_t* rwlock);
+
+// Locks for writing. Blocks while any other thread holds the lock.
+void rwlock_write_lock(rwlock_t* rwlock);
+
+// Locks for writing only if no other thread holds the lock. Never blocks.
+// Returns true if the lock was taken; it must then be unlocked.
+bool rwlock_try_write_lock(rwlock_t* rwlock);
+
+// Releases a write lock.
+void rwlock_write_unlock(rwlock_t* rwlock);
@@ -1,31 +1,97 @@
 #include "semaphore.h"
 
-#define WIN32_LEAN_AND_MEAN
-#include <windows.h>
+#include "atomic.h"
+#include "futex.h"
+
+#include <stdlib.h>
+
+// Counting semaphore on a futex word. Acquiring while the count is above
+// zero, and releasing when nobody is parked, are one atomic each.
+//
+// A thread about to park registers as a waiter before its final look at
+// the count. Both sides use full barriers, so a release either sees the
+// waiter and wakes it, or the waiter's final look sees the release.
+
+enum
+{
+	// Failed attempts before an acquire parks.
+	k_semaphore_spin_count = 64,
+};
+
+typedef struct semaphore_t
+{
+	int count;
+	int max_count;
+	// Threads parked, or about to park, on count.
+	int waiters;
+} semaphore_t;
 
 semaphore_t* semaphore_create(int initial_count, int max_count)
 {
-	HANDLE semaphore = CreateSemaphore(NULL, initial_count, max_count, NULL);
-	return (semaphore_t*)semaphore;
+	semaphore_t* semaphore = malloc(sizeof(semaphore_t));
+	semaphore->count = initial_count;
+	semaphore->max_count = max_count;
+	semaphore->waiters = 0;
+	return semaphore;
 }
 
 void semaphore_destroy(semaphore_t* semaphore)
 {
-	CloseHandle(semaphore);
+	free(semaphore);
 }
 
 void semaphore_acquire(semaphore_t* semaphore)
 {
-	WaitForSingleObject(semaphore, INFINITE);
+	for (int spin = 0; !semaphore_try_acquire(semaphore); ++spin)
+	{
+		if (spin < k_semaphore_spin_count)
+		{
+			atomic_pause();
+			continue;
+		}
+		atomic_increment(&semaphore->waiters);
+		bool acquired = semaphore_try_acquire(semaphore);
+		if (!acquired)
+		{
+			futex_wait(&semaphore->count, 0);
+		}
+		atomic_decrement(&semaphore->waiters);
+		if (acquired)
+		{
+			return;
+		}
+	}
 }
 
 bool semaphore_try_acquire(semaphore_t* semaphore)
 {
-	DWORD result = WaitForSingleObject(semaphore, 0);
-	return result == WAIT_OBJECT_0;
+	int count = atomic_load(&semaphore->count);
+	while (count > 0)
+	{
+		int old_count = atomic_compare_and_exchange(&semaphore->count, count, count - 1);
+		if (old_count == count)
+		{
+			return true;
+		}
+		count = old_count;
+	}
+	return false;
 }
 
 void semaphore_release(semaphore_t* semaphore)
 {
-	ReleaseSemaphore(semaphore, 1, NULL);
+	int count = atomic_load(&semaphore->count);
+	while (count < semaphore->max_count)
+	{
+		int old_count = atomic_compare_and_exchange(&semaphore->count, count, count + 1);
+		if (old_count == count)
+		{
+			if (atomic_load_explicit(&semaphore->waiters, k_atomic_order_seq_cst) > 0)
+			{
+				futex_wake_one(&semaphore->count);
+			}
+			return;
+		}
+		count = old_count;
+	}
 }
@@ -3,6 +3,9 @@
 #include <stdbool.h>
 
 // Counting semaphore thread synchronization
+//
+// Built on futex: the count is adjusted in user space, and only threads
+// that must sleep, or must be woken, make system calls.
 
 // Handle to a semaphore.
 typedef struct semaphore_t semaphore_t;
@@ -48,10 +48,12 @@ typedef struct simple_game_t
 	fs_t* fs;
 	wm_window_t* window;
 	render_t* render;
+	heap_t* net_heap;
 	net_t* net;
 
 	timer_object_t* timer;
 
+	heap_t* ecs_heap;
 	ecs_t* ecs;
 	int transform_type;
 	int camera_type;
@@ -84,14 +86,16 @@ simple_game_t* simple_game_create(heap_t* heap, fs_t* fs, wm_window_t* window, r
 
 	game->timer = timer_object_create(heap, NULL);
 	
-	game->ecs = ecs_create(heap);
+	game->ecs_heap = heap_create_child(heap, "ecs", 256 * 1024, 32 * 1024 * 1024);
+	game->ecs = ecs_create(game->ecs_heap);
 	game->transform_type = ecs_register_component_type(game->ecs, "transform", sizeof(transform_component_t), _Alignof(transform_component_t));
 	game->camera_type = ecs_register_component_type(game->ecs, "camera", sizeof(camera_component_t), _Alignof(camera_component_t));
 	game->model_type = ecs_register_component_type(game->ecs, "model", sizeof(model_component_t), _Alignof(model_component_t));
 	game->player_type = ecs_register_component_type(game->ecs, "player", sizeof(player_component_t), _Alignof(player_component_t));
 	game->name_type = ecs_register_component_type(game->ecs, "name", sizeof(name_component_t), _Alignof(name_component_t));
 
-	game->net = net_create(heap, game->ecs);
+	game->net_heap = heap_create_child(heap, "net", 64 * 1024, 4 * 1024 * 1024);
+	game->net = net_create(game->net_heap, game->ecs);
 	if (argc >= 2)
 	{
 		net_address_t server;
@@ -115,7 +119,9 @@ simple_game_t* simple_game_create(heap_t* heap, fs_t* fs, wm_window_t* window, r
 void simple_game_destroy(simple_game_t* game)
 {
 	net_destroy(game->net);
+	heap_destroy(game->net_heap);
 	ecs_destroy(game->ecs);
+	heap_destroy(game->ecs_heap);
 	timer_object_destroy(game->timer);
 	unload_resources(game);
 	heap_free(game->heap, game);
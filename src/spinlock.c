@@ -0,0 +1,67 @@
+#include "spinlock.h"
+
+#include "atomic.h"
+#include "thread.h"
+
+#include <stdlib.h>
+
+// Test and test-and-set: waiters read the lock until it looks free, and
+// only then try to take it, so they share the cache line while they wait.
+
+enum
+{
+	// Pauses between attempts start at one and double up to this.
+	k_spinlock_max_backoff = 64,
+};
+
+typedef struct spinlock_t
+{
+	int locked;
+} spinlock_t;
+
+spinlock_t* spinlock_create()
+{
+	spinlock_t* spinlock = malloc(sizeof(spinlock_t));
+	spinlock->locked = 0;
+	return spinlock;
+}
+
+void spinlock_destroy(spinlock_t* spinlock)
+{
+	free(spinlock);
+}
+
+void spinlock_lock(spinlock_t* spinlock)
+{
+	int backoff = 1;
+	while (atomic_exchange_explicit(&spinlock->locked, 1, k_atomic_order_acquire) != 0)
+	{
+		do
+		{
+			if (backoff < k_spinlock_max_backoff)
+			{
+				for (int i = 0; i < backoff; ++i)
+				{
+					atomic_pause();
+				}
+				backoff *= 2;
+			}
+			else
+			{
+				// The holder has probably been preempted; let it run.
+				thread_yield();
+			}
+		} while (atomic_load_explicit(&spinlock->locked, k_atomic_order_relaxed) != 0);
+	}
+}
+
+bool spinlock_try_lock(spinlock_t* spinlock)
+{
+	return atomic_load_explicit(&spinlock->locked, k_atomic_order_relaxed) == 0
+		&& atomic_exchange_explicit(&spinlock->locked, 1, k_atomic_order_acquire) == 0;
+}
+
+void spinlock_unlock(spinlock_t* spinlock)
+{
+	atomic_store_explicit(&spinlock->locked, 0, k_atomic_order_release);
+}
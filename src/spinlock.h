@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Spinlock thread synchronization
+//
+// For very short critical sections, a handful of instructions, where
+// parking a thread would cost far more than waiting. Waiters back off
+// exponentially between attempts, so contended locks do not hammer the
+// cache line, and yield the processor once the backoff is at its longest.
+// Not recursive. Prefer mutex_t for anything longer.
+
+// Handle to a spinlock.
+typedef struct spinlock_t spinlock_t;
+
+// Creates a new spinlock.
+spinlock_t* spinlock_create();
+
+// Destroys a previously created spinlock.
+void spinlock_destroy(spinlock_t* spinlock);
+
+// Locks a spinlock. Spins while another thread holds it.
+void spinlock_lock(spinlock_t* spinlock);
+
+// Locks a spinlock only if no other thread holds it. Never spins.
+// Returns true if the spinlock was locked; it must then be unlocked.
+bool spinlock_try_lock(spinlock_t* spinlock);
+
+// Unlocks a spinlock.
+void spinlock_unlock(spinlock_t* spinlock);
@@ -0,0 +1,224 @@
+#include "spsc_queue.h"
+
+#include "atomic.h"
+#include "futex.h"
+#include "heap.h"
+
+#include <stdint.h>
+
+// Each side keeps a cached copy of the other side's index and only reloads
+// it when the cache says the ring is full or empty. The consumer publishes
+// its index in batches, so a steady stream of pops costs the producer's
+// cache line one write per batch instead of one per item.
+//
+// Indices are published with release stores and read with acquire loads.
+// A side about to sleep raises its waiting flag, issues the heavy half of
+// an asymmetric fence and checks the ring again. A publishing side puts
+// only the light half between its index store and its check of the flag,
+// so the common path has no hardware barrier, yet either the publisher
+// sees the flag and wakes the sleeper, or the recheck sees the new index.
+
+enum
+{
+	k_spsc_queue_cache_line_size = 64,
+	// Most pops between publications of the consumer index.
+	k_spsc_queue_publish_batch = 32,
+	// Failed attempts before a blocking call sleeps.
+	k_spsc_queue_spin_count = 64,
+};
+
+typedef struct spsc_queue_t
+{
+	// Owned by the producer.
+	int64_t tail_index;
+	int64_t cached_head_index;
+	char producer_pad[k_spsc_queue_cache_line_size - sizeof(int64_t) * 2];
+
+	// Owned by the consumer. head_index is the published copy of
+	// local_head_index.
+	int64_t head_index;
+	int64_t local_head_index;
+	int64_t cached_tail_index;
+	char consumer_pad[k_spsc_queue_cache_line_size - sizeof(int64_t) * 3];
+
+	// Futex words, nonzero while that side sleeps.
+	int producer_waiting;
+	int consumer_waiting;
+
+	heap_t* heap;
+	void** items;
+	int capacity;
+	int publish_batch;
+} spsc_queue_t;
+
+spsc_queue_t* spsc_queue_create(heap_t* heap, int capacity)
+{
+	spsc_queue_t* queue = heap_alloc(heap, sizeof(spsc_queue_t), k_spsc_queue_cache_line_size);
+	queue->items = heap_alloc(heap, sizeof(void*) * capacity, 8);
+	queue->heap = heap;
+	queue->capacity = capacity;
+	// Small queues throttle their producer; hold back no more than a
+	// quarter of the slots.
+	queue->publish_batch = __max(__min(k_spsc_queue_publish_batch, capacity / 4), 1);
+	queue->tail_index = 0;
+	queue->cached_head_index = 0;
+	queue->head_index = 0;
+	queue->local_head_index = 0;
+	queue->cached_tail_index = 0;
+	queue->producer_waiting = 0;
+	queue->consumer_waiting = 0;
+	return queue;
+}
+
+void spsc_queue_destroy(spsc_queue_t* queue)
+{
+	heap_free(queue->heap, queue->items);
+	heap_free(queue->heap, queue);
+}
+
+// Wake the other side if it sleeps. Call after publishing an index.
+static void spsc_queue_wake(int* waiting)
+{
+	atomic_fence_light();
+	if (atomic_load_explicit(waiting, k_atomic_order_relaxed))
+	{
+		atomic_store(waiting, 0);
+		futex_wake_one(waiting);
+	}
+}
+
+static void spsc_queue_publish_head(spsc_queue_t* queue)
+{
+	if (queue->local_head_index != queue->head_index)
+	{
+		atomic_store64_explicit(&queue->head_index, queue->local_head_index, k_atomic_order_release);
+		spsc_queue_wake(&queue->producer_waiting);
+	}
+}
+
+// Push as many of the items as there are free slots, publishing them with
+// one store. Returns the number of items pushed; zero if the queue is full.
+static int spsc_queue_try_push_some(spsc_queue_t* queue, void* const* items, int count)
+{
+	int64_t tail = queue->tail_index;
+	if (tail - queue->cached_head_index + count > queue->capacity)
+	{
+		queue->cached_head_index = atomic_load64_explicit(&queue->head_index, k_atomic_order_acquire);
+	}
+	int pushed = (int)__min(queue->capacity - (tail - queue->cached_head_index), count);
+	if (pushed <= 0)
+	{
+		return 0;
+	}
+	for (int i = 0; i < pushed; ++i)
+	{
+		queue->items[(tail + i) % queue->capacity] = items[i];
+	}
+	atomic_store64_explicit(&queue->tail_index, tail + pushed, k_atomic_order_release);
+	spsc_queue_wake(&queue->consumer_waiting);
+	return pushed;
+}
+
+// Pop up to max_count items. Returns the number of items popped; zero if
+// the queue is empty.
+static int spsc_queue_try_pop_some(spsc_queue_t* queue, void** items, int max_count)
+{
+	int64_t head = queue->local_head_index;
+	if (queue->cached_tail_index - head < max_count)
+	{
+		queue->cached_tail_index = atomic_load64_explicit(&queue->tail_index, k_atomic_order_acquire);
+		if (head == queue->cached_tail_index)
+		{
+			// Going idle: hand back every slot consumed so far.
+			spsc_queue_publish_head(queue);
+			return 0;
+		}
+	}
+	int popped = (int)__min(queue->cached_tail_index - head, max_count);
+	for (int i = 0; i < popped; ++i)
+	{
+		items[i] = queue->items[(head + i) % queue->capacity];
+	}
+	queue->local_head_index = head + popped;
+	if (queue->local_head_index - queue->head_index >= queue->publish_batch)
+	{
+		spsc_queue_publish_head(queue);
+	}
+	return popped;
+}
+
+void spsc_queue_push_n(spsc_queue_t* queue, void* const* items, int count)
+{
+	int spin = 0;
+	while (count > 0)
+	{
+		int pushed = spsc_queue_try_push_some(queue, items, count);
+		if (pushed == 0 && spin++ >= k_spsc_queue_spin_count)
+		{
+			atomic_compare_and_exchange(&queue->producer_waiting, 0, 1);
+			atomic_fence_heavy();
+			pushed = spsc_queue_try_push_some(queue, items, count);
+			if (pushed > 0)
+			{
+				atomic_store(&queue->producer_waiting, 0);
+			}
+			else
+			{
+				futex_wait(&queue->producer_waiting, 1);
+			}
+		}
+		else if (pushed == 0)
+		{
+			atomic_pause();
+		}
+		items += pushed;
+		count -= pushed;
+	}
+}
+
+int spsc_queue_pop_n(spsc_queue_t* queue, void** items, int max_count)
+{
+	int popped = 0;
+	for (int spin = 0; (popped = spsc_queue_try_pop_some(queue, items, max_count)) == 0; ++spin)
+	{
+		if (spin < k_spsc_queue_spin_count)
+		{
+			atomic_pause();
+			continue;
+		}
+		atomic_compare_and_exchange(&queue->consumer_waiting, 0, 1);
+		atomic_fence_heavy();
+		popped = spsc_queue_try_pop_some(queue, items, max_count);
+		if (popped > 0)
+		{
+			atomic_store(&queue->consumer_waiting, 0);
+			break;
+		}
+		futex_wait(&queue->consumer_waiting, 1);
+	}
+	return popped;
+}
+
+void spsc_queue_push(spsc_queue_t* queue, void* item)
+{
+	spsc_queue_push_n(queue, &item, 1);
+}
+
+void* spsc_queue_pop(spsc_queue_t* queue)
+{
+	void* item = NULL;
+	spsc_queue_pop_n(queue, &item, 1);
+	return item;
+}
+
+bool spsc_queue_try_push(spsc_queue_t* queue, void* item)
+{
+	return spsc_queue_try_push_some(queue, &item, 1) == 1;
+}
+
+void* spsc_queue_try_pop(spsc_queue_t* queue)
+{
+	void* item = NULL;
+	spsc_queue_try_pop_some(queue, &item, 1);
+	return item;
+}
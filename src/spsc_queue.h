@@ -0,0 +1,52 @@
+#pragma once
+
+#include <stdbool.h>
+
+// Single-producer, single-consumer queue container
+// A bounded ring for pipelines between two threads. Cheaper than queue_t:
+// indices are published with release stores and no hardware barrier, and a
+// thread only enters the kernel on a full or empty queue, to issue a
+// process-wide barrier and sleep.
+
+// Handle to a single-producer, single-consumer queue.
+typedef struct spsc_queue_t spsc_queue_t;
+
+typedef struct heap_t heap_t;
+
+// Create a queue with the defined capacity.
+spsc_queue_t* spsc_queue_create(heap_t* heap, int capacity);
+
+// Destroy a previously created queue.
+void spsc_queue_destroy(spsc_queue_t* queue);
+
+// Push an item onto a queue.
+// If the queue is full, blocks until space is available.
+// Only one thread may push to a queue.
+void spsc_queue_push(spsc_queue_t* queue, void* item);
+
+// Pop an item off a queue (FIFO order).
+// If the queue is empty, blocks until an item is available.
+// Only one thread may pop from a queue.
+void* spsc_queue_pop(spsc_queue_t* queue);
+
+// Push count items onto a queue, in order, publishing each run of free
+// slots with one store. If the queue fills up, blocks until all items are
+// pushed.
+// Only one thread may push to a queue.
+void spsc_queue_push_n(spsc_queue_t* queue, void* const* items, int count);
+
+// Pop up to max_count items off a queue (FIFO order) into items.
+// If the queue is empty, blocks until at least one item is available.
+// Returns the number of items popped.
+// Only one thread may pop from a queue.
+int spsc_queue_pop_n(spsc_queue_t* queue, void** items, int max_count);
+
+// Push an item onto a queue if space is available.
+// If the queue is full, returns false.
+// Only one thread may push to a queue.
+bool spsc_queue_try_push(spsc_queue_t* queue, void* item);
+
+// Pop an item off a queue (FIFO order).
+// If the queue is empty, returns NULL.
+// Only one thread may pop from a queue.
+void* spsc_queue_try_pop(spsc_queue_t* queue);
@@ -0,0 +1,488 @@
+#include "sync_bench.h"
+
+#include "atomic.h"
+#include "bench.h"
+#include "event.h"
+#include "heap.h"
+#include "mutex.h"
+#include "queue.h"
+#include "rwlock.h"
+#include "semaphore.h"
+#include "spinlock.h"
+#include "spsc_queue.h"
+
+#include <stdint.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#endif
+
+enum
+{
+	k_sync_bench_cache_line_size = 64,
+	k_sync_bench_max_threads = 64,
+	k_sync_bench_counter_ops = 200000,
+	k_sync_bench_queue_ops = 200000,
+	k_sync_bench_ping_pong_ops = 20000,
+	k_sync_bench_heap_ops = 200000,
+	k_sync_bench_queue_capacity = 1024,
+	// One in this many reader-writer lock operations writes.
+	k_sync_bench_write_interval = 16,
+	// Blocks each heap churn thread keeps live.
+	k_sync_bench_heap_working_set = 64,
+};
+
+// One thread's slot, on cache lines of its own.
+typedef struct sync_bench_slot_t
+{
+	void* blocks[k_sync_bench_heap_working_set];
+	int64_t sum;
+	uint32_t seed;
+	char pad[k_sync_bench_cache_line_size - sizeof(int64_t) - sizeof(uint32_t)];
+} sync_bench_slot_t;
+
+typedef struct sync_bench_state_t
+{
+	// Shared counter, on its own cache line.
+	int counter;
+	char counter_pad[k_sync_bench_cache_line_size - sizeof(int)];
+
+	mutex_t* mutex;
+	semaphore_t* semaphore;
+	rwlock_t* rwlock;
+	spinlock_t* spinlock;
+	queue_t* queue;
+	// Per producer/consumer pair.
+	spsc_queue_t* spsc_queues[k_sync_bench_max_threads / 2];
+	event_t* pings[k_sync_bench_max_threads / 2];
+	event_t* pongs[k_sync_bench_max_threads / 2];
+	heap_t* churn_heap;
+	sync_bench_slot_t* slots;
+	int thread_count;
+#if defined(_WIN32)
+	// Kernel objects, as mutex_t and friends used to wrap, to compare
+	// against the futex-based versions.
+	HANDLE kernel_mutex;
+	HANDLE kernel_semaphore;
+	SRWLOCK srwlock;
+	HANDLE kernel_pings[k_sync_bench_max_threads / 2];
+	HANDLE kernel_pongs[k_sync_bench_max_threads / 2];
+#endif
+} sync_bench_state_t;
+
+// Every scenario shares one setup, so each creates a little more than it
+// uses; none of it is timed.
+static void* sync_bench_setup(heap_t* heap, int thread_count)
+{
+	sync_bench_state_t* state = heap_alloc(heap, sizeof(sync_bench_state_t), k_sync_bench_cache_line_size);
+	state->counter = 0;
+	state->mutex = mutex_create();
+	state->semaphore = semaphore_create(1, 1);
+	state->rwlock = rwlock_create();
+	state->spinlock = spinlock_create();
+	state->queue = queue_create(heap, k_sync_bench_queue_capacity);
+	state->thread_count = thread_count;
+	for (int i = 0; i < thread_count / 2; ++i)
+	{
+		state->spsc_queues[i] = spsc_queue_create(heap, k_sync_bench_queue_capacity);
+		state->pings[i] = event_create();
+		state->pongs[i] = event_create();
+	}
+	heap_info_t info = { .grow_increment = 1024 * 1024, .name = "sync_bench", .leak_mode = k_heap_leak_off };
+	state->churn_heap = heap_create_ex(&info);
+	state->slots = heap_alloc(heap, sizeof(sync_bench_slot_t) * thread_count, k_sync_bench_cache_line_size);
+	for (int i = 0; i < thread_count; ++i)
+	{
+		state->slots[i].sum = 0;
+		state->slots[i].seed = 0x9e3779b9u * (i + 1);
+		for (int j = 0; j < k_sync_bench_heap_working_set; ++j)
+		{
+			state->slots[i].blocks[j] = NULL;
+		}
+	}
+#if defined(_WIN32)
+	state->kernel_mutex = CreateMutex(NULL, FALSE, NULL);
+	state->kernel_semaphore = CreateSemaphore(NULL, 1, 1, NULL);
+	InitializeSRWLock(&state->srwlock);
+	for (int i = 0; i < thread_count / 2; ++i)
+	{
+		state->kernel_pings[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
+		state->kernel_pongs[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
+	}
+#endif
+	return state;
+}
+
+static void sync_bench_teardown(heap_t* heap, void* user)
+{
+	sync_bench_state_t* state = user;
+#if defined(_WIN32)
+	for (int i = 0; i < state->thread_count / 2; ++i)
+	{
+		CloseHandle(state->kernel_pongs[i]);
+		CloseHandle(state->kernel_pings[i]);
+	}
+	CloseHandle(state->kernel_semaphore);
+	CloseHandle(state->kernel_mutex);
+#endif
+	for (int i = 0; i < state->thread_count; ++i)
+	{
+		for (int j = 0; j < k_sync_bench_heap_working_set; ++j)
+		{
+			heap_free(state->churn_heap, state->slots[i].blocks[j]);
+		}
+	}
+	heap_free(heap, state->slots);
+	heap_destroy(state->churn_heap);
+	for (int i = 0; i < state->thread_count / 2; ++i)
+	{
+		event_destroy(state->pongs[i]);
+		event_destroy(state->pings[i]);
+		spsc_queue_destroy(state->spsc_queues[i]);
+	}
+	queue_destroy(state->queue);
+	spinlock_destroy(state->spinlock);
+	rwlock_destroy(state->rwlock);
+	semaphore_destroy(state->semaphore);
+	mutex_destroy(state->mutex);
+	heap_free(heap, state);
+}
+
+static bool check_counter(void* user, int thread_count, int ops_per_thread)
+{
+	sync_bench_state_t* state = user;
+	return state->counter == thread_count * ops_per_thread;
+}
+
+// Each thread counts its own writes; the counter must have seen them all.
+static bool check_writes(void* user, int thread_count, int ops_per_thread)
+{
+	sync_bench_state_t* state = user;
+	int64_t writes = 0;
+	for (int i = 0; i < thread_count; ++i)
+	{
+		writes += state->slots[i].sum;
+	}
+	return state->counter == writes;
+}
+
+// Consumers, the odd threads, must have received every value the
+// producers sent: each producer sends its pair number plus one.
+static bool check_handoff(void* user, int thread_count, int ops_per_thread)
+{
+	sync_bench_state_t* state = user;
+	int64_t expected = 0;
+	int64_t received = 0;
+	for (int i = 0; i + 1 < thread_count; i += 2)
+	{
+		expected += (int64_t)(i / 2 + 1) * ops_per_thread;
+		received += state->slots[i + 1].sum;
+	}
+	return received == expected;
+}
+
+static void atomic_increment_run(void* user, int thread_index, int count)
+{
+	sync_bench_state_t* state = user;
+	for (int i = 0; i < count; ++i)
+	{
+		atomic_increment(&state->counter);
+	}
+}
+
+static void atomic_compare_and_exchange_run(void* user, int thread_index, int count)
+{
+	sync_bench_state_t* state = user;
+	for (int i = 0; i < count; ++i)
+	{
+		int value = atomic_load_explicit(&state->counter, k_atomic_order_relaxed);
+		int old_value;
+		while ((old_value = atomic_compare_and_exchange(&state->counter, value, value + 1)) != value)
+		{
+			value = old_value;
+		}
+	}
+}
+
+static void mutex_run(void* user, int thread_index, int count)
+{
+	sync_bench_state_t* state = user;
+	for (int i = 0; i < count; ++i)
+	{
+		mutex_lock(state->mutex);
+		state->counter = state->counter + 1;
+		mutex_unlock(state->mutex);
+	}
+}
+
+static void semaphore_run(void* user, int thread_index, int count)
+{
+	sync_bench_state_t* state = user;
+	for (int i = 0; i < count; ++i)
+	{
+		semaphore_acquire(state->semaphore);
+		state->counter = state->counter + 1;
+		semaphore_release(state->semaphore);
+	}
+}
+
+static void spinlock_run(void* user, int thread_index, int count)
+{
+	sync_bench_state_t* state = user;
+	for (int i = 0; i < count; ++i)
+	{
+		spinlock_lock(state->spinlock);
+		state->counter = state->counter + 1;
+		spinlock_unlock(state->spinlock);
+	}
+}
+
+// Readers only, as in a lookup table nobody changes.
+static void rwlock_read_run(void* user, int thread_index, int count)
+{
+	sync_bench_state_t* state = user;
+	sync_bench_slot_t* slot = &state->slots[thread_index];
+	for (int i = 0; i < count; ++i)
+	{
+		rwlock_read_lock(state->rwlock);
+		slot->sum += state->counter;
+		rwlock_read_unlock(state->rwlock);
+	}
+}
+
+// Mostly readers, with an occasional writer.
+static void rwlock_mixed_run(void* user, int thread_index, int count)
+{
+	sync_bench_state_t* state = user;
+	sync_bench_slot_t* slot = &state->slots[thread_index];
+	for (int i = 0; i < count; ++i)
+	{
+		if (i % k_sync_bench_write_interval == 0)
+		{
+			rwlock_write_lock(state->rwlock);
+			state->counter = state->counter + 1;
+			rwlock_write_unlock(state->rwlock);
+			slot->sum++;
+		}
+		else
+		{
+			rwlock_read_lock(state->rwlock);
+			slot->seed += state->counter;
+			rwlock_read_unlock(state->rwlock);
+		}
+	}
+}
+
+// The same mix under a mutex, for comparison.
+static void mutex_mixed_run(void* user, int thread_index, int count)
+{
+	sync_bench_state_t* state = user;
+	sync_bench_slot_t* slot = &state->slots[thread_index];
+	for (int i = 0; i < count; ++i)
+	{
+		mutex_lock(state->mutex);
+		if (i % k_sync_bench_write_interval == 0)
+		{
+			state->counter = state->counter + 1;
+			slot->sum++;
+		}
+		else
+		{
+			slot->seed += state->counter;
+		}
+		mutex_unlock(state->mutex);
+	}
+}
+
+// Every thread pushes an item and pops one back.
+static void queue_push_pop_run(void* user, int thread_index, int count)
+{
+	sync_bench_state_t* state = user;
+	for (int i = 0; i < count; ++i)
+	{
+		queue_push(state->queue, (void*)(intptr_t)(thread_index + 1));
+		queue_pop(state->queue);
+	}
+}
+
+// Even threads produce into one shared queue; odd threads consume.
+static void mpmc_handoff_run(void* user, int thread_index, int count)
+{
+	sync_bench_state_t* state = user;
+	sync_bench_slot_t* slot = &state->slots[thread_index];
+	for (int i = 0; i < count; ++i)
+	{
+		if (thread_index % 2 == 0)
+		{
+			queue_push(state->queue, (void*)(intptr_t)(thread_index / 2 + 1));
+		}
+		else
+		{
+			slot->sum += (intptr_t)queue_pop(state->queue);
+		}
+	}
+}
+
+// Each pair of threads has its own single-producer/single-consumer queue.
+static void spsc_handoff_run(void* user, int thread_index, int count)
+{
+	sync_bench_state_t* state = user;
+	spsc_queue_t* queue = state->spsc_queues[thread_index / 2];
+	sync_bench_slot_t* slot = &state->slots[thread_index];
+	for (int i = 0; i < count; ++i)
+	{
+		if (thread_index % 2 == 0)
+		{
+			spsc_queue_push(queue, (void*)(intptr_t)(thread_index / 2 + 1));
+		}
+		else
+		{
+			slot->sum += (intptr_t)spsc_queue_pop(queue);
+		}
+	}
+}
+
+// Each pair of threads bounces between two events. A side resets the
+// event it waited on before signaling, so the other side cannot signal it
+// again until the reset is done.
+static void event_ping_pong_run(void* user, int thread_index, int count)
+{
+	sync_bench_state_t* state = user;
+	event_t* ping = state->pings[thread_index / 2];
+	event_t* pong = state->pongs[thread_index / 2];
+	for (int i = 0; i < count; ++i)
+	{
+		if (thread_index % 2 == 0)
+		{
+			event_signal(ping);
+			event_wait(pong);
+			event_reset(pong);
+		}
+		else
+		{
+			event_wait(ping);
+			event_reset(ping);
+			event_signal(pong);
+		}
+	}
+}
+
+// Every thread replaces random blocks of its working set in a shared heap.
+static void heap_churn_run(void* user, int thread_index, int count)
+{
+	sync_bench_state_t* state = user;
+	sync_bench_slot_t* slot = &state->slots[thread_index];
+	for (int i = 0; i < count; ++i)
+	{
+		slot->seed ^= slot->seed << 13;
+		slot->seed ^= slot->seed >> 17;
+		slot->seed ^= slot->seed << 5;
+		void** block = &slot->blocks[slot->seed % k_sync_bench_heap_working_set];
+		heap_free(state->churn_heap, *block);
+		*block = heap_alloc(state->churn_heap, 16 + (slot->seed >> 8) % 1008, 8);
+	}
+}
+
+#if defined(_WIN32)
+
+static void kernel_mutex_run(void* user, int thread_index, int count)
+{
+	sync_bench_state_t* state = user;
+	for (int i = 0; i < count; ++i)
+	{
+		WaitForSingleObject(state->kernel_mutex, INFINITE);
+		state->counter = state->counter + 1;
+		ReleaseMutex(state->kernel_mutex);
+	}
+}
+
+static void srwlock_mixed_run(void* user, int thread_index, int count)
+{
+	sync_bench_state_t* state = user;
+	sync_bench_slot_t* slot = &state->slots[thread_index];
+	for (int i = 0; i < count; ++i)
+	{
+		if (i % k_sync_bench_write_interval == 0)
+		{
+			AcquireSRWLockExclusive(&state->srwlock);
+			state->counter = state->counter + 1;
+			ReleaseSRWLockExclusive(&state->srwlock);
+			slot->sum++;
+		}
+		else
+		{
+			AcquireSRWLockShared(&state->srwlock);
+			slot->seed += state->counter;
+			ReleaseSRWLockShared(&state->srwlock);
+		}
+	}
+}
+
+static void kernel_semaphore_run(void* user, int thread_index, int count)
+{
+	sync_bench_state_t* state = user;
+	for (int i = 0; i < count; ++i)
+	{
+		WaitForSingleObject(state->kernel_semaphore, INFINITE);
+		state->counter = state->counter + 1;
+		ReleaseSemaphore(state->kernel_semaphore, 1, NULL);
+	}
+}
+
+// Auto-reset kernel events need no reset step.
+static void kernel_event_ping_pong_run(void* user, int thread_index, int count)
+{
+	sync_bench_state_t* state = user;
+	HANDLE ping = state->kernel_pings[thread_index / 2];
+	HANDLE pong = state->kernel_pongs[thread_index / 2];
+	for (int i = 0; i < count; ++i)
+	{
+		if (thread_index % 2 == 0)
+		{
+			SetEvent(ping);
+			WaitForSingleObject(pong, INFINITE);
+		}
+		else
+		{
+			WaitForSingleObject(ping, INFINITE);
+			SetEvent(pong);
+		}
+	}
+}
+
+#endif
+
+static const bench_scenario_t k_sync_bench_scenarios[] =
+{
+	{ "atomic_increment", k_sync_bench_counter_ops, 1, sync_bench_setup, atomic_increment_run, check_counter, sync_bench_teardown },
+	{ "atomic_cas", k_sync_bench_counter_ops, 1, sync_bench_setup, atomic_compare_and_exchange_run, check_counter, sync_bench_teardown },
+	{ "mutex", k_sync_bench_counter_ops, 1, sync_bench_setup, mutex_run, check_counter, sync_bench_teardown },
+#if defined(_WIN32)
+	{ "kernel_mutex", k_sync_bench_counter_ops, 1, sync_bench_setup, kernel_mutex_run, check_counter, sync_bench_teardown },
+#endif
+	{ "semaphore", k_sync_bench_counter_ops, 1, sync_bench_setup, semaphore_run, check_counter, sync_bench_teardown },
+#if defined(_WIN32)
+	{ "kernel_semaphore", k_sync_bench_counter_ops, 1, sync_bench_setup, kernel_semaphore_run, check_counter, sync_bench_teardown },
+#endif
+	{ "spinlock", k_sync_bench_counter_ops, 1, sync_bench_setup, spinlock_run, check_counter, sync_bench_teardown },
+	{ "rwlock_read", k_sync_bench_counter_ops, 1, sync_bench_setup, rwlock_read_run, NULL, sync_bench_teardown },
+	{ "rwlock_mixed", k_sync_bench_counter_ops, 1, sync_bench_setup, rwlock_mixed_run, check_writes, sync_bench_teardown },
+	{ "mutex_mixed", k_sync_bench_counter_ops, 1, sync_bench_setup, mutex_mixed_run, check_writes, sync_bench_teardown },
+#if defined(_WIN32)
+	{ "srwlock_mixed", k_sync_bench_counter_ops, 1, sync_bench_setup, srwlock_mixed_run, check_writes, sync_bench_teardown },
+#endif
+	{ "queue_push_pop", k_sync_bench_queue_ops, 1, sync_bench_setup, queue_push_pop_run, NULL, sync_bench_teardown },
+	{ "mpmc_handoff", k_sync_bench_queue_ops, 2, sync_bench_setup, mpmc_handoff_run, check_handoff, sync_bench_teardown },
+	{ "spsc_handoff", k_sync_bench_queue_ops, 2, sync_bench_setup, spsc_handoff_run, check_handoff, sync_bench_teardown },
+	{ "event_ping_pong", k_sync_bench_ping_pong_ops, 2, sync_bench_setup, event_ping_pong_run, NULL, sync_bench_teardown },
+#if defined(_WIN32)
+	{ "kernel_event_ping_pong", k_sync_bench_ping_pong_ops, 2, sync_bench_setup, kernel_event_ping_pong_run, NULL, sync_bench_teardown },
+#endif
+	{ "heap_churn", k_sync_bench_heap_ops, 1, sync_bench_setup, heap_churn_run, NULL, sync_bench_teardown },
+};
+
+int sync_bench_main(int argc, const char** argv)
+{
+	return bench_main("sync", k_sync_bench_scenarios, _countof(k_sync_bench_scenarios), argc, argv);
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+// Synchronization benchmarks, run with the bench.h harness.
+//
+// Scenarios:
+//   atomic_increment  threads increment one shared counter
+//   atomic_cas        the same with a compare-and-exchange loop
+//   mutex             the counter guarded by a mutex_t
+//   semaphore         the counter guarded by a semaphore_t of one
+//   queue_push_pop    threads push and pop one queue_t
+//   mpmc_handoff      producer threads hand items to consumers through one queue_t
+//   spsc_handoff      each producer/consumer pair shares a spsc_queue_t
+//   event_ping_pong   each pair of threads bounces between two event_t
+//   heap_churn        threads allocate and free random sizes in one heap_t
+// Windows builds add kernel_mutex, kernel_semaphore and
+// kernel_event_ping_pong, the kernel objects the primitives replaced.
+
+// Run the benchmark suite. Takes the options of bench_main.
+// Returns zero on success, nonzero if a scenario computed a wrong result.
+int sync_bench_main(int argc, const char** argv);
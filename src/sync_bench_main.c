@@ -0,0 +1,11 @@
+#include "sync_bench.h"
+#include "timer.h"
+
+// Standalone entry point for the synchronization benchmarks; see the
+// Makefile. The game runs the same suite with: ga2022 --sync-bench [options]
+
+int main(int argc, const char* argv[])
+{
+	timer_startup();
+	return sync_bench_main(argc, argv);
+}
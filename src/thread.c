@@ -2,17 +2,81 @@
 
 #include "debug.h"
 
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+enum
+{
+	// Longest name kept, with its terminator.
+	k_thread_name_size = 32,
+};
+
+// One core per logical processor, for when the platform says nothing better.
+static void thread_topology_flat(thread_topology_t* topology)
+{
+	topology->logical_count = __min(thread_get_core_count(), 64);
+	topology->core_count = topology->logical_count;
+	for (int i = 0; i < topology->core_count; ++i)
+	{
+		topology->core_masks[i] = 1ull << i;
+	}
+}
+
+#if defined(_WIN32)
+
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
 
+static int thread_popcount(uint64_t mask)
+{
+	int count = 0;
+	for (; mask; mask &= mask - 1)
+	{
+		++count;
+	}
+	return count;
+}
+
+static void thread_set_description(HANDLE h, const char* name)
+{
+	wchar_t wide[k_thread_name_size];
+	if (MultiByteToWideChar(CP_UTF8, 0, name, -1, wide, k_thread_name_size) > 0)
+	{
+		SetThreadDescription(h, wide);
+	}
+}
+
 thread_t* thread_create(int (*function)(void*), void* data)
 {
-	HANDLE h = CreateThread(NULL, 0, function, data, CREATE_SUSPENDED, NULL);
-	if (h == INVALID_HANDLE_VALUE)
+	thread_info_t info = { .function = function, .data = data };
+	return thread_create_ex(&info);
+}
+
+thread_t* thread_create_ex(const thread_info_t* info)
+{
+	// The stack size reserves address space; pages commit as it grows.
+	DWORD flags = CREATE_SUSPENDED | (info->stack_size ? STACK_SIZE_PARAM_IS_A_RESERVATION : 0);
+	DWORD id = 0;
+	HANDLE h = CreateThread(NULL, info->stack_size, info->function, info->data, flags, &id);
+	if (!h)
 	{
 		debug_print(k_print_warning, "Thread failed to create!\n");
 		return NULL;
 	}
+	if (info->name)
+	{
+		thread_set_description(h, info->name);
+	}
+	if (info->affinity_mask && !SetThreadAffinityMask(h, (DWORD_PTR)info->affinity_mask))
+	{
+		debug_print(k_print_warning, "Thread affinity mask %llx rejected.\n", (unsigned long long)info->affinity_mask);
+	}
+	// Priorities match THREAD_PRIORITY_LOWEST through THREAD_PRIORITY_HIGHEST.
+	if (info->priority != k_thread_priority_normal)
+	{
+		SetThreadPriority(h, (int)info->priority);
+	}
 	ResumeThread(h);
 	return (thread_t*)h;
 }
@@ -30,3 +94,432 @@ void thread_sleep(uint32_t ms)
 {
 	Sleep(ms);
 }
+
+void thread_yield()
+{
+	SwitchToThread();
+}
+
+int thread_get_core_count()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int)info.dwNumberOfProcessors;
+}
+
+uint32_t thread_get_id()
+{
+	return GetCurrentThreadId();
+}
+
+uintptr_t thread_get_self()
+{
+	return GetCurrentThreadId();
+}
+
+void thread_set_name(const char* name)
+{
+	thread_set_description(GetCurrentThread(), name);
+}
+
+bool thread_get_name(char* buffer, size_t size)
+{
+	buffer[0] = '\0';
+	wchar_t* wide = NULL;
+	if (SUCCEEDED(GetThreadDescription(GetCurrentThread(), &wide)))
+	{
+		if (WideCharToMultiByte(CP_UTF8, 0, wide, -1, buffer, (int)size, NULL, NULL) == 0)
+		{
+			buffer[0] = '\0';
+		}
+		LocalFree(wide);
+	}
+	return buffer[0] != '\0';
+}
+
+void thread_get_topology(thread_topology_t* topology)
+{
+	memset(topology, 0, sizeof(*topology));
+
+	SYSTEM_LOGICAL_PROCESSOR_INFORMATION info[256];
+	DWORD size = sizeof(info);
+	if (!GetLogicalProcessorInformation(info, &size))
+	{
+		thread_topology_flat(topology);
+		return;
+	}
+
+	for (DWORD i = 0; i < size / sizeof(info[0]); ++i)
+	{
+		if (info[i].Relationship == RelationProcessorCore && topology->core_count < k_thread_max_cores)
+		{
+			topology->core_masks[topology->core_count++] = (uint64_t)info[i].ProcessorMask;
+			topology->logical_count += thread_popcount((uint64_t)info[i].ProcessorMask);
+		}
+		else if (info[i].Relationship == RelationCache && info[i].Cache.Type != CacheInstruction)
+		{
+			// Every core reports its own caches; they agree, so keep the first.
+			size_t* cache_size =
+				info[i].Cache.Level == 1 ? &topology->l1_data_cache_size :
+				info[i].Cache.Level == 2 ? &topology->l2_cache_size :
+				info[i].Cache.Level == 3 ? &topology->l3_cache_size : NULL;
+			if (cache_size && *cache_size == 0)
+			{
+				*cache_size = info[i].Cache.Size;
+			}
+			if (topology->cache_line_size == 0)
+			{
+				topology->cache_line_size = info[i].Cache.LineSize;
+			}
+		}
+	}
+}
+
+// Slots with destructors are fiber-local storage, marked by this bit.
+static const uint64_t k_thread_local_fls_bit = 1ull << 32;
+
+uint64_t thread_local_alloc()
+{
+	return TlsAlloc();
+}
+
+uint64_t thread_local_alloc_ex(void (*destructor)(void* value))
+{
+	// Only fiber-local storage calls back as threads exit.
+	return FlsAlloc((PFLS_CALLBACK_FUNCTION)destructor) | k_thread_local_fls_bit;
+}
+
+void thread_local_free(uint64_t slot)
+{
+	if (slot & k_thread_local_fls_bit)
+	{
+		FlsFree((DWORD)slot);
+	}
+	else
+	{
+		TlsFree((DWORD)slot);
+	}
+}
+
+void* thread_local_get(uint64_t slot)
+{
+	return (slot & k_thread_local_fls_bit) ? FlsGetValue((DWORD)slot) : TlsGetValue((DWORD)slot);
+}
+
+void thread_local_set(uint64_t slot, void* value)
+{
+	if (slot & k_thread_local_fls_bit)
+	{
+		FlsSetValue((DWORD)slot, value);
+	}
+	else
+	{
+		TlsSetValue((DWORD)slot, value);
+	}
+}
+
+#else
+
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// pthreads expects a different entry point signature, so the thread object
+// carries the function and its result. Like the kernel objects on Windows,
+// it lives outside of any heap.
+typedef struct thread_t
+{
+	pthread_t handle;
+	int (*function)(void*);
+	void* data;
+	int code;
+	// Applied by the thread itself as it starts.
+	char name[k_thread_name_size];
+	thread_priority_t priority;
+} thread_t;
+
+static void* thread_start(void* user)
+{
+	thread_t* thread = user;
+	if (thread->name[0])
+	{
+		thread_set_name(thread->name);
+	}
+#if defined(__linux__)
+	// Linux threads each have their own nice value. Lowering it needs
+	// CAP_SYS_NICE, so a raised priority may quietly stay normal.
+	if (thread->priority != k_thread_priority_normal)
+	{
+		setpriority(PRIO_PROCESS, thread_get_id(), -5 * (int)thread->priority);
+	}
+#endif
+	thread->code = thread->function(thread->data);
+	return NULL;
+}
+
+thread_t* thread_create(int (*function)(void*), void* data)
+{
+	thread_info_t info = { .function = function, .data = data };
+	return thread_create_ex(&info);
+}
+
+thread_t* thread_create_ex(const thread_info_t* info)
+{
+	thread_t* thread = malloc(sizeof(thread_t));
+	thread->function = info->function;
+	thread->data = info->data;
+	thread->code = 0;
+	snprintf(thread->name, sizeof(thread->name), "%s", info->name ? info->name : "");
+	thread->priority = info->priority;
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	if (info->stack_size)
+	{
+		pthread_attr_setstacksize(&attr, __max(info->stack_size, (size_t)PTHREAD_STACK_MIN));
+	}
+#if defined(__linux__)
+	if (info->affinity_mask)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (int i = 0; i < 64; ++i)
+		{
+			if (info->affinity_mask & (1ull << i))
+			{
+				CPU_SET(i, &set);
+			}
+		}
+		pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+	}
+#endif
+
+	int result = pthread_create(&thread->handle, &attr, thread_start, thread);
+	pthread_attr_destroy(&attr);
+	if (result != 0)
+	{
+		debug_print(k_print_warning, "Thread failed to create!\n");
+		free(thread);
+		return NULL;
+	}
+	return thread;
+}
+
+int thread_destroy(thread_t* thread)
+{
+	pthread_join(thread->handle, NULL);
+	int code = thread->code;
+	free(thread);
+	return code;
+}
+
+void thread_sleep(uint32_t ms)
+{
+	struct timespec duration = { .tv_sec = ms / 1000, .tv_nsec = (long)(ms % 1000) * 1000000 };
+	nanosleep(&duration, NULL);
+}
+
+void thread_yield()
+{
+	sched_yield();
+}
+
+int thread_get_core_count()
+{
+	return (int)sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+uint32_t thread_get_id()
+{
+#if defined(SYS_gettid)
+	return (uint32_t)syscall(SYS_gettid);
+#else
+	return (uint32_t)(uintptr_t)pthread_self();
+#endif
+}
+
+uintptr_t thread_get_self()
+{
+	// The address of the thread's control block, read from its TLS register.
+	return (uintptr_t)pthread_self();
+}
+
+void thread_set_name(const char* name)
+{
+#if defined(__linux__)
+	// Linux keeps 15 characters.
+	char short_name[16];
+	snprintf(short_name, sizeof(short_name), "%.15s", name);
+	pthread_setname_np(pthread_self(), short_name);
+#endif
+}
+
+bool thread_get_name(char* buffer, size_t size)
+{
+	buffer[0] = '\0';
+#if defined(__linux__)
+	char name[16];
+	if (pthread_getname_np(pthread_self(), name, sizeof(name)) == 0)
+	{
+		snprintf(buffer, size, "%s", name);
+	}
+#endif
+	return buffer[0] != '\0';
+}
+
+static bool thread_read_sysfs(const char* path, char* buffer, size_t size)
+{
+	FILE* file = fopen(path, "r");
+	if (!file)
+	{
+		return false;
+	}
+	bool ok = fgets(buffer, (int)size, file) != NULL;
+	fclose(file);
+	return ok;
+}
+
+// Cache sizes read like "32K" or "8M".
+static size_t thread_parse_size(const char* text)
+{
+	char* end = NULL;
+	size_t size = strtoul(text, &end, 10);
+	if (*end == 'K')
+	{
+		size *= 1024;
+	}
+	else if (*end == 'M')
+	{
+		size *= 1024 * 1024;
+	}
+	return size;
+}
+
+void thread_get_topology(thread_topology_t* topology)
+{
+	memset(topology, 0, sizeof(*topology));
+
+	// Only processors the process may run on, so masks built from the
+	// topology are always accepted.
+#if defined(__linux__)
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	bool restricted = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+#endif
+
+	// Group logical processors into cores by package and core identifier.
+	uint32_t core_keys[k_thread_max_cores];
+	int cpu_count = __min((int)sysconf(_SC_NPROCESSORS_CONF), 64);
+	for (int cpu = 0; cpu < cpu_count; ++cpu)
+	{
+#if defined(__linux__)
+		if (restricted && !CPU_ISSET(cpu, &allowed))
+		{
+			continue;
+		}
+#endif
+		char path[128];
+		char package[32];
+		char core[32];
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+		if (!thread_read_sysfs(path, package, sizeof(package)))
+		{
+			continue;
+		}
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+		if (!thread_read_sysfs(path, core, sizeof(core)))
+		{
+			continue;
+		}
+		uint32_t key = ((uint32_t)atoi(package) << 16) | (uint32_t)atoi(core);
+		int index = 0;
+		while (index < topology->core_count && core_keys[index] != key)
+		{
+			++index;
+		}
+		if (index == topology->core_count)
+		{
+			if (index == k_thread_max_cores)
+			{
+				continue;
+			}
+			core_keys[topology->core_count++] = key;
+		}
+		topology->core_masks[index] |= 1ull << cpu;
+		++topology->logical_count;
+	}
+	if (topology->core_count == 0)
+	{
+		thread_topology_flat(topology);
+	}
+
+	for (int index = 0; ; ++index)
+	{
+		char path[128];
+		char level[32];
+		char type[32];
+		char size[32];
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/level", index);
+		if (!thread_read_sysfs(path, level, sizeof(level)))
+		{
+			break;
+		}
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/type", index);
+		if (!thread_read_sysfs(path, type, sizeof(type)) || strncmp(type, "Instruction", 11) == 0)
+		{
+			continue;
+		}
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", index);
+		if (!thread_read_sysfs(path, size, sizeof(size)))
+		{
+			continue;
+		}
+		size_t* cache_size =
+			atoi(level) == 1 ? &topology->l1_data_cache_size :
+			atoi(level) == 2 ? &topology->l2_cache_size :
+			atoi(level) == 3 ? &topology->l3_cache_size : NULL;
+		if (cache_size)
+		{
+			*cache_size = thread_parse_size(size);
+		}
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/coherency_line_size", index);
+		if (topology->cache_line_size == 0 && thread_read_sysfs(path, size, sizeof(size)))
+		{
+			topology->cache_line_size = thread_parse_size(size);
+		}
+	}
+}
+
+uint64_t thread_local_alloc()
+{
+	return thread_local_alloc_ex(NULL);
+}
+
+uint64_t thread_local_alloc_ex(void (*destructor)(void* value))
+{
+	pthread_key_t key;
+	pthread_key_create(&key, destructor);
+	return (uint64_t)key;
+}
+
+void thread_local_free(uint64_t slot)
+{
+	pthread_key_delete((pthread_key_t)slot);
+}
+
+void* thread_local_get(uint64_t slot)
+{
+	return pthread_getspecific((pthread_key_t)slot);
+}
+
+void thread_local_set(uint64_t slot, void* value)
+{
+	pthread_setspecific((pthread_key_t)slot, value);
+}
+
+#endif
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 // Threading support.
@@ -7,14 +9,112 @@
 // Handle to a thread.
 typedef struct thread_t thread_t;
 
+// Scheduling priority of a thread, relative to the rest of the process.
+typedef enum thread_priority_t
+{
+	k_thread_priority_lowest = -2,
+	k_thread_priority_low = -1,
+	k_thread_priority_normal = 0,
+	k_thread_priority_high = 1,
+	k_thread_priority_highest = 2,
+} thread_priority_t;
+
+// Parameters for creating a thread with thread_create_ex.
+typedef struct thread_info_t
+{
+	// Thread begins running function with data.
+	int (*function)(void*);
+	void* data;
+	// Shown in debuggers and trace captures. May be NULL; copied.
+	const char* name;
+	// Logical processors the thread may run on, bit i for processor i.
+	// Zero lets it run on any.
+	uint64_t affinity_mask;
+	// Best effort: raising priority may need privileges on Linux.
+	thread_priority_t priority;
+	// Stack size in bytes. Zero uses the platform default.
+	size_t stack_size;
+} thread_info_t;
+
+enum
+{
+	// Most physical cores a thread_topology_t describes.
+	k_thread_max_cores = 64,
+};
+
+// Processor layout of the machine, limited to the first 64 logical
+// processors. Sizes are zero where the platform does not say.
+typedef struct thread_topology_t
+{
+	int logical_count;
+	int core_count;
+	// Logical processors of each physical core; more than one bit set
+	// where SMT siblings share the core.
+	uint64_t core_masks[k_thread_max_cores];
+	size_t cache_line_size;
+	size_t l1_data_cache_size;
+	size_t l2_cache_size;
+	size_t l3_cache_size;
+} thread_topology_t;
+
 // Creates a new thread.
 // Thread begins running function with data on return.
 thread_t* thread_create(int (*function)(void*), void* data);
 
+// Creates a new thread with explicit parameters.
+thread_t* thread_create_ex(const thread_info_t* info);
+
 // Waits for a thread to complete and destroys it.
 // Returns the thread's exit code.
-int thread_destroy(thread);
+int thread_destroy(thread_t* thread);
 
 // Puts the calling thread to sleep for the specified number of milliseconds.
 // Thread will sleep for *approximately* the specified time.
 void thread_sleep(uint32_t ms);
+
+// Gives the rest of the calling thread's time slice to another ready thread.
+void thread_yield();
+
+// Returns the number of logical processors available to the process.
+int thread_get_core_count();
+
+// Returns an identifier for the calling thread, unique among live threads.
+// On Linux this is a system call each time; see thread_get_self.
+uint32_t thread_get_id();
+
+// Returns a nonzero value naming the calling thread, unique among live
+// threads, without a system call. It is not the system's thread id; use it
+// to tag ownership, as mutexes do on every lock.
+uintptr_t thread_get_self();
+
+// Name the calling thread, as thread_info_t.name names a new one.
+void thread_set_name(const char* name);
+
+// Copy the calling thread's name into buffer, truncated to size.
+// Returns false, with an empty buffer, if the thread has no name.
+// On Linux a name keeps 15 characters, and a thread never named reports
+// the name of the thread that created it.
+bool thread_get_name(char* buffer, size_t size);
+
+// Describe the processor layout of the machine.
+void thread_get_topology(thread_topology_t* topology);
+
+// Allocate a thread-local storage slot.
+// Every thread sees its own value in the slot, initially NULL.
+uint64_t thread_local_alloc();
+
+// Allocate a thread-local storage slot whose destructor is called with a
+// thread's value, if it is not NULL, when that thread exits.
+// On Windows the slot is fiber-local: a thread running fibers sees one
+// value per fiber, and the destructor also runs as each fiber is deleted
+// and may run for every remaining value when the slot is freed.
+uint64_t thread_local_alloc_ex(void (*destructor)(void* value));
+
+// Free a thread-local storage slot.
+void thread_local_free(uint64_t slot);
+
+// Get the calling thread's value in a thread-local storage slot.
+void* thread_local_get(uint64_t slot);
+
+// Set the calling thread's value in a thread-local storage slot.
+void thread_local_set(uint64_t slot, void* value);
@@ -1,7 +1,11 @@
 #include "timer.h"
 
+#if defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#else
+#include <time.h>
+#endif
 
 static uint64_t s_ticks_start = 0;
 static double s_us_per_tick = 0.001;
@@ -26,6 +30,8 @@ uint32_t timer_ticks_to_ms(uint64_t t)
 	return (uint32_t)((double)t * s_ms_per_tick);
 }
 
+#if defined(_WIN32)
+
 uint64_t timer_get_ticks()
 {
 	LARGE_INTEGER now;
@@ -39,3 +45,20 @@ uint64_t timer_get_ticks_per_second()
 	QueryPerformanceFrequency(&freq);
 	return freq.QuadPart;
 }
+
+#else
+
+// Ticks are nanoseconds of the monotonic clock.
+uint64_t timer_get_ticks()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ull + (uint64_t)now.tv_nsec - s_ticks_start;
+}
+
+uint64_t timer_get_ticks_per_second()
+{
+	return 1000000000ull;
+}
+
+#endif
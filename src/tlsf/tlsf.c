@@ -1041,6 +1041,14 @@ void tlsf_remove_pool(tlsf_t tlsf, pool_t pool)
 	remove_free_block(control, block, fl, sl);
 }
 
+int tlsf_pool_is_empty(pool_t pool)
+{
+	block_header_t* block = offset_to_block(pool, -(int)block_header_overhead);
+
+	/* A fully free pool is a single free block followed by the sentinel. */
+	return block_is_free(block) && block_size(block_next(block)) == 0;
+}
+
 /*
 ** TLSF main interface.
 */
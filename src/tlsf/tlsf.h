@@ -58,6 +58,8 @@ pool_t tlsf_get_pool(tlsf_t tlsf);
 /* Add/remove memory pools. */
 pool_t tlsf_add_pool(tlsf_t tlsf, void* mem, size_t bytes);
 void tlsf_remove_pool(tlsf_t tlsf, pool_t pool);
+/* Returns nonzero if every byte of the pool is free, so it can be removed. */
+int tlsf_pool_is_empty(pool_t pool);
 
 /* malloc/memalign/realloc/free replacements. */
 void* tlsf_malloc(tlsf_t tlsf, size_t bytes);
@@ -7,12 +7,31 @@
 #include "fs.h"
 #include "mutex.h"
 #include "debug.h"
+#include "thread.h"
 
 #include <stddef.h>
 #include <stdio.h>
 
+#if defined(_WIN32)
 #define WIN32_LEAN_AND_MEAN
 #include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+enum
+{
+	// Threads labeled by name in one capture; later ones go unlabeled.
+	k_trace_max_named_threads = 64,
+	k_trace_thread_name_size = 32,
+};
+
+// A thread seen during a capture, with its name if it has one.
+typedef struct trace_thread_t
+{
+	int tid;
+	char name[k_trace_thread_name_size];
+} trace_thread_t;
 
 typedef struct trace_t
 {
@@ -24,6 +43,10 @@ typedef struct trace_t
 	size_t event_capacity;
 	int event_buff_count;
 	bool capturing;
+	// Names are copied as each thread records its first event, since a
+	// thread may have exited by the time the capture stops.
+	int thread_count;
+	trace_thread_t threads[k_trace_max_named_threads];
 } trace_t;
 
 typedef struct trace_event_t
@@ -33,11 +56,21 @@ typedef struct trace_event_t
 	int pid;
 	int tid;
 	uint64_t ts;
+	int64_t value;
 } trace_event_t;
 
+static int trace_get_process_id()
+{
+#if defined(_WIN32)
+	return (int)GetCurrentProcessId();
+#else
+	return (int)getpid();
+#endif
+}
+
 trace_t* trace_create(heap_t* heap, int event_capacity)
 {
-	trace_t* t = heap_alloc(heap, sizeof(t), 8);
+	trace_t* t = heap_alloc(heap, sizeof(trace_t), 8);
 	t->heap = heap;
 	t->event_queue = queue_create(heap, event_capacity);
 	t->mutex = mutex_create();
@@ -45,6 +78,7 @@ trace_t* trace_create(heap_t* heap, int event_capacity)
 	t->event_capacity = (size_t)event_capacity;
 	t->event_buff_count = 0;
 	t->capturing = false;
+	t->thread_count = 0;
 	return t;
 }
 
@@ -57,6 +91,25 @@ void trace_destroy(trace_t* trace)
 	heap_free(trace->heap, trace);
 }
 
+// Remember the calling thread's name for the capture.
+// Must be called with the trace mutex held.
+static void trace_note_thread(trace_t* trace, int tid)
+{
+	for (int i = 0; i < trace->thread_count; ++i)
+	{
+		if (trace->threads[i].tid == tid)
+		{
+			return;
+		}
+	}
+	if (trace->thread_count < k_trace_max_named_threads)
+	{
+		trace_thread_t* thread = &trace->threads[trace->thread_count++];
+		thread->tid = tid;
+		thread_get_name(thread->name, sizeof(thread->name));
+	}
+}
+
 void trace_duration_push(trace_t* trace, const char* name)
 {
 	mutex_lock(trace->mutex);
@@ -65,8 +118,9 @@ void trace_duration_push(trace_t* trace, const char* name)
 		trace_event_t* ev = (trace_event_t*)(trace->event_buff + (trace->event_buff_count * sizeof(trace_event_t)));
 		ev->name = name;
 		ev->ph = 'B';
-		ev->pid = GetCurrentProcessId();
-		ev->tid = GetCurrentThreadId();
+		ev->pid = trace_get_process_id();
+		ev->tid = thread_get_id();
+		trace_note_thread(trace, ev->tid);
 		ev->ts = timer_get_ticks();
 		trace->event_buff_count++;
 		queue_push(trace->event_queue, ev);
@@ -91,11 +145,53 @@ void trace_duration_pop(trace_t* trace)
 	mutex_unlock(trace->mutex);
 }
 
+void trace_counter(trace_t* trace, const char* name, int64_t value)
+{
+	mutex_lock(trace->mutex);
+	if (trace->capturing && (size_t)trace->event_buff_count < trace->event_capacity * 2)
+	{
+		trace_event_t* ev = (trace_event_t*)(trace->event_buff + (trace->event_buff_count * sizeof(trace_event_t)));
+		ev->name = name;
+		ev->ph = 'C';
+		ev->pid = trace_get_process_id();
+		ev->tid = thread_get_id();
+		trace_note_thread(trace, ev->tid);
+		ev->ts = timer_get_ticks();
+		ev->value = value;
+		trace->event_buff_count++;
+	}
+	mutex_unlock(trace->mutex);
+}
+
+// Format one event as a line of the Chrome trace JSON.
+// Follows snprintf conventions: pass a NULL buffer to measure the line.
+static int trace_format_event(char* buffer, size_t size, const trace_event_t* ev, bool last)
+{
+	if (ev->ph == 'C')
+	{
+		return snprintf(buffer, size, "\t\t{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":\"%d\",\"ts\":\"%d\",\"args\":{\"value\":%lld}}%s\n",
+			ev->name, ev->ph, ev->pid, ev->tid, (int)ev->ts, (long long)ev->value, last ? "" : ",");
+	}
+	return snprintf(buffer, size, "\t\t{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":\"%d\",\"ts\":\"%d\"}%s\n",
+		ev->name, ev->ph, ev->pid, ev->tid, (int)ev->ts, last ? "" : ",");
+}
+
+// Format the metadata event that labels a thread's track with its name.
+// Always followed by an event line.
+static int trace_format_thread_name(char* buffer, size_t size, const trace_thread_t* thread)
+{
+	return snprintf(buffer, size, "\t\t{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":\"%d\",\"args\":{\"name\":\"%s\"}},\n",
+		trace_get_process_id(), thread->tid, thread->name);
+}
+
 void trace_capture_start(trace_t* trace, const char* path)
 {
 	if (!trace->capturing) {
+		mutex_lock(trace->mutex);
+		trace->thread_count = 0;
 		trace->capturing = true;
 		trace->file_path = path;
+		mutex_unlock(trace->mutex);
 	}
 }
 
@@ -104,54 +200,50 @@ void trace_capture_stop(trace_t* trace)
 	if (trace->capturing) {
 		fs_t* f = fs_create(trace->heap, 1);
 		trace->capturing = false;
-		int str_size = 0;
-		str_size += snprintf(NULL, 0, "{\n\t\"displayTimeUnit\": \"ns\", \"traceEvents\" : [\n");
-		int first_line = str_size;
-		//debug_print(k_print_info, "{\n\t\"displayTimeUnit\": \"ns\", \"traceEvents\" : [\n");
-		for (int i = 0; i < trace->event_buff_count; i++) {
-			trace_event_t* ev = (trace_event_t*)(trace->event_buff + (i * sizeof(trace_event_t)));
-			if (i == trace->event_buff_count - 1) {
-				str_size += snprintf(NULL, 0, "\t\t{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":\"%d\",\"ts\":\"%d\"}\n",
-					ev->name, ev->ph, ev->pid, ev->tid, (int)ev->ts);
-				//debug_print(k_print_info, "\t\t{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":\"%d\",\"ts\":\"%d\"}\n",
-				//	ev->name, ev->ph, ev->pid, ev->tid, (int)ev->ts);
-			}
-			else {
-				str_size += snprintf(NULL, 0, "\t\t{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":\"%d\",\"ts\":\"%d\"},\n",
-									ev->name, ev->ph, ev->pid, ev->tid, (int)ev->ts);
-				//debug_print(k_print_info, "\t\t{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":\"%d\",\"ts\":\"%d\"},\n",
-				//	ev->name, ev->ph, ev->pid, ev->tid, (int)ev->ts);
+
+		// Format each line straight into the buffer, growing it when a line
+		// does not fit. heap_realloc usually extends the buffer in place.
+		size_t capacity = 4096;
+		size_t str_size = 0;
+		char* buffer = heap_alloc(trace->heap, capacity, 8);
+
+		// Named threads that recorded events get a metadata line each, ahead
+		// of the events.
+		const trace_thread_t* named[k_trace_max_named_threads];
+		int named_count = 0;
+		for (int i = 0; i < trace->thread_count; i++) {
+			if (trace->threads[i].name[0]) {
+				named[named_count++] = &trace->threads[i];
 			}
 		}
-		int last_line = snprintf(NULL, 0, "\t]\n}\0");
-		str_size += last_line;
-		//debug_print(k_print_info, "\t]\n}\0");
-		//debug_print(k_print_info, "str_size = %d", str_size);
-
-		char* buffer = heap_alloc(trace->heap, str_size, 8);
-		int current_pos = first_line;
-		snprintf(buffer, (first_line + 1), "{\n\t\"displayTimeUnit\": \"ns\", \"traceEvents\" : [\n");
-		for (int j = 0; j < trace->event_buff_count; j++) {
-			trace_event_t* ev = (trace_event_t*)(trace->event_buff + (j * sizeof(trace_event_t)));
-			int line_size = 0;
-
-			if (j == trace->event_buff_count - 1) {
-				line_size = snprintf(NULL, 0, "\t\t{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":\"%d\",\"ts\":\"%d\"}\n\0",
-					ev->name, ev->ph, ev->pid, ev->tid, (int)ev->ts);
-				snprintf((buffer + current_pos), (line_size + 1), 
-					"\t\t{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":\"%d\",\"ts\":\"%d\"}\n\0",
-					ev->name, ev->ph, ev->pid, ev->tid, (int)ev->ts);
-			}
-			else {
-				line_size = snprintf(NULL, 0, "\t\t{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":\"%d\",\"ts\":\"%d\"},\n\0",
-					ev->name, ev->ph, ev->pid, ev->tid, (int)ev->ts);
-				snprintf((buffer + current_pos), (line_size + 1), 
-					"\t\t{\"name\":\"%s\",\"ph\":\"%c\",\"pid\":%d,\"tid\":\"%d\",\"ts\":\"%d\"},\n\0",
-					ev->name, ev->ph, ev->pid, ev->tid, (int)ev->ts);
+
+		int line_count = named_count + trace->event_buff_count;
+		for (int i = -1; i <= line_count; i++) {
+			int line_size;
+			while (true) {
+				char* line = buffer + str_size;
+				size_t remaining = capacity - str_size;
+				if (i < 0) {
+					line_size = snprintf(line, remaining, "{\n\t\"displayTimeUnit\": \"ns\", \"traceEvents\" : [\n");
+				}
+				else if (i == line_count) {
+					line_size = snprintf(line, remaining, "\t]\n}");
+				}
+				else if (i < named_count) {
+					line_size = trace_format_thread_name(line, remaining, named[i]);
+				}
+				else {
+					trace_event_t* ev = (trace_event_t*)(trace->event_buff + ((i - named_count) * sizeof(trace_event_t)));
+					line_size = trace_format_event(line, remaining, ev, i == line_count - 1);
+				}
+				if ((size_t)line_size < remaining) {
+					break;
+				}
+				capacity = __max(capacity * 2, str_size + line_size + 1);
+				buffer = heap_realloc(trace->heap, buffer, capacity, 8);
 			}
-			current_pos += line_size;
+			str_size += line_size;
 		}
-		snprintf((buffer + current_pos), (last_line + 1), "\t]\n}\0");
 
 		fs_work_t* w = fs_write(f, trace->file_path, buffer, str_size, false);
 		fs_work_wait(w);
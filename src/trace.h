@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdint.h>
+
 typedef struct heap_t heap_t;
 
 typedef struct trace_t trace_t;
@@ -18,6 +20,11 @@ void trace_duration_push(trace_t* trace, const char* name);
 // End tracing the currently active duration on the current thread.
 void trace_duration_pop(trace_t* trace);
 
+// Record the current value of a named counter.
+// Counters show up as their own tracks in the trace viewer.
+// The name must remain valid until the capture is stopped.
+void trace_counter(trace_t* trace, const char* name, int64_t value);
+
 // Start recording trace events.
 // A Chrome trace file will be written to path.
 void trace_capture_start(trace_t* trace, const char* path);
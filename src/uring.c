@@ -0,0 +1,320 @@
+#include "uring.h"
+
+#include "atomic.h"
+#include "heap.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+enum
+{
+	k_uring_max_buffers = 64,
+};
+
+typedef struct uring_t
+{
+	heap_t* heap;
+	int fd;
+
+	// Mappings shared with the kernel.
+	void* rings;
+	size_t rings_size;
+	struct io_uring_sqe* sqes;
+	size_t sqes_size;
+
+	// Submission ring: the kernel consumes from head, we produce at tail.
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_array;
+	unsigned sq_mask;
+	unsigned sq_entries;
+	// Entries queued but not yet published to the kernel.
+	unsigned sq_local_tail;
+
+	// Completion ring: the kernel produces at tail, we consume from head.
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	struct io_uring_cqe* cqes;
+	unsigned cq_mask;
+} uring_t;
+
+static int uring_setup(unsigned entries, struct io_uring_params* params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, const void* arg, unsigned count)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, count);
+}
+
+// Every operation fs issues must be supported, or the ring is no use.
+static bool uring_probe(int fd)
+{
+	static const int k_ops[] =
+	{
+		IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_READ_FIXED, IORING_OP_WRITE, IORING_OP_CLOSE,
+	};
+	char storage[sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op)];
+	memset(storage, 0, sizeof(storage));
+	struct io_uring_probe* probe = (struct io_uring_probe*)storage;
+	if (uring_register(fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+	{
+		return false;
+	}
+	for (int i = 0; i < _countof(k_ops); ++i)
+	{
+		if (k_ops[i] > probe->last_op || !(probe->ops[k_ops[i]].flags & IO_URING_OP_SUPPORTED))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+uring_t* uring_create(heap_t* heap, int entries)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CLAMP;
+	int fd = uring_setup((unsigned)entries, &params);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+	// Kernels old enough to need separate ring mappings lack the
+	// operations used here anyway.
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !uring_probe(fd))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	size_t rings_size = __max(sq_size, cq_size);
+	void* rings = mmap(NULL, rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (rings == MAP_FAILED)
+	{
+		close(fd);
+		return NULL;
+	}
+	size_t sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	void* sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED)
+	{
+		munmap(rings, rings_size);
+		close(fd);
+		return NULL;
+	}
+
+	uring_t* ring = heap_alloc(heap, sizeof(uring_t), 8);
+	ring->heap = heap;
+	ring->fd = fd;
+	ring->rings = rings;
+	ring->rings_size = rings_size;
+	ring->sqes = sqes;
+	ring->sqes_size = sqes_size;
+	ring->sq_head = (unsigned*)((char*)rings + params.sq_off.head);
+	ring->sq_tail = (unsigned*)((char*)rings + params.sq_off.tail);
+	ring->sq_array = (unsigned*)((char*)rings + params.sq_off.array);
+	ring->sq_mask = *(unsigned*)((char*)rings + params.sq_off.ring_mask);
+	ring->sq_entries = params.sq_entries;
+	ring->sq_local_tail = *ring->sq_tail;
+	ring->cq_head = (unsigned*)((char*)rings + params.cq_off.head);
+	ring->cq_tail = (unsigned*)((char*)rings + params.cq_off.tail);
+	ring->cqes = (struct io_uring_cqe*)((char*)rings + params.cq_off.cqes);
+	ring->cq_mask = *(unsigned*)((char*)rings + params.cq_off.ring_mask);
+	return ring;
+}
+
+void uring_destroy(uring_t* ring)
+{
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->rings, ring->rings_size);
+	close(ring->fd);
+	heap_free(ring->heap, ring);
+}
+
+bool uring_register_buffers(uring_t* ring, void* const* buffers, const size_t* sizes, int count)
+{
+	struct iovec iovecs[k_uring_max_buffers];
+	if (count > k_uring_max_buffers)
+	{
+		return false;
+	}
+	for (int i = 0; i < count; ++i)
+	{
+		iovecs[i].iov_base = buffers[i];
+		iovecs[i].iov_len = sizes[i];
+	}
+	return uring_register(ring->fd, IORING_REGISTER_BUFFERS, iovecs, (unsigned)count) == 0;
+}
+
+bool uring_register_file_slots(uring_t* ring, int count)
+{
+	struct io_uring_rsrc_register files;
+	memset(&files, 0, sizeof(files));
+	files.nr = (unsigned)count;
+	files.flags = IORING_RSRC_REGISTER_SPARSE;
+	return uring_register(ring->fd, IORING_REGISTER_FILES2, &files, sizeof(files)) == 0;
+}
+
+// Claim the next submission entry, cleared, or NULL if the ring is full.
+static struct io_uring_sqe* uring_get_sqe(uring_t* ring, uint8_t opcode, uint64_t user_data)
+{
+	unsigned head = (unsigned)atomic_load_explicit((int*)ring->sq_head, k_atomic_order_acquire);
+	if (ring->sq_local_tail - head >= ring->sq_entries)
+	{
+		return NULL;
+	}
+	unsigned index = ring->sq_local_tail & ring->sq_mask;
+	struct io_uring_sqe* sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->user_data = user_data;
+	ring->sq_array[index] = index;
+	ring->sq_local_tail++;
+	return sqe;
+}
+
+bool uring_openat(uring_t* ring, const char* path, int flags, int mode, int slot, uint64_t user_data)
+{
+	struct io_uring_sqe* sqe = uring_get_sqe(ring, IORING_OP_OPENAT, user_data);
+	if (!sqe)
+	{
+		return false;
+	}
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uint64_t)(uintptr_t)path;
+	sqe->len = (uint32_t)mode;
+	// Slots are never inherited, and the kernel refuses O_CLOEXEC for them.
+	sqe->open_flags = (uint32_t)(slot >= 0 ? flags & ~O_CLOEXEC : flags);
+	// Zero means a plain descriptor, so slots are stored one up.
+	sqe->file_index = slot >= 0 ? (uint32_t)slot + 1 : 0;
+	return true;
+}
+
+bool uring_statx(uring_t* ring, const char* path, struct statx* statx, uint64_t user_data)
+{
+	struct io_uring_sqe* sqe = uring_get_sqe(ring, IORING_OP_STATX, user_data);
+	if (!sqe)
+	{
+		return false;
+	}
+	sqe->fd = AT_FDCWD;
+	sqe->addr = (uint64_t)(uintptr_t)path;
+	sqe->len = STATX_SIZE;
+	sqe->off = (uint64_t)(uintptr_t)statx;
+	return true;
+}
+
+bool uring_read(uring_t* ring, int fd, bool fixed_file, void* buffer, uint32_t size, uint64_t offset, int buffer_index, uint64_t user_data)
+{
+	struct io_uring_sqe* sqe = uring_get_sqe(ring, buffer_index >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ, user_data);
+	if (!sqe)
+	{
+		return false;
+	}
+	sqe->fd = fd;
+	sqe->flags = fixed_file ? IOSQE_FIXED_FILE : 0;
+	sqe->addr = (uint64_t)(uintptr_t)buffer;
+	sqe->len = size;
+	sqe->off = offset;
+	sqe->buf_index = buffer_index >= 0 ? (uint16_t)buffer_index : 0;
+	return true;
+}
+
+bool uring_write(uring_t* ring, int fd, bool fixed_file, const void* buffer, uint32_t size, uint64_t offset, uint64_t user_data)
+{
+	struct io_uring_sqe* sqe = uring_get_sqe(ring, IORING_OP_WRITE, user_data);
+	if (!sqe)
+	{
+		return false;
+	}
+	sqe->fd = fd;
+	sqe->flags = fixed_file ? IOSQE_FIXED_FILE : 0;
+	sqe->addr = (uint64_t)(uintptr_t)buffer;
+	sqe->len = size;
+	sqe->off = offset;
+	return true;
+}
+
+bool uring_close(uring_t* ring, int fd, bool fixed_file, uint64_t user_data)
+{
+	struct io_uring_sqe* sqe = uring_get_sqe(ring, IORING_OP_CLOSE, user_data);
+	if (!sqe)
+	{
+		return false;
+	}
+	sqe->fd = fixed_file ? 0 : fd;
+	sqe->file_index = fixed_file ? (uint32_t)fd + 1 : 0;
+	return true;
+}
+
+int uring_submit(uring_t* ring, int wait_count)
+{
+	// Publish the queued entries before the kernel looks at the tail.
+	atomic_store_explicit((int*)ring->sq_tail, (int)ring->sq_local_tail, k_atomic_order_release);
+
+	unsigned flags = wait_count > 0 ? IORING_ENTER_GETEVENTS : 0;
+	while (true)
+	{
+		// Everything published that the kernel has not consumed, including
+		// entries an earlier call left behind.
+		unsigned head = (unsigned)atomic_load_explicit((int*)ring->sq_head, k_atomic_order_acquire);
+		unsigned to_submit = ring->sq_local_tail - head;
+		if (to_submit == 0 && wait_count == 0)
+		{
+			return 0;
+		}
+
+		int result = uring_enter(ring->fd, to_submit, (unsigned)wait_count, flags);
+		if (result < 0)
+		{
+			if (errno != EINTR)
+			{
+				return -errno;
+			}
+			continue;
+		}
+		if ((unsigned)result >= to_submit)
+		{
+			return 0;
+		}
+		// The kernel took only some entries. Hand it the rest, unless it
+		// took none, in which case the next call tries again.
+		if (result == 0)
+		{
+			return -EAGAIN;
+		}
+	}
+}
+
+int uring_reap(uring_t* ring, uring_completion_t* completions, int max_count)
+{
+	unsigned head = *ring->cq_head;
+	unsigned tail = (unsigned)atomic_load_explicit((int*)ring->cq_tail, k_atomic_order_acquire);
+	int count = 0;
+	for (; head != tail && count < max_count; ++head, ++count)
+	{
+		struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+		completions[count].user_data = cqe->user_data;
+		completions[count].result = cqe->res;
+	}
+	atomic_store_explicit((int*)ring->cq_head, (int)head, k_atomic_order_release);
+	return count;
+}
+
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Linux io_uring submission and completion rings, used directly through
+// system calls. Linux only; not part of the Windows build.
+//
+// Operations are queued in the submission ring and handed to the kernel
+// in batches by uring_submit; their results come back in the completion
+// ring, tagged with the user_data they were queued with. One thread at a
+// time may use a ring.
+//
+// Fixed files and registered buffers skip the per-operation file table
+// lookup and page pinning. A fixed file is a slot in the ring's own file
+// table, opened straight into the slot by uring_openat.
+
+// Handle to a ring.
+typedef struct uring_t uring_t;
+
+typedef struct heap_t heap_t;
+struct statx;
+
+typedef struct uring_completion_t
+{
+	uint64_t user_data;
+	// The operation's return value, or a negative errno.
+	int result;
+} uring_completion_t;
+
+// Create a ring with room for entries queued operations.
+// Returns NULL where io_uring or the operations used here are unavailable:
+// kernels before 5.6, or kernels and sandboxes that disable io_uring.
+uring_t* uring_create(heap_t* heap, int entries);
+
+// Destroy a ring. Operations still in flight are abandoned.
+void uring_destroy(uring_t* ring);
+
+// Register buffers for uring_read with a buffer index.
+// Returns false if the kernel refused, for example over the locked
+// memory limit.
+bool uring_register_buffers(uring_t* ring, void* const* buffers, const size_t* sizes, int count);
+
+// Register a table of count empty fixed file slots.
+// Returns false if the kernel does not support opening into slots.
+bool uring_register_file_slots(uring_t* ring, int count);
+
+// Queue operations. Each returns false if the submission ring is full;
+// submit and try again. Completions report user_data and the result.
+
+// Open a file. With slot of zero or more, opens into that fixed file slot
+// and completes with zero; otherwise completes with a descriptor.
+bool uring_openat(uring_t* ring, const char* path, int flags, int mode, int slot, uint64_t user_data);
+
+// Fill statx with the size of the file at path.
+bool uring_statx(uring_t* ring, const char* path, struct statx* statx, uint64_t user_data);
+
+// Read size bytes at offset. fd is a fixed file slot if fixed_file is set.
+// With buffer_index of zero or more, buffer lies in that registered buffer.
+bool uring_read(uring_t* ring, int fd, bool fixed_file, void* buffer, uint32_t size, uint64_t offset, int buffer_index, uint64_t user_data);
+
+// Write size bytes at offset. fd is a fixed file slot if fixed_file is set.
+bool uring_write(uring_t* ring, int fd, bool fixed_file, const void* buffer, uint32_t size, uint64_t offset, uint64_t user_data);
+
+// Close a descriptor, or free a fixed file slot if fixed_file is set.
+bool uring_close(uring_t* ring, int fd, bool fixed_file, uint64_t user_data);
+
+// Hand queued operations to the kernel and block until at least
+// wait_count completions are ready. Operations the kernel does not take
+// at once are handed over again, here or by the next call.
+// Returns zero or a negative errno; EINTR is retried.
+int uring_submit(uring_t* ring, int wait_count);
+
+// Take up to max_count completions. Never blocks.
+// Returns the number taken.
+int uring_reap(uring_t* ring, uring_completion_t* completions, int max_count);
@@ -0,0 +1,141 @@
+#include "vm.h"
+
+#if defined(_WIN32)
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#pragma comment(lib, "advapi32.lib")
+
+size_t vm_page_size()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwPageSize;
+}
+
+void* vm_reserve(size_t size)
+{
+	return VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_NOACCESS);
+}
+
+bool vm_commit(void* address, size_t size)
+{
+	return VirtualAlloc(address, size, MEM_COMMIT, PAGE_READWRITE) != NULL;
+}
+
+void vm_decommit(void* address, size_t size)
+{
+	VirtualFree(address, size, MEM_DECOMMIT);
+}
+
+void vm_release(void* address, size_t size)
+{
+	VirtualFree(address, 0, MEM_RELEASE);
+}
+
+static bool vm_enable_lock_memory_privilege()
+{
+	HANDLE token;
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token))
+	{
+		return false;
+	}
+	TOKEN_PRIVILEGES privileges = { .PrivilegeCount = 1 };
+	privileges.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+	// AdjustTokenPrivileges succeeds even if the privilege was not granted.
+	bool enabled = LookupPrivilegeValue(NULL, SE_LOCK_MEMORY_NAME, &privileges.Privileges[0].Luid) &&
+		AdjustTokenPrivileges(token, FALSE, &privileges, 0, NULL, NULL) &&
+		GetLastError() == ERROR_SUCCESS;
+	CloseHandle(token);
+	return enabled;
+}
+
+size_t vm_large_page_size()
+{
+	return vm_enable_lock_memory_privilege() ? GetLargePageMinimum() : 0;
+}
+
+void* vm_map_large_pages(size_t size)
+{
+	return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+}
+
+void vm_advise_large_pages(void* address, size_t size)
+{
+	// Windows has no transparent large pages.
+}
+
+#else
+
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+size_t vm_page_size()
+{
+	return (size_t)sysconf(_SC_PAGESIZE);
+}
+
+void* vm_reserve(size_t size)
+{
+	void* address = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return address == MAP_FAILED ? NULL : address;
+}
+
+bool vm_commit(void* address, size_t size)
+{
+	return mprotect(address, size, PROT_READ | PROT_WRITE) == 0;
+}
+
+void vm_decommit(void* address, size_t size)
+{
+	// Drop the pages first so they are zero if committed again.
+	madvise(address, size, MADV_DONTNEED);
+	mprotect(address, size, PROT_NONE);
+}
+
+void vm_release(void* address, size_t size)
+{
+	munmap(address, size);
+}
+
+size_t vm_large_page_size()
+{
+	size_t size = 0;
+	FILE* meminfo = fopen("/proc/meminfo", "r");
+	if (meminfo)
+	{
+		char line[128];
+		unsigned long kilobytes;
+		while (fgets(line, sizeof(line), meminfo))
+		{
+			if (sscanf(line, "Hugepagesize: %lu kB", &kilobytes) == 1)
+			{
+				size = (size_t)kilobytes * 1024;
+				break;
+			}
+		}
+		fclose(meminfo);
+	}
+	return size;
+}
+
+void* vm_map_large_pages(size_t size)
+{
+#if defined(MAP_HUGETLB)
+	// Fails unless pages were set aside in /proc/sys/vm/nr_hugepages.
+	void* address = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	return address == MAP_FAILED ? NULL : address;
+#else
+	return NULL;
+#endif
+}
+
+void vm_advise_large_pages(void* address, size_t size)
+{
+#if defined(MADV_HUGEPAGE)
+	madvise(address, size, MADV_HUGEPAGE);
+#endif
+}
+
+#endif
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Virtual memory
+//
+// Thin layer over the OS virtual memory API. Address space is reserved up
+// front and physical memory is committed to it page by page as needed.
+// All sizes and addresses should be multiples of vm_page_size().
+
+// Returns the size of an OS page in bytes.
+size_t vm_page_size();
+
+// Reserve a range of address space without backing it with memory.
+// Returns NULL on failure.
+void* vm_reserve(size_t size);
+
+// Back a previously reserved range with zeroed, read-write memory.
+// Returns false if the OS is out of memory.
+bool vm_commit(void* address, size_t size);
+
+// Return the memory backing a committed range to the OS.
+// The address range stays reserved and may be committed again.
+void vm_decommit(void* address, size_t size);
+
+// Release an entire reservation made with vm_reserve or vm_map_large_pages.
+void vm_release(void* address, size_t size);
+
+// Returns the size of a large page in bytes, or zero if the OS does not
+// offer them. On Windows this enables the lock memory privilege, which the
+// user must have been granted.
+size_t vm_large_page_size();
+
+// Reserve and commit a range backed by large pages, which stay resident.
+// The size must be a multiple of vm_large_page_size().
+// Returns NULL if no large pages are available; fall back to vm_reserve.
+void* vm_map_large_pages(size_t size);
+
+// Ask the OS to back a committed range with large pages transparently,
+// where supported (Linux transparent huge pages). Otherwise does nothing.
+void vm_advise_large_pages(void* address, size_t size);